@@ -0,0 +1,517 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "kserialize.h"
+#include "kser_view.h"
+#include "kser_pool.h"
+#include "kser_stats.h"
+
+#if defined(OS_LINUX)
+#include <sys/resource.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// benchmark of the engine on synthetic trees. every tree is generated from a fixed seed, so two
+// runs with the same arguments measure the same files; a tree is kept in the work folder and
+// only generated again when its parameters change. each scenario serializes its tree and
+// extracts the archive again, timing every phase on its own:
+//   scan     process_directory and the stat of the input
+//   sort     entry_table::sort_by_name
+//   write    payloads and index (write_fso_map_to_file)
+//   parse    opening the archive and checking its index (KserView)
+//   extract  create_files: directories, file data, permissions
+// the result is one json document on stdout (or --json file), a readable table goes to stderr.
+// peak rss and read/write syscall counts (syscr/syscw of /proc/self/io, which io_uring
+// operations and getdents don't show up in; the scan counts its own) are per phase on linux,
+// 0 elsewhere. the engine's own stats (kser_stats.h) of write and extract are added as
+// "engine", which splits them further: dedup, sparse, payloads and index; directories, files
+// and permissions, with the file latency histogram and the slowest files.
+
+static void print_usage() {
+    std::cerr <<
+        "usage:\n"
+        "  kser_bench [scenario ...] [--dir folder] [--scale factor] [--json file] [-j threads] [-c codec] [--io backend] [--dedup]\n"
+        "      scenarios: empty (1M empty files), small (100k 4 KiB files), large (3 files of 2 GiB),\n"
+        "      deep (32 chains of 256 nested folders), sparse (64 sparse files of 1 GiB). default: all.\n"
+        "      --dir is where trees, archives and extracted copies go (default: temp folder/kser_bench).\n"
+        "      --scale multiplies file counts and the size of large and sparse files, e.g. 0.01 for a quick run.\n"
+        "      -j, -c, --io and --dedup are passed to the engine like in kser.\n";
+}
+
+// xorshift64*, the same stream of bytes on every platform
+class bench_random {
+public:
+    explicit bench_random(uint64_t seed) : state_(seed * 0x9e3779b97f4a7c15ull + 1) {}
+
+    uint64_t next() {
+        state_ ^= state_ >> 12;
+        state_ ^= state_ << 25;
+        state_ ^= state_ >> 27;
+        return state_ * 0x2545f4914f6cdd1dull;
+    }
+
+private:
+    uint64_t state_;
+};
+
+// about half compressible: runs of words alternate with random bytes
+static void fill_data(bench_random& random, char* data, size_t size) {
+    static const char* const words[] = { "permissions ", "serialize ", "directory ", "kser ", "file ", "owner " };
+    size_t pos = 0;
+    while (pos < size) {
+        uint64_t r = random.next();
+        size_t run = std::min<size_t>(size - pos, 64 + r % 192);
+        if (r & (1ull << 40)) {
+            for (size_t k = 0; k < run; k++) {
+                data[pos + k] = static_cast<char>(random.next());
+            }
+        }
+        else {
+            const char* word = words[(r >> 8) % 6];
+            size_t length = std::strlen(word);
+            for (size_t k = 0; k < run; k++) {
+                data[pos + k] = word[k % length];
+            }
+        }
+        pos += run;
+    }
+}
+
+static void write_file(const fs::path& path, bench_random& random, uint64_t size) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw_u8string_error(u8"failed to create " + path.u8string());
+    }
+    std::vector<char> buffer(static_cast<size_t>(std::min<uint64_t>(size, 1 << 20)));
+    for (uint64_t left = size; left > 0;) {
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(left, buffer.size()));
+        fill_data(random, buffer.data(), chunk);
+        out.write(buffer.data(), static_cast<std::streamsize>(chunk));
+        left -= chunk;
+    }
+    if (!out) {
+        throw_u8string_error(u8"failed to write " + path.u8string());
+    }
+}
+
+struct scenario {
+    std::string name;
+    // what the generator was asked for, stored next to the tree to tell whether it can be reused
+    std::string parameters;
+    void (*generate)(const fs::path& root, double scale);
+};
+
+static uint64_t scaled(uint64_t value, double scale) {
+    return std::max<uint64_t>(1, static_cast<uint64_t>(static_cast<double>(value) * scale));
+}
+
+// prefix followed by n, built in place (operator+ on a literal trips -Wrestrict in gcc 12)
+static std::string numbered(const char* prefix, uint64_t n) {
+    std::string name = prefix;
+    name += std::to_string(n);
+    return name;
+}
+
+// files spread over folders of at most 1000 entries
+static void generate_flat(const fs::path& root, uint64_t files, uint64_t size) {
+    bench_random random(files);
+    for (uint64_t i = 0; i < files; i++) {
+        fs::path folder = root / numbered("d", i / 1000);
+        if (i % 1000 == 0) {
+            fs::create_directories(folder);
+        }
+        write_file(folder / numbered("f", i), random, size);
+    }
+}
+
+static void generate_empty(const fs::path& root, double scale) {
+    generate_flat(root, scaled(1000000, scale), 0);
+}
+
+static void generate_small(const fs::path& root, double scale) {
+    generate_flat(root, scaled(100000, scale), 4096);
+}
+
+static void generate_large(const fs::path& root, double scale) {
+    bench_random random(3);
+    fs::create_directories(root);
+    for (int i = 0; i < 3; i++) {
+        write_file(root / numbered("large", i), random, scaled(2ull << 30, scale));
+    }
+}
+
+static void generate_deep(const fs::path& root, double scale) {
+    bench_random random(256);
+    uint64_t chains = scaled(32, scale);
+    for (uint64_t c = 0; c < chains; c++) {
+        fs::path folder = root / numbered("chain", c);
+        for (int level = 0; level < 256; level++) {
+            folder /= numbered("l", level);
+            fs::create_directories(folder);
+            write_file(folder / "f", random, 1024);
+        }
+    }
+}
+
+// 16 extents of 64 KiB spread over each file, the rest are holes
+static void generate_sparse(const fs::path& root, double scale) {
+    bench_random random(64);
+    fs::create_directories(root);
+    uint64_t files = scaled(64, scale);
+    uint64_t size = std::max<uint64_t>(scaled(1ull << 30, scale), 16 << 20);
+    std::vector<char> extent(64 << 10);
+    for (uint64_t i = 0; i < files; i++) {
+        fs::path path = root / numbered("sparse", i);
+        {
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            for (uint64_t k = 0; k < 16; k++) {
+                fill_data(random, extent.data(), extent.size());
+                out.seekp(static_cast<std::streamoff>(size / 16 * k));
+                out.write(extent.data(), static_cast<std::streamsize>(extent.size()));
+            }
+            if (!out) {
+                throw_u8string_error(u8"failed to write " + path.u8string());
+            }
+        }
+        fs::resize_file(path, size);
+    }
+}
+
+struct phase_result {
+    std::string name;
+    double seconds = 0;
+    uint64_t peak_rss_kb = 0;
+    uint64_t read_syscalls = 0;
+    uint64_t write_syscalls = 0;
+};
+
+struct process_counters {
+    uint64_t read_syscalls = 0;
+    uint64_t write_syscalls = 0;
+};
+
+static process_counters read_counters() {
+    process_counters counters;
+#if defined(OS_LINUX)
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    uint64_t value;
+    while (io >> key >> value) {
+        if (key == "syscr:") {
+            counters.read_syscalls = value;
+        }
+        else if (key == "syscw:") {
+            counters.write_syscalls = value;
+        }
+    }
+#endif
+    return counters;
+}
+
+// reading /proc/self/io takes read syscalls of its own, measured once and taken off every phase
+static process_counters counter_overhead() {
+    process_counters before = read_counters();
+    process_counters after = read_counters();
+    return { after.read_syscalls - before.read_syscalls, after.write_syscalls - before.write_syscalls };
+}
+
+// the high-water mark of the resident set can be reset on linux, so every phase gets its own
+// peak. where that is refused the process-wide peak is reported
+static void reset_peak_rss() {
+#if defined(OS_LINUX)
+    std::ofstream clear("/proc/self/clear_refs");
+    clear << "5";
+#endif
+}
+
+static uint64_t peak_rss_kb() {
+#if defined(OS_LINUX)
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) {
+            return std::stoull(line.substr(6));
+        }
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+    return 0;
+#endif
+}
+
+template <typename Step>
+static void run_phase(std::vector<phase_result>& phases, const char* name, Step step) {
+    reset_peak_rss();
+    process_counters before = read_counters();
+    auto start = std::chrono::steady_clock::now();
+    step();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    process_counters after = read_counters();
+    phase_result phase;
+    phase.name = name;
+    phase.seconds = seconds;
+    phase.peak_rss_kb = peak_rss_kb();
+    static const process_counters overhead = counter_overhead();
+    phase.read_syscalls = after.read_syscalls - before.read_syscalls - overhead.read_syscalls;
+    phase.write_syscalls = after.write_syscalls - before.write_syscalls - overhead.write_syscalls;
+    phases.push_back(phase);
+}
+
+struct scenario_result {
+    std::string name;
+    uint64_t files = 0;
+    uint64_t dirs = 0;
+    uint64_t bytes = 0;
+    uint64_t archive_bytes = 0;
+    uint64_t index_bytes = 0;
+    uint64_t scan_syscalls = 0;
+    std::vector<phase_result> phases;
+    // kser_stats::json() of the engine phases
+    std::string engine;
+};
+
+static scenario_result run_scenario(const scenario& s, const fs::path& work_dir, double scale, kser_options options) {
+    fs::path tree_parent = work_dir / s.name;
+    fs::path tree = tree_parent / "tree";
+    fs::path marker = tree_parent / "parameters";
+    std::string parameters = s.parameters + " scale=" + std::to_string(scale);
+
+    std::string existing;
+    {
+        std::ifstream in(marker);
+        std::getline(in, existing);
+    }
+    if (existing != parameters || !fs::exists(tree)) {
+        std::cerr << "kser_bench: generating " << s.name << "...\n";
+        std::error_code ec;
+        fs::remove_all(tree_parent, ec);
+        fs::create_directories(tree);
+        s.generate(tree, scale);
+        std::ofstream(marker) << parameters << "\n";
+    }
+
+    fs::path archive = tree_parent / "tree.kser";
+    fs::path extract_dir = tree_parent / "extracted";
+    std::error_code ec;
+    fs::remove(archive, ec);
+    fs::remove_all(extract_dir, ec);
+    fs::create_directories(extract_dir);
+
+    scenario_result result;
+    result.name = s.name;
+    kser_stats stats;
+    options.stats = &stats;
+
+    // the steps of serialize() one by one
+    entry_table table(tree.parent_path());
+    run_phase(result.phases, "scan", [&] {
+        std::u8string first_name = tree.filename().generic_u8string();
+        size_t first = table.add(std::string_view(reinterpret_cast<const char*>(first_name.data()), first_name.size()));
+        read_fso_isDir_size_permissions(table, first);
+        result.scan_syscalls = process_directory(tree, table, options);
+    });
+    run_phase(result.phases, "sort", [&] {
+        table.sort_by_name(options.threads);
+    });
+    for (size_t i = 0; i < table.size(); i++) {
+        if (table.is_dir[i]) {
+            result.dirs++;
+        }
+        else {
+            result.files++;
+            result.bytes += table.file_size[i];
+        }
+    }
+    run_phase(result.phases, "write", [&] {
+        write_fso_map_to_file(archive, table, options);
+    });
+    table.clear();
+    result.archive_bytes = fs::file_size(archive);
+
+    // and those of deserialize()
+    std::unique_ptr<KserView> view;
+    run_phase(result.phases, "parse", [&] {
+        view = std::make_unique<KserView>(archive);
+    });
+    result.index_bytes = view->index_size();
+    run_phase(result.phases, "extract", [&] {
+        create_files(*view, extract_dir, options);
+    });
+    view.reset();
+    result.engine = stats.json();
+
+    fs::remove(archive, ec);
+    fs::remove_all(extract_dir, ec);
+    return result;
+}
+
+static double per_second(double amount, double seconds) {
+    return seconds > 0 ? amount / seconds : 0.0;
+}
+
+static void print_json(std::FILE* out, const std::vector<scenario_result>& results, double scale, const kser_options& options) {
+    const char* io = options.io == kser_io_backend::sync ? "sync" : options.io == kser_io_backend::io_uring ? "uring" : "auto";
+    std::fprintf(out, "{\n  \"threads\": %u,\n  \"scale\": %g,\n  \"compression\": \"%s\",\n  \"io\": \"%s\",\n"
+        "  \"dedup\": %s,\n  \"scenarios\": [",
+        work_stealing_pool::resolve_thread_count(options.threads), scale,
+        options.compression == kser_codec::klz ? "klz" : "none", io, options.dedup ? "true" : "false");
+    for (size_t r = 0; r < results.size(); r++) {
+        const scenario_result& result = results[r];
+        uint64_t entries = result.files + result.dirs;
+        double mb = result.bytes / (1024.0 * 1024.0);
+        std::fprintf(out, "%s\n    {\n      \"name\": \"%s\",\n      \"files\": %llu,\n      \"dirs\": %llu,\n"
+            "      \"bytes\": %llu,\n      \"archive_bytes\": %llu,\n      \"index_bytes\": %llu,\n      \"scan_syscalls\": %llu,\n"
+            "      \"phases\": {",
+            r ? "," : "", result.name.c_str(),
+            static_cast<unsigned long long>(result.files), static_cast<unsigned long long>(result.dirs),
+            static_cast<unsigned long long>(result.bytes), static_cast<unsigned long long>(result.archive_bytes),
+            static_cast<unsigned long long>(result.index_bytes),
+            static_cast<unsigned long long>(result.scan_syscalls));
+        for (size_t p = 0; p < result.phases.size(); p++) {
+            const phase_result& phase = result.phases[p];
+            std::fprintf(out, "%s\n        \"%s\": { \"seconds\": %.6f, \"files_per_s\": %.1f, \"mb_per_s\": %.2f, "
+                "\"peak_rss_kb\": %llu, \"read_syscalls\": %llu, \"write_syscalls\": %llu }",
+                p ? "," : "", phase.name.c_str(), phase.seconds,
+                per_second(static_cast<double>(entries), phase.seconds), per_second(mb, phase.seconds),
+                static_cast<unsigned long long>(phase.peak_rss_kb),
+                static_cast<unsigned long long>(phase.read_syscalls),
+                static_cast<unsigned long long>(phase.write_syscalls));
+        }
+        std::fprintf(out, "\n      },\n      \"engine\": %s\n    }", result.engine.c_str());
+    }
+    std::fprintf(out, "\n  ]\n}\n");
+}
+
+static void print_table(const std::vector<scenario_result>& results) {
+    std::fprintf(stderr, "%-8s %-8s %10s %12s %10s %12s %10s %10s\n",
+        "scenario", "phase", "seconds", "files/s", "MB/s", "peak_rss_kb", "reads", "writes");
+    for (const scenario_result& result : results) {
+        uint64_t entries = result.files + result.dirs;
+        double mb = result.bytes / (1024.0 * 1024.0);
+        for (const phase_result& phase : result.phases) {
+            std::fprintf(stderr, "%-8s %-8s %10.3f %12.0f %10.1f %12llu %10llu %10llu\n",
+                result.name.c_str(), phase.name.c_str(), phase.seconds,
+                per_second(static_cast<double>(entries), phase.seconds), per_second(mb, phase.seconds),
+                static_cast<unsigned long long>(phase.peak_rss_kb),
+                static_cast<unsigned long long>(phase.read_syscalls),
+                static_cast<unsigned long long>(phase.write_syscalls));
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    const std::vector<scenario> all = {
+        { "empty", "files=1000000 size=0", generate_empty },
+        { "small", "files=100000 size=4096", generate_small },
+        { "large", "files=3 size=2GiB", generate_large },
+        { "deep", "chains=32 depth=256 size=1024", generate_deep },
+        { "sparse", "files=64 size=1GiB extents=16x64KiB", generate_sparse },
+    };
+
+    std::vector<const scenario*> selected;
+    fs::path work_dir = fs::temp_directory_path() / "kser_bench";
+    fs::path json_path;
+    double scale = 1.0;
+    kser_options options;
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--dir" && i + 1 < argc) {
+                work_dir = fs::path(fs::u8path(argv[++i]).native());
+            }
+            else if (arg == "--json" && i + 1 < argc) {
+                json_path = fs::path(fs::u8path(argv[++i]).native());
+            }
+            else if (arg == "--scale" && i + 1 < argc) {
+                scale = std::stod(argv[++i]);
+                if (!(scale > 0)) {
+                    throw std::invalid_argument("--scale must be positive");
+                }
+            }
+            else if (arg == "-j" && i + 1 < argc) {
+                options.threads = static_cast<unsigned>(std::stoul(argv[++i]));
+            }
+            else if (arg == "-c" && i + 1 < argc) {
+                std::string codec = argv[++i];
+                if (codec != "klz" && codec != "none") {
+                    throw std::invalid_argument("-c: unknown codec " + codec);
+                }
+                options.compression = codec == "klz" ? kser_codec::klz : kser_codec::none;
+            }
+            else if (arg == "--io" && i + 1 < argc) {
+                std::string backend = argv[++i];
+                if (backend == "auto") {
+                    options.io = kser_io_backend::automatic;
+                }
+                else if (backend == "sync") {
+                    options.io = kser_io_backend::sync;
+                }
+                else if (backend == "uring") {
+                    options.io = kser_io_backend::io_uring;
+                }
+                else {
+                    throw std::invalid_argument("--io: unknown backend " + backend);
+                }
+            }
+            else if (arg == "--dedup") {
+                options.dedup = true;
+            }
+            else {
+                auto it = std::find_if(all.begin(), all.end(), [&](const scenario& s) { return s.name == arg; });
+                if (it == all.end()) {
+                    print_usage();
+                    return 2;
+                }
+                selected.push_back(&*it);
+            }
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << "kser_bench: " << e.what() << "\n";
+        return 2;
+    }
+    if (selected.empty()) {
+        for (const scenario& s : all) {
+            selected.push_back(&s);
+        }
+    }
+
+    std::vector<scenario_result> results;
+    try {
+        fs::create_directories(work_dir);
+        for (const scenario* s : selected) {
+            std::cerr << "kser_bench: running " << s->name << "...\n";
+            results.push_back(run_scenario(*s, work_dir, scale, options));
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << "kser_bench: " << e.what() << "\n";
+        return 1;
+    }
+
+    print_table(results);
+    if (json_path.empty()) {
+        print_json(stdout, results, scale, options);
+    }
+    else {
+        std::FILE* out = std::fopen(json_path.string().c_str(), "w");
+        if (!out) {
+            std::cerr << "kser_bench: failed to create " << json_path.string() << "\n";
+            return 1;
+        }
+        print_json(out, results, scale, options);
+        std::fclose(out);
+    }
+    return 0;
+}
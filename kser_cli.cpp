@@ -0,0 +1,476 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+
+#include "kserialize.h"
+#include "kser_view.h"
+#include "kser_stream.h"
+#include "kser_stats.h"
+
+#if defined(OS_WIN)
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// headless front end for the engine in kserialize.h, meant for cron jobs and benchmarking.
+// every successful run ends with one machine-readable summary line on stdout:
+//   kser: op=<op> files=<n> dirs=<n> bytes=<n> seconds=<s> mb_per_s=<r>
+// serialize adds scan_syscalls=<n> syscalls_per_entry=<r> for the directory scan, serialize and
+// deserialize add archive_bytes=<n> ratio=<r> (archive size / file bytes), incremental serialize
+// adds reused_files=<n>. verify adds unchecked_files=<n> for files of archives written before
+// checksums. apply adds unchanged_entries=<n> missing_entries=<n> for the entries it left alone.
+// --stats prints the engine's phase times, counters, file latency histogram and slowest files to
+// stderr after it, --stats-json writes them to a file.
+
+static void print_usage() {
+    std::cerr <<
+        "usage:\n"
+        "  kser serialize <input> [output] [-f] [-j threads] [--portable-scan] [-c codec] [--dedup] [--incremental] [--stream] [--metadata-only] [--io backend] [-v]\n"
+        "      output is a .kser file or a folder (default: parent folder of input).\n"
+        "      an existing .kser output file is used to keep the other system's permissions.\n"
+        "      -f overwrites <folder>/<input name>.kser if it already exists.\n"
+        "      -j sets the number of scan and compression threads (default: one per hardware thread).\n"
+        "      --portable-scan uses std::filesystem instead of getdents64/statx on linux.\n"
+        "      -c sets the payload codec: klz (default) or none. files that don't compress are stored raw.\n"
+        "      --dedup stores identical files once and keeps hard links as hard links.\n"
+        "      --incremental keeps the payloads of files unchanged since the existing output .kser\n"
+        "      (same size, mtime and inode) and appends only the changed ones.\n"
+        "      --stream writes a streaming archive: no index, each entry's data follows its record,\n"
+        "      so it can go through a pipe. output - writes it to stdout.\n"
+        "      --metadata-only writes names, sizes and permissions without any file data. such an\n"
+        "      archive can't be deserialized, only applied.\n"
+        "  kser deserialize <input.kser> [output folder] [-j threads] [--io backend] [-v]\n"
+        "      input - reads a streaming archive from stdin.\n"
+        "      -j sets the number of threads writing files (default: one per hardware thread).\n"
+        "  kser apply <input.kser> [target folder] [-j threads] [-v]\n"
+        "      sets the permissions in the archive on the tree that already exists in the target folder\n"
+        "      (default: parent folder of input), without touching file data. entries whose permissions\n"
+        "      already match are skipped, missing ones are reported. input - reads a streaming archive from stdin.\n"
+        "  kser list <input.kser>\n"
+        "      input - lists a streaming archive from stdin.\n"
+        "  kser verify <input.kser> [-j threads] [-v]\n"
+        "      checks the index and every file's data against the archive checksums.\n"
+        "      input - checks a streaming archive from stdin as it arrives.\n"
+        "  --io sets how small files are read and written: auto (default, io_uring on linux when\n"
+        "      the files are small on average), sync or uring.\n"
+        "  -v prints the engine log to stderr, one line per file included\n"
+        "  --stats prints the time of each phase, counters, a histogram of the time per file and\n"
+        "      the slowest files to stderr. --stats-json <file> writes the same as json.\n"
+        "      --slowest <n> sets how many of the slowest files are listed (default: 10).\n";
+}
+
+static unsigned parse_count(const std::string& value) {
+    try {
+        return static_cast<unsigned>(std::stoul(value));
+    }
+    catch (const std::exception&) {
+        throw std::invalid_argument("expected a number, got '" + value + "'");
+    }
+}
+
+static fs::path path_from_arg(const char* arg) {
+    return fs::path(fs::u8path(arg).native());
+}
+
+// out is stderr when stdout carries the archive
+static void print_summary(std::FILE* out, const char* op, const run_summary& summary, double seconds) {
+    double mb_per_s = seconds > 0 ? (summary.bytes / (1024.0 * 1024.0)) / seconds : 0.0;
+    std::fprintf(out, "kser: op=%s files=%llu dirs=%llu bytes=%llu seconds=%.6f mb_per_s=%.2f",
+        op,
+        static_cast<unsigned long long>(summary.files),
+        static_cast<unsigned long long>(summary.dirs),
+        static_cast<unsigned long long>(summary.bytes),
+        seconds, mb_per_s);
+    if (summary.scan_syscalls != 0) {
+        uint64_t entries = summary.files + summary.dirs;
+        std::fprintf(out, " scan_syscalls=%llu syscalls_per_entry=%.2f",
+            static_cast<unsigned long long>(summary.scan_syscalls),
+            entries ? static_cast<double>(summary.scan_syscalls) / entries : 0.0);
+    }
+    if (summary.archive_bytes != 0) {
+        std::fprintf(out, " archive_bytes=%llu ratio=%.3f",
+            static_cast<unsigned long long>(summary.archive_bytes),
+            summary.bytes ? static_cast<double>(summary.archive_bytes) / summary.bytes : 0.0);
+    }
+    if (summary.reused_files != 0) {
+        std::fprintf(out, " reused_files=%llu", static_cast<unsigned long long>(summary.reused_files));
+    }
+    if (summary.unchecked_files != 0) {
+        std::fprintf(out, " unchecked_files=%llu", static_cast<unsigned long long>(summary.unchecked_files));
+    }
+    if (summary.unchanged_entries != 0 || summary.missing_entries != 0) {
+        std::fprintf(out, " unchanged_entries=%llu missing_entries=%llu",
+            static_cast<unsigned long long>(summary.unchanged_entries),
+            static_cast<unsigned long long>(summary.missing_entries));
+    }
+    std::fprintf(out, "\n");
+}
+
+// reports the stats of a run, failed ones included. false when the json file can't be written
+static bool write_stats(const kser_stats* stats, bool print, const fs::path& json_path) {
+    if (!stats) {
+        return true;
+    }
+    if (print) {
+        std::string summary = stats->summary();
+        std::fwrite(summary.data(), 1, summary.size(), stderr);
+    }
+    if (!json_path.empty()) {
+        std::ofstream out(json_path, std::ios::trunc);
+        out << stats->json() << "\n";
+        if (!out) {
+            std::cerr << "kser: failed to write " << json_path.string() << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// same rules as the gui: a folder output gets <input name>.kser, a file output must be .kser
+// and is reused as the source of previously serialized permissions
+static fs::path prepare_kser_file(const fs::path& input_path, fs::path output_path, bool force) {
+    if (output_path.native().empty()) {
+        output_path = input_path.parent_path();
+        if (output_path.native().empty()) {
+            output_path = fs::current_path();
+        }
+    }
+
+    fs::path kser_file_path;
+    if (fs::is_directory(output_path)) {
+        kser_file_path = output_path / input_path.filename();
+        kser_file_path.replace_extension(".kser");
+        if (fs::exists(kser_file_path) && !force) {
+            throw_u8string_error(kser_file_path.u8string() + u8" already exists. use -f to overwrite it or pass the file itself as output to keep its permissions");
+        }
+        std::ofstream outfile(kser_file_path, std::ios::trunc);
+        if (!outfile) {
+            throw_u8string_error(u8"failed to create serialized file: " + kser_file_path.u8string());
+        }
+    }
+    else {
+        if (output_path.extension() != ".kser") {
+            throw_u8string_error(u8"output file must have .kser extension");
+        }
+        kser_file_path = output_path;
+        if (!fs::exists(kser_file_path)) {
+            std::ofstream outfile(kser_file_path);
+            if (!outfile) {
+                throw_u8string_error(u8"failed to create serialized file: " + kser_file_path.u8string());
+            }
+        }
+    }
+    return kser_file_path;
+}
+
+// archives piped through stdin and stdout are binary, iostreams must not touch them
+static void binary_stdio() {
+    std::ios::sync_with_stdio(false);
+#if defined(OS_WIN)
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+}
+
+static void check_kser_input(const fs::path& input_path) {
+    if (!fs::exists(input_path)) {
+        throw_u8string_error(u8"input path doesn't exist on the system: " + input_path.u8string());
+    }
+    if (fs::is_directory(input_path)) {
+        throw_u8string_error(u8"input must be a .kser file, not a directory");
+    }
+    if (fs::is_empty(input_path)) {
+        throw_u8string_error(u8"input file is empty. nothing to deserialize");
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        print_usage();
+        return 2;
+    }
+
+    std::string op = argv[1];
+    std::vector<fs::path> positional;
+    bool verbose = false;
+    bool force = false;
+    bool stream = false;
+    bool print_stats = false;
+    fs::path stats_json_path;
+    size_t slowest = 10;
+    kser_options options;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-v") {
+            verbose = true;
+        }
+        else if (arg == "-j" && i + 1 < argc) {
+            try {
+                options.threads = parse_count(argv[++i]);
+            }
+            catch (const std::exception& e) {
+                std::cerr << "kser: -j: " << e.what() << "\n";
+                return 2;
+            }
+        }
+        else if (arg == "-c" && i + 1 < argc) {
+            std::string codec = argv[++i];
+            if (codec == "klz") {
+                options.compression = kser_codec::klz;
+            }
+            else if (codec == "none") {
+                options.compression = kser_codec::none;
+            }
+            else {
+                std::cerr << "kser: -c: unknown codec " << codec << "\n";
+                return 2;
+            }
+        }
+        else if (arg == "--io" && i + 1 < argc) {
+            std::string backend = argv[++i];
+            if (backend == "auto") {
+                options.io = kser_io_backend::automatic;
+            }
+            else if (backend == "sync") {
+                options.io = kser_io_backend::sync;
+            }
+            else if (backend == "uring") {
+                options.io = kser_io_backend::io_uring;
+            }
+            else {
+                std::cerr << "kser: --io: unknown backend " << backend << "\n";
+                return 2;
+            }
+        }
+        else if (arg == "--stats") {
+            print_stats = true;
+        }
+        else if (arg == "--stats-json" && i + 1 < argc) {
+            stats_json_path = path_from_arg(argv[++i]);
+        }
+        else if (arg == "--slowest" && i + 1 < argc) {
+            try {
+                slowest = parse_count(argv[++i]);
+            }
+            catch (const std::exception& e) {
+                std::cerr << "kser: --slowest: " << e.what() << "\n";
+                return 2;
+            }
+        }
+        else if (arg == "--incremental") {
+            options.incremental = true;
+        }
+        else if (arg == "--stream") {
+            stream = true;
+        }
+        else if (arg == "--metadata-only") {
+            options.metadata_only = true;
+        }
+        else if (arg == "--dedup") {
+            options.dedup = true;
+        }
+        else if (arg == "--portable-scan") {
+            options.fast_scan = false;
+        }
+        else if (arg == "-f") {
+            force = true;
+        }
+        else if (!arg.empty() && arg[0] == '-' && arg != "-") {
+            std::cerr << "kser: unknown option " << arg << "\n";
+            print_usage();
+            return 2;
+        }
+        else {
+            positional.push_back(path_from_arg(argv[i]));
+        }
+    }
+    if (positional.empty() || positional.size() > 2) {
+        print_usage();
+        return 2;
+    }
+
+    if (verbose) {
+        set_log_level(log_level::debug);
+        set_log_handler([](log_level level, const std::u8string& message) {
+            if (level >= log_level::warning) {
+                std::cerr << log_level_name(level) << ": ";
+            }
+            std::cerr.write(reinterpret_cast<const char*>(message.data()), message.size());
+            std::cerr << '\n';
+        });
+    }
+
+    // "-" is stdin as input and stdout as output, for streaming archives
+    bool from_stdin = positional[0] == "-";
+    bool to_stdout = positional.size() > 1 && positional[1] == "-";
+    // the engine names entries relative to the parent of the input, so it needs one
+    fs::path input_path = from_stdin ? fs::path() : fs::absolute(positional[0]);
+    if (!input_path.has_filename()) {
+        input_path = input_path.parent_path();
+    }
+    fs::path output_path = positional.size() > 1 ? positional[1] : fs::path();
+    if (from_stdin && op == "serialize") {
+        std::cerr << "kser: serialize can't read from stdin\n";
+        return 2;
+    }
+    if (to_stdout && op != "serialize") {
+        std::cerr << "kser: only serialize writes to stdout\n";
+        return 2;
+    }
+    if (options.metadata_only && (stream || to_stdout)) {
+        std::cerr << "kser: --metadata-only archives have an index and can't be streamed\n";
+        return 2;
+    }
+
+    // only set up when asked for, a run without it skips every timer
+    std::unique_ptr<kser_stats> stats;
+    if (print_stats || !stats_json_path.empty()) {
+        stats = std::make_unique<kser_stats>(slowest);
+        options.stats = stats.get();
+    }
+
+    try {
+        auto start = std::chrono::steady_clock::now();
+        run_summary summary;
+
+        if (op == "serialize") {
+            if (!fs::exists(input_path)) {
+                throw_u8string_error(u8"input path doesn't exist on the system: " + input_path.u8string());
+            }
+            if (to_stdout) {
+                binary_stdio();
+                summary = serialize_stream(input_path, std::cout, options);
+            }
+            else if (stream) {
+                fs::path kser_file_path = prepare_kser_file(input_path, output_path, force);
+                std::ofstream out(kser_file_path, std::ios::binary | std::ios::trunc);
+                if (!out) {
+                    throw_u8string_error(u8"failed to open " + kser_file_path.u8string() + u8" for writing");
+                }
+                summary = serialize_stream(input_path, out, options);
+                out.close();
+                summary.archive_bytes = fs::file_size(kser_file_path);
+            }
+            else {
+                fs::path kser_file_path = prepare_kser_file(input_path, output_path, force);
+                summary = serialize(input_path, kser_file_path, options);
+            }
+        }
+        else if (op == "deserialize" && from_stdin) {
+            if (output_path.native().empty()) {
+                output_path = fs::current_path();
+            }
+            else if (!fs::exists(output_path)) {
+                throw_u8string_error(u8"output path does not exist on this system");
+            }
+            binary_stdio();
+            summary = deserialize_stream(std::cin, u8"stdin", output_path, options);
+        }
+        else if (op == "deserialize") {
+            check_kser_input(input_path);
+            if (output_path.native().empty()) {
+                output_path = input_path.parent_path();
+                if (output_path.native().empty()) {
+                    output_path = fs::current_path();
+                }
+            }
+            else if (!fs::exists(output_path)) {
+                throw_u8string_error(u8"output path does not exist on this system");
+            }
+            summary = deserialize(input_path, output_path, options);
+        }
+        else if (op == "apply" && from_stdin) {
+            if (output_path.native().empty()) {
+                output_path = fs::current_path();
+            }
+            else if (!fs::exists(output_path)) {
+                throw_u8string_error(u8"output path does not exist on this system");
+            }
+            binary_stdio();
+            summary = apply_permissions_stream(std::cin, u8"stdin", output_path, options);
+        }
+        else if (op == "apply") {
+            check_kser_input(input_path);
+            if (output_path.native().empty()) {
+                output_path = input_path.parent_path();
+                if (output_path.native().empty()) {
+                    output_path = fs::current_path();
+                }
+            }
+            else if (!fs::exists(output_path)) {
+                throw_u8string_error(u8"output path does not exist on this system");
+            }
+            summary = apply_permissions(input_path, output_path, options);
+        }
+        else if (op == "verify" && from_stdin) {
+            binary_stdio();
+            summary = verify_stream(std::cin, u8"stdin", options);
+        }
+        else if (op == "verify") {
+            check_kser_input(input_path);
+            summary = verify(input_path, options);
+        }
+        else if (op == "list") {
+            auto print_entry = [&](const kser_entry& entry) {
+                std::printf("%c %08x %06o %12llu ",
+                    entry.isDir ? 'd' : 'f',
+                    static_cast<unsigned>(entry.win_permissions),
+                    static_cast<unsigned>(entry.linux_permissions),
+                    static_cast<unsigned long long>(entry.file_size));
+                std::fwrite(entry.filename.data(), 1, entry.filename.size(), stdout);
+                std::fputc('\n', stdout);
+                if (entry.isDir) {
+                    summary.dirs++;
+                }
+                else {
+                    summary.files++;
+                    summary.bytes += entry.file_size;
+                }
+            };
+            if (!from_stdin) {
+                check_kser_input(input_path);
+            }
+            if (from_stdin || is_kser_stream(input_path)) {
+                // no index: every record is read and every payload skipped on the way
+                std::ifstream file;
+                if (!from_stdin) {
+                    file.open(input_path, std::ios::binary);
+                }
+                else {
+                    binary_stdio();
+                }
+                kser_stream_reader reader(from_stdin ? std::cin : file, from_stdin ? u8"stdin" : input_path.u8string());
+                while (reader.next()) {
+                    print_entry(reader.entry());
+                }
+            }
+            else {
+                KserView view(input_path);
+                for (const auto& entry : view.entries()) {
+                    print_entry(entry);
+                }
+            }
+        }
+        else {
+            std::cerr << "kser: unknown operation " << op << "\n";
+            print_usage();
+            return 2;
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        print_summary(to_stdout ? stderr : stdout, op.c_str(), summary, elapsed.count());
+    }
+    catch (const std::exception& e) {
+        std::cerr << "kser: ERROR: " << e.what() << "\n";
+        write_stats(stats.get(), print_stats, stats_json_path);
+        return 1;
+    }
+    return write_stats(stats.get(), print_stats, stats_json_path) ? 0 : 1;
+}
@@ -0,0 +1,205 @@
+#include "kser_codec.h"
+
+#include <cstring>
+#include <memory>
+
+#include "kserialize.h"
+
+// format of a compressed block: a series of sequences, each
+//   token (high nibble literal count, low nibble match length - 4; 15 means more length bytes follow)
+//   [literal count extension] literals [u16 match offset] [match length extension]
+// the last sequence has literals only. length extensions are runs of 255 ending with a byte < 255.
+
+static constexpr size_t min_match = 4;
+// matches don't start in the last 12 bytes and don't extend into the last 5,
+// which keeps the compressor's 4-byte reads inside the block
+static constexpr size_t match_start_limit = 12;
+static constexpr size_t last_literals = 5;
+static constexpr int hash_bits = 14;
+static constexpr size_t max_offset = 65535;
+
+static inline uint32_t read32(const char* p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash_sequence(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - hash_bits);
+}
+
+static inline char* write_length(char* op, size_t length) {
+    while (length >= 255) {
+        *op++ = static_cast<char>(255);
+        length -= 255;
+    }
+    *op++ = static_cast<char>(length);
+    return op;
+}
+
+static char* write_sequence(char* op, const char* literals, size_t literal_count, size_t offset, size_t match_length) {
+    char* token = op++;
+    uint8_t token_value = static_cast<uint8_t>((literal_count >= 15 ? 15 : literal_count) << 4);
+    if (literal_count >= 15) {
+        op = write_length(op, literal_count - 15);
+    }
+    if (literal_count > 0) {
+        std::memcpy(op, literals, literal_count);
+        op += literal_count;
+    }
+
+    if (match_length != 0) {
+        *op++ = static_cast<char>(offset & 0xff);
+        *op++ = static_cast<char>(offset >> 8);
+        size_t extra = match_length - min_match;
+        token_value |= static_cast<uint8_t>(extra >= 15 ? 15 : extra);
+        if (extra >= 15) {
+            op = write_length(op, extra - 15);
+        }
+    }
+    *token = static_cast<char>(token_value);
+    return op;
+}
+
+size_t klz_compress(const char* src, size_t size, char* dst) {
+    uint32_t table[1 << hash_bits];
+    std::memset(table, 0, sizeof(table));
+
+    char* op = dst;
+    size_t anchor = 0;
+    if (size > match_start_limit) {
+        const size_t start_limit = size - match_start_limit;
+        const size_t match_limit = size - last_literals;
+        size_t ip = 1;
+        while (ip < start_limit) {
+            uint32_t sequence = read32(src + ip);
+            uint32_t h = hash_sequence(sequence);
+            size_t ref = table[h];
+            table[h] = static_cast<uint32_t>(ip);
+
+            if (ref >= ip || ip - ref > max_offset || read32(src + ref) != sequence) {
+                // skip faster through data that doesn't match
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            size_t length = min_match;
+            while (ip + length < match_limit && src[ref + length] == src[ip + length]) {
+                length++;
+            }
+            op = write_sequence(op, src + anchor, ip - anchor, ip - ref, length);
+            ip += length;
+            anchor = ip;
+            if (ip < start_limit) {
+                table[hash_sequence(read32(src + ip - 2))] = static_cast<uint32_t>(ip - 2);
+            }
+        }
+    }
+    op = write_sequence(op, src + anchor, size - anchor, 0, 0);
+    return static_cast<size_t>(op - dst);
+}
+
+static inline bool read_length(const uint8_t*& ip, const uint8_t* end, size_t& length) {
+    uint8_t byte;
+    do {
+        if (ip >= end) {
+            return false;
+        }
+        byte = *ip++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool klz_decompress(const char* src, size_t size, char* dst, size_t raw_size) {
+    const uint8_t* ip = reinterpret_cast<const uint8_t*>(src);
+    const uint8_t* end = ip + size;
+    size_t op = 0;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+
+        size_t literal_count = token >> 4;
+        if (literal_count == 15 && !read_length(ip, end, literal_count)) {
+            return false;
+        }
+        if (literal_count > static_cast<size_t>(end - ip) || literal_count > raw_size - op) {
+            return false;
+        }
+        if (literal_count > 0) {
+            std::memcpy(dst + op, ip, literal_count);
+        }
+        ip += literal_count;
+        op += literal_count;
+
+        if (ip == end) {
+            break;
+        }
+
+        if (end - ip < 2) {
+            return false;
+        }
+        size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8);
+        ip += 2;
+        size_t match_length = token & 15;
+        if (match_length == 15 && !read_length(ip, end, match_length)) {
+            return false;
+        }
+        match_length += min_match;
+        if (offset == 0 || offset > op || match_length > raw_size - op) {
+            return false;
+        }
+
+        char* out = dst + op;
+        const char* match = out - offset;
+        if (offset >= match_length) {
+            std::memcpy(out, match, match_length);
+        }
+        else {
+            for (size_t i = 0; i < match_length; i++) {
+                out[i] = match[i];
+            }
+        }
+        op += match_length;
+    }
+    return op == raw_size;
+}
+
+void klz_unpack_payload(std::span<const char> payload, uint64_t raw_size,
+                        const std::function<void(const char* data, size_t size)>& sink) {
+    static thread_local std::unique_ptr<char[]> block;
+    if (!block) {
+        block.reset(new char[klz_block_size]);
+    }
+
+    size_t pos = 0;
+    while (raw_size > 0) {
+        uint32_t block_raw = 0;
+        uint32_t block_stored = 0;
+        if (payload.size() - pos < klz_block_header_size) {
+            throw_u8string_error(u8"compressed data ends early (possibly incorrect data format)");
+        }
+        std::memcpy(&block_raw, payload.data() + pos, sizeof(block_raw));
+        std::memcpy(&block_stored, payload.data() + pos + 4, sizeof(block_stored));
+        pos += klz_block_header_size;
+
+        if (block_raw == 0 || block_raw > klz_block_size || block_raw > raw_size ||
+            block_stored > block_raw || payload.size() - pos < block_stored) {
+            throw_u8string_error(u8"corrupt compressed block header (possibly incorrect data format)");
+        }
+        if (block_stored == block_raw) {
+            sink(payload.data() + pos, block_raw);
+        }
+        else {
+            if (!klz_decompress(payload.data() + pos, block_stored, block.get(), block_raw)) {
+                throw_u8string_error(u8"corrupt compressed block (possibly incorrect data format)");
+            }
+            sink(block.get(), block_raw);
+        }
+        pos += block_stored;
+        raw_size -= block_raw;
+    }
+    if (pos != payload.size()) {
+        throw_u8string_error(u8"trailing bytes after compressed data (possibly incorrect data format)");
+    }
+}
@@ -0,0 +1,40 @@
+#pragma once
+#ifndef K_SER_CODEC_IMPL
+#define K_SER_CODEC_IMPL
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <span>
+
+// per-entry payload codecs stored in the v2 index
+enum class kser_codec : uint8_t {
+    none = 0,
+    // in-tree LZ77 codec (lz4-style sequences), see below
+    klz = 1
+};
+
+// a klz payload is a sequence of independently compressed blocks:
+//   u32 raw_size | u32 stored_size | stored_size bytes
+// a block with stored_size == raw_size is kept uncompressed. every block except the last
+// holds klz_block_size raw bytes.
+constexpr size_t klz_block_size = 256 * 1024;
+constexpr size_t klz_block_header_size = 8;
+
+// worst case output size of klz_compress for size input bytes
+constexpr size_t klz_bound(size_t size) {
+    return size + size / 255 + 16;
+}
+
+// compresses one block. dst must hold klz_bound(size) bytes. returns the compressed size.
+size_t klz_compress(const char* src, size_t size, char* dst);
+
+// decompresses one block into exactly raw_size bytes. returns false if the input is malformed.
+bool klz_decompress(const char* src, size_t size, char* dst, size_t raw_size);
+
+// decodes a whole klz payload that expands to raw_size bytes and hands the data to sink block
+// by block (stored blocks are passed straight from the payload). throws if it is malformed.
+void klz_unpack_payload(std::span<const char> payload, uint64_t raw_size,
+                        const std::function<void(const char* data, size_t size)>& sink);
+
+#endif
@@ -0,0 +1,160 @@
+#include "kser_dedup.h"
+#include "kser_hash.h"
+#include "kser_io.h"
+#include "kser_pool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <utility>
+
+static constexpr size_t dedup_chunk_size = 1 << 20;
+
+static char* chunk_buffer(int which) {
+    static thread_local std::unique_ptr<char[]> buffers[2];
+    if (!buffers[which]) {
+        buffers[which].reset(new char[dedup_chunk_size]);
+    }
+    return buffers[which].get();
+}
+
+// xxh64 chained over chunks of the file, each chunk seeded with the hash so far
+static uint64_t hash_file(const entry_table& table, size_t i) {
+    source_file in(table.full_path(i));
+    char* buffer = chunk_buffer(0);
+    uint64_t hash = 0;
+    for (uint64_t left = table.file_size[i]; left > 0;) {
+        size_t size = static_cast<size_t>(std::min<uint64_t>(left, dedup_chunk_size));
+        in.read(buffer, size);
+        hash = xxh64(buffer, size, hash);
+        left -= size;
+    }
+    return hash;
+}
+
+static bool same_contents(const entry_table& table, size_t a, size_t b) {
+    source_file in_a(table.full_path(a));
+    source_file in_b(table.full_path(b));
+    char* buffer_a = chunk_buffer(0);
+    char* buffer_b = chunk_buffer(1);
+    for (uint64_t left = table.file_size[a]; left > 0;) {
+        size_t size = static_cast<size_t>(std::min<uint64_t>(left, dedup_chunk_size));
+        in_a.read(buffer_a, size);
+        in_b.read(buffer_b, size);
+        if (std::memcmp(buffer_a, buffer_b, size) != 0) {
+            return false;
+        }
+        left -= size;
+    }
+    return true;
+}
+
+dedup_plan find_duplicate_payloads(const entry_table& table, unsigned threads,
+                                   const std::vector<uint8_t>& settled) {
+    dedup_plan plan;
+    plan.same_as.assign(table.size(), dedup_plan::no_entry);
+    plan.hard_link.assign(table.size(), 0);
+
+    // hard links: the first name of an inode (in entry order) keeps the payload
+    std::map<std::pair<uint64_t, uint64_t>, size_t> first_name;
+    std::vector<size_t> candidates;
+    for (size_t i = 0; i < table.size(); i++) {
+        if (table.is_dir[i]) {
+            continue;
+        }
+        if (table.inode[i] != 0 && table.link_count[i] > 1) {
+            auto [it, inserted] = first_name.emplace(std::make_pair(table.device[i], table.inode[i]), i);
+            if (!inserted) {
+                plan.same_as[i] = it->second;
+                plan.hard_link[i] = 1;
+                plan.hard_links++;
+                plan.saved_bytes += table.file_size[i];
+                continue;
+            }
+        }
+        if (table.file_size[i] > 0 && (settled.empty() || !settled[i])) {
+            candidates.push_back(i);
+        }
+    }
+
+    // only sizes shared by several files are worth hashing
+    std::stable_sort(candidates.begin(), candidates.end(), [&](size_t a, size_t b) {
+        return table.file_size[a] < table.file_size[b];
+    });
+    std::vector<size_t> to_hash;
+    for (size_t begin = 0; begin < candidates.size();) {
+        size_t end = begin + 1;
+        while (end < candidates.size() && table.file_size[candidates[end]] == table.file_size[candidates[begin]]) {
+            end++;
+        }
+        if (end - begin > 1) {
+            to_hash.insert(to_hash.end(), candidates.begin() + begin, candidates.begin() + end);
+        }
+        begin = end;
+    }
+    if (to_hash.empty()) {
+        return plan;
+    }
+
+    work_stealing_pool pool(threads);
+    std::vector<uint64_t> hashes(to_hash.size());
+    for (size_t k = 0; k < to_hash.size(); k++) {
+        pool.submit([&, k] {
+            hashes[k] = hash_file(table, to_hash[k]);
+        });
+    }
+    pool.wait();
+
+    // runs of equal size and hash, in entry order so the payload stays with the earliest entry
+    std::vector<size_t> order(to_hash.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        uint64_t size_a = table.file_size[to_hash[a]];
+        uint64_t size_b = table.file_size[to_hash[b]];
+        if (size_a != size_b) {
+            return size_a < size_b;
+        }
+        if (hashes[a] != hashes[b]) {
+            return hashes[a] < hashes[b];
+        }
+        return to_hash[a] < to_hash[b];
+    });
+
+    for (size_t begin = 0; begin < order.size();) {
+        size_t end = begin + 1;
+        while (end < order.size() && hashes[order[end]] == hashes[order[begin]] &&
+               table.file_size[to_hash[order[end]]] == table.file_size[to_hash[order[begin]]]) {
+            end++;
+        }
+        if (end - begin > 1) {
+            // equal hashes are only candidates, a collision leaves the file with its own payload
+            pool.submit([&, begin, end] {
+                std::vector<size_t> originals;
+                for (size_t k = begin; k < end; k++) {
+                    size_t entry = to_hash[order[k]];
+                    auto original = std::find_if(originals.begin(), originals.end(), [&](size_t o) {
+                        return same_contents(table, o, entry);
+                    });
+                    if (original != originals.end()) {
+                        plan.same_as[entry] = *original;
+                    }
+                    else {
+                        originals.push_back(entry);
+                    }
+                }
+            });
+        }
+        begin = end;
+    }
+    pool.wait();
+
+    for (size_t i = 0; i < table.size(); i++) {
+        if (plan.same_as[i] != dedup_plan::no_entry && !plan.hard_link[i]) {
+            plan.duplicates++;
+            plan.saved_bytes += table.file_size[i];
+        }
+    }
+    return plan;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#ifndef K_SER_DEDUP_IMPL
+#define K_SER_DEDUP_IMPL
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "kserialize.h"
+
+// which entries of a sorted entry list can reuse the payload of an earlier entry
+struct dedup_plan {
+    static constexpr size_t no_entry = static_cast<size_t>(-1);
+
+    // same_as[i] is the earlier entry whose payload entry i shares, or no_entry
+    std::vector<size_t> same_as;
+    // set when entry i is the same file on disk as same_as[i] (same device and inode)
+    std::vector<uint8_t> hard_link;
+
+    size_t hard_links = 0;
+    size_t duplicates = 0;
+    uint64_t saved_bytes = 0;
+};
+
+// hard links are found from (device, inode) without reading anything. the remaining files
+// are grouped by size, only sizes shared by several files are hashed (xxh64, on the pool) and
+// files with equal hashes are compared byte by byte before they are marked as duplicates.
+// entries with settled[i] set already have a payload (incremental serialize) and aren't hashed.
+dedup_plan find_duplicate_payloads(const entry_table& table, unsigned threads,
+                                   const std::vector<uint8_t>& settled = {});
+
+#endif
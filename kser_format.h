@@ -0,0 +1,165 @@
+#pragma once
+#ifndef K_SER_FORMAT_IMPL
+#define K_SER_FORMAT_IMPL
+
+#include <cstdint>
+#include <cstring>
+
+// .kser v2 layout (all integers little endian):
+//
+//   header   magic "KSER" | u16 version | u16 archive flags
+//   payloads file data, each entry's data starts at its data_offset. it is raw unless the
+//            entry has a codec (see kser_codec.h)
+//   index    with kser_archive_compact_index set, see the compact index below. otherwise
+//            u64 entry count, then per entry:
+//            u8 isDir | u8 entry flags | u32 filename_len | filename (utf-8, '/' separated) |
+//            i32 win_perms | i32 linux_perms | u64 filesize | u64 data_offset (absolute)
+//            [u8 codec | u64 stored_size]   only with kser_entry_codec set
+//            [u64 link_target]              only with kser_entry_hard_link set
+//            [i64 mtime_ns | u64 inode]     only with kser_entry_stat set
+//            [u32 extent_count | extent_count * (u64 offset | u64 length)]
+//                                           only with kser_entry_sparse set
+//            [u64 checksum]                 only with kser_entry_checksum set
+//   index checksum
+//            u64 xxh64 of the index bytes, only with kser_archive_checksums set
+//   trailer  u64 index_offset | u64 index_length | magic "KSERIDX\0"
+//
+// entries with identical contents share one payload: their data_offset (and codec, stored_size)
+// are the same. a hard link also names the earlier entry it was linked to on disk.
+//
+// data_offset identifies a payload only when stored_size > 0. an empty payload (an empty or
+// fully sparse file) is given the offset where it would start, which is also where the next
+// payload starts, so anything keyed on data_offset must leave entries with stored_size 0 out.
+//
+// compact index (kser_archive_compact_index), written since it was added. varint is a leb128
+// unsigned integer (7 bits per byte, low bits first), zigzag maps signed values to varints:
+//
+//   varint entry count | varint name bytes (all names in full) | varint permission count |
+//   permission count * (i32 win_perms | i32 linux_perms)
+//   per entry:
+//            u8 entry flags (kser_entry_dir for directories) |
+//            varint shared | varint suffix_len | suffix    the name is the first shared bytes of
+//                                                          the previous entry's name and suffix
+//            varint permissions                            number of the (win, linux) pair
+//            [varint filesize | zigzag data_offset]        files only. data_offset is relative
+//                                                          to where the previous file's stored
+//                                                          payload ends, 0 when it follows it
+//            [u8 codec | varint stored_size]   only with kser_entry_codec set
+//            [varint link_target]              only with kser_entry_hard_link set, as the
+//                                              distance back from this entry
+//            [zigzag mtime_ns | zigzag inode]  only with kser_entry_stat set, each relative to
+//                                              the previous entry with kser_entry_stat
+//            [varint extent_count | extent_count * (varint gap | varint length)]
+//                                              only with kser_entry_sparse set. gap is the
+//                                              distance from the end of the previous extent
+//            [u64 checksum]                    only with kser_entry_checksum set
+//
+// entries are sorted by name, so neighbours share most of their path, and a tree has only a
+// handful of distinct permission pairs: a record is usually a few bytes plus the last name
+// component. it is decoded in one forward pass.
+//
+// readers find the index through the fixed-size trailer at the end of the file, so any entry
+// can be reached without reading the ones before it. v1 archives (u32 count, records, data)
+// have no magic and are still read.
+//
+// streaming archives (kser_archive_stream) are written and read strictly front to back, e.g.
+// through a pipe. there is no index, each entry's record comes right before its payload:
+//
+//   header   magic "KSER" | u16 version | u16 archive flags (kser_archive_stream)
+//   entries  per entry, in path order:
+//            u8 isDir | u8 entry flags | u32 filename_len | filename |
+//            i32 win_perms | i32 linux_perms | u64 filesize
+//            [u8 codec]                     only with kser_entry_codec set
+//            [u64 link_target]              only with kser_entry_hard_link set
+//            [i64 mtime_ns | u64 inode]     only with kser_entry_stat set
+//            [u32 extent_count | extent_count * (u64 offset | u64 length)]
+//                                           only with kser_entry_sparse set
+//            [u64 same_as]                  only with kser_entry_shared set
+//            payload                        files that are neither links nor shared. a raw
+//                                           payload holds the file's data bytes, a klz payload
+//                                           blocks until they expand to that many bytes
+//            [u64 checksum]                 only with kser_entry_checksum set, after the payload
+//   end      u8 kser_stream_end | u64 entry count | u64 xxh64 of all record bytes
+//
+// link_target and same_as are numbers of earlier entries: a hard link of that file, or a file
+// with the same contents whose payload isn't repeated.
+
+constexpr char kser_magic[4] = { 'K', 'S', 'E', 'R' };
+constexpr char kser_trailer_magic[8] = { 'K', 'S', 'E', 'R', 'I', 'D', 'X', '\0' };
+constexpr uint16_t kser_version = 2;
+
+struct kser_file_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t flags;
+};
+
+struct kser_trailer {
+    uint64_t index_offset;
+    uint64_t index_length;
+    char magic[8];
+};
+
+// archive flags
+// every index is followed by its checksum, checked before any of it is parsed
+constexpr uint16_t kser_archive_checksums = 0x0001;
+// records and payloads interleaved, no index or trailer (see above)
+constexpr uint16_t kser_archive_stream = 0x0002;
+// the index is in the compact encoding (see above)
+constexpr uint16_t kser_archive_compact_index = 0x0004;
+// no payloads, only the index: files have their size and permissions but no data, so the
+// archive can be applied onto an existing tree but not extracted. every data_offset is 0
+// relative to the previous one and stored_size is 0. written with the compact index only
+constexpr uint16_t kser_archive_metadata_only = 0x0008;
+
+static_assert(sizeof(kser_file_header) == 8, "kser_file_header must not be padded");
+static_assert(sizeof(kser_trailer) == 24, "kser_trailer must not be padded");
+
+// entry flags
+constexpr uint8_t kser_entry_codec = 0x01;
+constexpr uint8_t kser_entry_hard_link = 0x02;
+// source file's mtime and inode, used by incremental serialize to spot unchanged files
+constexpr uint8_t kser_entry_stat = 0x04;
+// sparse file: the payload holds only the listed data extents, back to back. the rest of the
+// file is holes. extents are sorted and don't overlap.
+constexpr uint8_t kser_entry_sparse = 0x08;
+// xxh64 of the stored payload bytes (after the codec), so they can be checked without decoding
+constexpr uint8_t kser_entry_checksum = 0x10;
+// streaming archives only: the payload is the one of the earlier entry same_as
+constexpr uint8_t kser_entry_shared = 0x20;
+// compact index only: the entry is a directory (there is no isDir byte)
+constexpr uint8_t kser_entry_dir = 0x40;
+
+// first byte of the end record of a streaming archive, where the next isDir would be
+constexpr uint8_t kser_stream_end = 0xff;
+
+// smallest possible index record: isDir, flags, filename_len, win, linux, filesize, data_offset
+constexpr uint64_t kser_min_index_record = 1 + 1 + 4 + 4 + 4 + 8 + 8;
+// and in the compact index: flags, shared, suffix_len, permissions
+constexpr uint64_t kser_min_compact_record = 4;
+
+// appends value as a varint to out (at least 10 bytes of room), returns the bytes written
+inline size_t put_varint(char* out, uint64_t value) {
+    size_t size = 0;
+    while (value >= 0x80) {
+        out[size++] = static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    out[size++] = static_cast<char>(value);
+    return size;
+}
+
+inline uint64_t zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t unzigzag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+inline bool is_kser_v2(const char* data, uint64_t size) {
+    return size >= sizeof(kser_file_header) + sizeof(kser_trailer) &&
+           std::memcmp(data, kser_magic, sizeof(kser_magic)) == 0;
+}
+
+#endif
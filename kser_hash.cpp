@@ -0,0 +1,148 @@
+#include "kser_hash.h"
+
+#include <cstring>
+
+static constexpr uint64_t prime1 = 11400714785074694791ULL;
+static constexpr uint64_t prime2 = 14029467366897019727ULL;
+static constexpr uint64_t prime3 = 1609587929392839161ULL;
+static constexpr uint64_t prime4 = 9650029242287828579ULL;
+static constexpr uint64_t prime5 = 2870177450012600261ULL;
+
+static inline uint64_t rotl(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t read64(const unsigned char* p) {
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t read32(const unsigned char* p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * prime2;
+    acc = rotl(acc, 31);
+    return acc * prime1;
+}
+
+static inline uint64_t merge_round(uint64_t acc, uint64_t value) {
+    acc ^= xxh_round(0, value);
+    return acc * prime1 + prime4;
+}
+
+// the four accumulators of a fresh hash
+static inline void init_accumulators(uint64_t acc[4], uint64_t seed) {
+    acc[0] = seed + prime1 + prime2;
+    acc[1] = seed + prime2;
+    acc[2] = seed;
+    acc[3] = seed - prime1;
+}
+
+// consumes whole 32 byte stripes and returns where the unconsumed tail starts
+static inline const unsigned char* consume_stripes(uint64_t acc[4], const unsigned char* p, const unsigned char* end) {
+    while (end - p >= 32) {
+        acc[0] = xxh_round(acc[0], read64(p));
+        acc[1] = xxh_round(acc[1], read64(p + 8));
+        acc[2] = xxh_round(acc[2], read64(p + 16));
+        acc[3] = xxh_round(acc[3], read64(p + 24));
+        p += 32;
+    }
+    return p;
+}
+
+static inline uint64_t merge_accumulators(const uint64_t acc[4]) {
+    uint64_t h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+    h = merge_round(h, acc[0]);
+    h = merge_round(h, acc[1]);
+    h = merge_round(h, acc[2]);
+    h = merge_round(h, acc[3]);
+    return h;
+}
+
+// mixes in the last (fewer than 32) bytes and the avalanche
+static uint64_t finish(uint64_t h, const unsigned char* p, const unsigned char* end) {
+    while (end - p >= 8) {
+        h ^= xxh_round(0, read64(p));
+        h = rotl(h, 27) * prime1 + prime4;
+        p += 8;
+    }
+    if (end - p >= 4) {
+        h ^= static_cast<uint64_t>(read32(p)) * prime1;
+        h = rotl(h, 23) * prime2 + prime3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * prime5;
+        h = rotl(h, 11) * prime1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t xxh64(const void* data, size_t size, uint64_t seed) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned char* end = p + size;
+    uint64_t h;
+
+    if (size >= 32) {
+        uint64_t acc[4];
+        init_accumulators(acc, seed);
+        p = consume_stripes(acc, p, end);
+        h = merge_accumulators(acc);
+    }
+    else {
+        h = seed + prime5;
+    }
+    h += static_cast<uint64_t>(size);
+    return finish(h, p, end);
+}
+
+void xxh64_stream::reset(uint64_t seed) {
+    seed_ = seed;
+    init_accumulators(acc_, seed);
+    total_ = 0;
+    pending_size_ = 0;
+}
+
+void xxh64_stream::update(const void* data, size_t size) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned char* end = p + size;
+    total_ += size;
+
+    if (pending_size_ + size < sizeof(pending_)) {
+        if (size > 0) {
+            std::memcpy(pending_ + pending_size_, p, size);
+        }
+        pending_size_ += size;
+        return;
+    }
+    if (pending_size_ > 0) {
+        size_t fill = sizeof(pending_) - pending_size_;
+        std::memcpy(pending_ + pending_size_, p, fill);
+        consume_stripes(acc_, pending_, pending_ + sizeof(pending_));
+        p += fill;
+        pending_size_ = 0;
+    }
+    p = consume_stripes(acc_, p, end);
+    pending_size_ = static_cast<size_t>(end - p);
+    if (pending_size_ > 0) {
+        std::memcpy(pending_, p, pending_size_);
+    }
+}
+
+uint64_t xxh64_stream::digest() const {
+    uint64_t h = total_ >= 32 ? merge_accumulators(acc_) : seed_ + prime5;
+    h += total_;
+    return finish(h, pending_, pending_ + pending_size_);
+}
@@ -0,0 +1,29 @@
+#pragma once
+#ifndef K_SER_HASH_IMPL
+#define K_SER_HASH_IMPL
+
+#include <cstddef>
+#include <cstdint>
+
+// xxHash64 (non-cryptographic, a few GB/s per core). used to find candidate duplicates, which
+// are always confirmed byte by byte before anything is shared, and as the archive checksums.
+uint64_t xxh64(const void* data, size_t size, uint64_t seed = 0);
+
+// xxh64 over data that arrives in pieces. digest() equals xxh64() of all pieces joined.
+class xxh64_stream {
+public:
+    explicit xxh64_stream(uint64_t seed = 0) { reset(seed); }
+
+    void reset(uint64_t seed = 0);
+    void update(const void* data, size_t size);
+    uint64_t digest() const;
+
+private:
+    uint64_t seed_ = 0;
+    uint64_t acc_[4] = {};
+    uint64_t total_ = 0;
+    unsigned char pending_[32] = {};
+    size_t pending_size_ = 0;
+};
+
+#endif
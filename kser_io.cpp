@@ -0,0 +1,467 @@
+#include "kser_io.h"
+#include "kser_hash.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#if defined(OS_LINUX)
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+
+#include <memory>
+#include <string>
+
+static void throw_copy_error(const char* what) {
+    std::string message = std::string(what) + ": " + std::strerror(errno);
+    throw_u8string_error(std::u8string(message.begin(), message.end()));
+}
+
+static void throw_short_copy() {
+    throw_u8string_error(u8"unexpected end of file while copying data (possibly incorrect data format)");
+}
+
+// errors meaning "this way of copying isn't supported here", not real i/o errors
+static bool copy_not_supported(int error) {
+    return error == EXDEV || error == EINVAL || error == ENOSYS || error == EOPNOTSUPP || error == EBADF;
+}
+
+void unique_fd::reset(int fd) {
+    if (fd_ != -1) {
+        close(fd_);
+    }
+    fd_ = fd;
+}
+
+dir_fd_cache::dir_fd_cache(int root, size_t capacity) : root_(root), capacity_(capacity) {
+    dirs_.reserve(capacity);
+}
+
+int dir_fd_cache::get(std::string_view path) {
+    if (path.empty()) {
+        return root_;
+    }
+    if (last_ < dirs_.size() && dirs_[last_].path == path) {
+        dirs_[last_].used = ++clock_;
+        return dirs_[last_].fd.get();
+    }
+    for (size_t k = 0; k < dirs_.size(); k++) {
+        if (dirs_[k].path == path) {
+            last_ = k;
+            dirs_[k].used = ++clock_;
+            return dirs_[k].fd.get();
+        }
+    }
+    unique_fd fd(openat(root_, std::string(path).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (!fd) {
+        return -1;
+    }
+    put(path, std::move(fd));
+    return dirs_[last_].fd.get();
+}
+
+void dir_fd_cache::put(std::string_view path, unique_fd fd) {
+    size_t slot = dirs_.size();
+    if (dirs_.size() == capacity_) {
+        slot = 0;
+        for (size_t k = 1; k < dirs_.size(); k++) {
+            if (dirs_[k].used < dirs_[slot].used) {
+                slot = k;
+            }
+        }
+    }
+    else {
+        dirs_.emplace_back();
+    }
+    dirs_[slot].path.assign(path);
+    dirs_[slot].fd = std::move(fd);
+    dirs_[slot].used = ++clock_;
+    last_ = slot;
+}
+
+bool clone_fd(int src_fd, int dst_fd) {
+    return ioctl(dst_fd, FICLONE, src_fd) == 0;
+}
+
+void write_fd_range(int fd, uint64_t offset, const char* data, size_t size) {
+    for (size_t written = 0; written < size;) {
+        ssize_t n = pwrite(fd, data + written, size - written, static_cast<off_t>(offset + written));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw_copy_error("write failed");
+        }
+        written += n;
+    }
+}
+
+fd_writer::fd_writer(int fd, uint64_t offset) : fd_(fd), offset_(offset) {
+    buffer_.reserve(copy_buffer_size);
+}
+
+fd_writer::~fd_writer() {
+    try {
+        flush();
+    }
+    catch (...) {
+    }
+}
+
+fd_writer& fd_writer::write(const char* data, size_t size) {
+    if (buffer_.size() + size > copy_buffer_size) {
+        flush();
+    }
+    if (size >= copy_buffer_size) {
+        write_fd_range(fd_, offset_, data, size);
+        offset_ += size;
+        return *this;
+    }
+    buffer_.append(data, size);
+    return *this;
+}
+
+void fd_writer::flush() {
+    write_fd_range(fd_, offset_, buffer_.data(), buffer_.size());
+    offset_ += buffer_.size();
+    buffer_.clear();
+}
+
+void page_cache_trimmer::advance(uint64_t end) {
+    if (end < started_ + window) {
+        return;
+    }
+    // the previous window had a full window's time to reach the disk, wait for it and drop it
+    if (started_ > dropped_) {
+        sync_file_range(fd_, static_cast<off_t>(dropped_), static_cast<off_t>(started_ - dropped_),
+            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd_, static_cast<off_t>(dropped_), static_cast<off_t>(started_ - dropped_), POSIX_FADV_DONTNEED);
+        dropped_ = started_;
+    }
+    sync_file_range(fd_, static_cast<off_t>(started_), static_cast<off_t>(end - started_), SYNC_FILE_RANGE_WRITE);
+    started_ = end;
+}
+
+void preallocate_fd(int fd, uint64_t size) {
+    if (size > 0) {
+        fallocate(fd, 0, 0, static_cast<off_t>(size));
+    }
+}
+
+static void copy_with_buffer(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset, uint64_t len) {
+    static thread_local std::unique_ptr<char[]> buffer;
+    if (!buffer) {
+        buffer.reset(new char[copy_buffer_size]);
+    }
+
+    while (len > 0) {
+        size_t chunk = len < copy_buffer_size ? static_cast<size_t>(len) : copy_buffer_size;
+        ssize_t read_bytes = pread(in_fd, buffer.get(), chunk, static_cast<off_t>(in_offset));
+        if (read_bytes < 0) {
+            if (errno == EINTR) continue;
+            throw_copy_error("read failed");
+        }
+        if (read_bytes == 0) {
+            throw_short_copy();
+        }
+        for (ssize_t written = 0; written < read_bytes;) {
+            ssize_t n = pwrite(out_fd, buffer.get() + written, read_bytes - written, static_cast<off_t>(out_offset + written));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw_copy_error("write failed");
+            }
+            written += n;
+        }
+        in_offset += read_bytes;
+        out_offset += read_bytes;
+        len -= read_bytes;
+    }
+}
+
+copy_method copy_fd_range(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset, uint64_t len) {
+    if (len == 0) {
+        return copy_method::none;
+    }
+
+    copy_method method = copy_method::copy_file_range;
+    loff_t in_pos = static_cast<loff_t>(in_offset);
+    loff_t out_pos = static_cast<loff_t>(out_offset);
+    while (len > 0) {
+        ssize_t n = copy_file_range(in_fd, &in_pos, out_fd, &out_pos, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (!copy_not_supported(errno)) throw_copy_error("copy_file_range failed");
+            method = copy_method::sendfile;
+            break;
+        }
+        if (n == 0) {
+            throw_short_copy();
+        }
+        len -= n;
+    }
+    if (len == 0) {
+        return method;
+    }
+
+    // sendfile writes at the current position of out_fd
+    off_t sendfile_pos = static_cast<off_t>(in_pos);
+    if (lseek(out_fd, static_cast<off_t>(out_pos), SEEK_SET) != -1) {
+        while (len > 0) {
+            ssize_t n = sendfile(out_fd, in_fd, &sendfile_pos, len);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (!copy_not_supported(errno)) throw_copy_error("sendfile failed");
+                break;
+            }
+            if (n == 0) {
+                throw_short_copy();
+            }
+            out_pos += n;
+            len -= n;
+        }
+        if (len == 0) {
+            return method;
+        }
+    }
+
+    copy_with_buffer(in_fd, static_cast<uint64_t>(sendfile_pos), out_fd, static_cast<uint64_t>(out_pos), len);
+    return copy_method::buffer;
+}
+
+#endif
+
+#if defined(OS_LINUX)
+
+static std::u8string reason_u8string(const std::exception& e) {
+    std::string reason = e.what();
+    return std::u8string(reason.begin(), reason.end());
+}
+
+static uint64_t end_offset(int fd) {
+    off_t end = fd == -1 ? 0 : lseek(fd, 0, SEEK_END);
+    return end > 0 ? static_cast<uint64_t>(end) : 0;
+}
+
+archive_sink::archive_sink(const fs::path& path, bool append)
+    : path_(path),
+      fd_(open(path.c_str(), append ? O_WRONLY | O_CLOEXEC : O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)),
+      writer_(fd_.get(), append ? end_offset(fd_.get()) : 0),
+      trimmer_(fd_.get(), writer_.offset()) {
+    if (!fd_) {
+        throw_u8string_error(u8"failed to open " + path.u8string() + u8" for writing");
+    }
+}
+
+archive_sink::~archive_sink() = default;
+
+void archive_sink::write(const char* data, size_t size) {
+    writer_.write(data, size);
+}
+
+uint64_t archive_sink::copy_file(const fs::path& source, uint64_t size, const std::vector<file_extent>* extents) {
+    source_file in(source, extents);
+    if (!copy_buffer_) {
+        copy_buffer_.reset(new char[copy_buffer_size]);
+    }
+    xxh64_stream hash;
+    writer_.flush();
+    for (uint64_t left = size; left > 0;) {
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(left, copy_buffer_size));
+        in.read(copy_buffer_.get(), chunk);
+        hash.update(copy_buffer_.get(), chunk);
+        try {
+            write_fd_range(fd_.get(), writer_.offset(), copy_buffer_.get(), chunk);
+        }
+        catch (const std::exception& e) {
+            throw_u8string_error(u8"failed to write " + source.u8string() + u8" data to " + path_.u8string()
+                + u8": " + reason_u8string(e));
+        }
+        writer_.skip(chunk);
+        left -= chunk;
+        trimmer_.advance(writer_.offset());
+    }
+    // both sides are dropped from the page cache behind us so a huge tree doesn't evict everything else
+    in.drop_cache();
+    return hash.digest();
+}
+
+void archive_sink::copy_range(int in_fd, uint64_t in_offset, uint64_t size) {
+    writer_.flush();
+    try {
+        copy_fd_range(in_fd, in_offset, fd_.get(), writer_.offset(), size);
+    }
+    catch (const std::exception& e) {
+        throw_u8string_error(u8"failed to write to " + path_.u8string() + u8": " + reason_u8string(e));
+    }
+    writer_.skip(size);
+    trimmer_.advance(writer_.offset());
+}
+
+void archive_sink::flush() {
+    writer_.flush();
+}
+
+uint64_t archive_sink::offset() const {
+    return writer_.offset();
+}
+
+source_file::source_file(const fs::path& path, const std::vector<file_extent>* extents)
+    : path_(path), fd_(open(path.c_str(), O_RDONLY | O_CLOEXEC)) {
+    if (!fd_) {
+        throw_u8string_error(u8"failed to open source file: " + path.u8string());
+    }
+    posix_fadvise(fd_.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (extents) {
+        extents_ = *extents;
+    }
+    else {
+        extents_.push_back({ 0, UINT64_MAX });
+    }
+}
+
+void source_file::read(char* data, size_t size) {
+    while (size > 0) {
+        if (!next_extent()) {
+            throw_u8string_error(u8"file got shorter while serializing: " + path_.u8string());
+        }
+        const file_extent& extent = extents_[extent_];
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(size, extent.length - extent_pos_));
+        ssize_t n = pread(fd_.get(), data, chunk, static_cast<off_t>(extent.offset + extent_pos_));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw_u8string_error(u8"failed to read " + path_.u8string());
+        }
+        if (n == 0) {
+            throw_u8string_error(u8"file got shorter while serializing: " + path_.u8string());
+        }
+        data += n;
+        size -= n;
+        extent_pos_ += n;
+    }
+}
+
+void source_file::drop_cache() {
+    posix_fadvise(fd_.get(), 0, 0, POSIX_FADV_DONTNEED);
+}
+
+std::vector<file_extent> find_data_extents(const fs::path& path, uint64_t size) {
+    std::vector<file_extent> extents;
+    unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!fd) {
+        throw_u8string_error(u8"failed to open source file: " + path.u8string());
+    }
+    off_t pos = 0;
+    while (static_cast<uint64_t>(pos) < size) {
+        off_t data = lseek(fd.get(), pos, SEEK_DATA);
+        if (data == -1) {
+            if (errno == ENXIO) {
+                // only a hole is left
+                break;
+            }
+            // no SEEK_DATA support, treat the file as all data
+            return { { 0, size } };
+        }
+        if (static_cast<uint64_t>(data) >= size) {
+            break;
+        }
+        off_t hole = lseek(fd.get(), data, SEEK_HOLE);
+        if (hole == -1) {
+            return { { 0, size } };
+        }
+        uint64_t end = std::min<uint64_t>(static_cast<uint64_t>(hole), size);
+        extents.push_back({ static_cast<uint64_t>(data), end - static_cast<uint64_t>(data) });
+        pos = static_cast<off_t>(end);
+    }
+    return extents;
+}
+
+#else
+
+archive_sink::archive_sink(const fs::path& path, bool append)
+    : path_(path),
+      out_(std::make_unique<std::ofstream>(path, append ? std::ios::binary | std::ios::in | std::ios::out
+                                                        : std::ios::binary | std::ios::trunc)) {
+    if (!*out_ || (append && !out_->seekp(0, std::ios::end))) {
+        throw_u8string_error(u8"failed to open " + path.u8string() + u8" for writing");
+    }
+}
+
+archive_sink::~archive_sink() = default;
+
+void archive_sink::write(const char* data, size_t size) {
+    if (!out_->write(data, size)) {
+        throw_u8string_error(u8"failed to write to " + path_.u8string());
+    }
+}
+
+uint64_t archive_sink::copy_file(const fs::path& source, uint64_t size, const std::vector<file_extent>* extents) {
+    source_file in(source, extents);
+    if (!copy_buffer_) {
+        copy_buffer_.reset(new char[copy_buffer_size]);
+    }
+    xxh64_stream hash;
+    for (uint64_t left = size; left > 0;) {
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(left, copy_buffer_size));
+        in.read(copy_buffer_.get(), chunk);
+        hash.update(copy_buffer_.get(), chunk);
+        write(copy_buffer_.get(), chunk);
+        left -= chunk;
+    }
+    return hash.digest();
+}
+
+void archive_sink::flush() {
+    if (!out_->flush()) {
+        throw_u8string_error(u8"failed to write to " + path_.u8string());
+    }
+}
+
+uint64_t archive_sink::offset() const {
+    return static_cast<uint64_t>(out_->tellp());
+}
+
+source_file::source_file(const fs::path& path, const std::vector<file_extent>* extents)
+    : path_(path), in_(std::make_unique<std::ifstream>(path, std::ios::binary)) {
+    if (!*in_) {
+        throw_u8string_error(u8"failed to open source file: " + path.u8string());
+    }
+    if (extents) {
+        extents_ = *extents;
+    }
+    else {
+        extents_.push_back({ 0, UINT64_MAX });
+    }
+}
+
+void source_file::read(char* data, size_t size) {
+    while (size > 0) {
+        if (!next_extent()) {
+            throw_u8string_error(u8"file got shorter while serializing: " + path_.u8string());
+        }
+        const file_extent& extent = extents_[extent_];
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(size, extent.length - extent_pos_));
+        if (!in_->seekg(static_cast<std::streamoff>(extent.offset + extent_pos_)) || !in_->read(data, chunk)) {
+            throw_u8string_error(u8"file got shorter while serializing: " + path_.u8string());
+        }
+        data += chunk;
+        size -= chunk;
+        extent_pos_ += chunk;
+    }
+}
+
+std::vector<file_extent> find_data_extents(const fs::path& path, uint64_t size) {
+    (void)path;
+    return { { 0, size } };
+}
+
+#endif
+
+bool source_file::next_extent() {
+    while (extent_ < extents_.size() && extent_pos_ == extents_[extent_].length) {
+        extent_++;
+        extent_pos_ = 0;
+    }
+    return extent_ < extents_.size();
+}
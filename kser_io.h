@@ -0,0 +1,215 @@
+#pragma once
+#ifndef K_SER_IO_IMPL
+#define K_SER_IO_IMPL
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <memory>
+#include <fstream>
+#include <vector>
+
+#include "kserialize.h"
+
+// size of the reusable buffer used when the kernel can't copy for us. copies never
+// allocate more than this, however large the file is.
+constexpr size_t copy_buffer_size = 1 << 20;
+
+#if defined(OS_LINUX)
+
+// how the last copy_fd_range call moved its data
+enum class copy_method {
+    none,
+    copy_file_range,
+    sendfile,
+    buffer
+};
+
+// copies len bytes from in_fd at in_offset to out_fd at out_offset, without touching the
+// file positions. tries copy_file_range (in-kernel copy, reflink or server-side copy where
+// the file system supports it), then sendfile, then pread/pwrite through a fixed buffer.
+// throws on errors and if in_fd ends before len bytes were copied.
+copy_method copy_fd_range(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset, uint64_t len);
+
+// reserves size bytes for a file that is about to be written. best effort, errors are ignored.
+void preallocate_fd(int fd, uint64_t size);
+
+// makes dst_fd share src_fd's data blocks (FICLONE reflink). returns false where the file
+// system can't, the caller then copies the data
+bool clone_fd(int src_fd, int dst_fd);
+
+// writes size bytes at offset with pwrite, retrying short writes
+void write_fd_range(int fd, uint64_t offset, const char* data, size_t size);
+
+// buffered sequential writer on a raw fd. write() has the same shape as ostream::write so
+// record writing code works with both.
+class fd_writer {
+public:
+    explicit fd_writer(int fd, uint64_t offset = 0);
+    ~fd_writer();
+
+    fd_writer& write(const char* data, size_t size);
+    void flush();
+
+    // file offset of the next byte written (buffered bytes included)
+    uint64_t offset() const { return offset_ + buffer_.size(); }
+    // the caller wrote size bytes at offset() directly on the fd, e.g. with copy_fd_range
+    void skip(uint64_t size) {
+        flush();
+        offset_ += size;
+    }
+
+private:
+    int fd_;
+    uint64_t offset_;
+    std::string buffer_;
+};
+
+// starts writeback of data written to fd and drops it from the page cache one window later,
+// so writing a multi-TB archive doesn't evict everything else. call advance() with the
+// current end of the written data.
+class page_cache_trimmer {
+public:
+    // start is where writing begins, data before it is left alone
+    explicit page_cache_trimmer(int fd, uint64_t start = 0) : fd_(fd), dropped_(start), started_(start) {}
+    void advance(uint64_t end);
+
+private:
+    static constexpr uint64_t window = 64ull << 20;
+    int fd_;
+    uint64_t dropped_;
+    uint64_t started_;
+};
+
+// closes fd on scope exit
+class unique_fd {
+public:
+    unique_fd() = default;
+    explicit unique_fd(int fd) : fd_(fd) {}
+    ~unique_fd() { reset(); }
+    unique_fd(unique_fd&& other) noexcept : fd_(other.release()) {}
+    unique_fd& operator=(unique_fd&& other) noexcept {
+        if (this != &other) {
+            reset(other.release());
+        }
+        return *this;
+    }
+    unique_fd(const unique_fd&) = delete;
+    unique_fd& operator=(const unique_fd&) = delete;
+
+    int get() const { return fd_; }
+    explicit operator bool() const { return fd_ != -1; }
+    int release() {
+        int fd = fd_;
+        fd_ = -1;
+        return fd;
+    }
+    void reset(int fd = -1);
+
+private:
+    int fd_ = -1;
+};
+
+// open directories of a tree being extracted, found by their path relative to its root. a
+// directory is opened with one openat from the root and kept, so the entries in it are made
+// with *at syscalls on that fd instead of resolving their full path each time. at most capacity
+// fds are kept, the least recently used one is closed first, so an fd from get() stays valid
+// until capacity - 1 other directories were asked for. not thread safe, one per thread
+class dir_fd_cache {
+public:
+    // root is an open directory fd that outlives the cache
+    explicit dir_fd_cache(int root, size_t capacity = 64);
+
+    // fd of the directory at path ("" is the root), opened on a miss. -1 with errno set when
+    // it can't be opened
+    int get(std::string_view path);
+    // keeps fd, just opened for the directory at path
+    void put(std::string_view path, unique_fd fd);
+
+private:
+    struct open_dir {
+        std::string path;
+        unique_fd fd;
+        uint64_t used = 0;
+    };
+
+    int root_;
+    size_t capacity_;
+    uint64_t clock_ = 0;
+    // most lookups are for the directory of the entry before, it's checked first
+    size_t last_ = 0;
+    std::vector<open_dir> dirs_;
+};
+
+#endif
+
+// a range of a file that holds data. everything outside the extents of a sparse file is a hole.
+struct file_extent {
+    uint64_t offset = 0;
+    uint64_t length = 0;
+};
+
+// data extents of the first size bytes of a file, found with SEEK_DATA/SEEK_HOLE on linux.
+// gives one extent over the whole file where holes can't be found.
+std::vector<file_extent> find_data_extents(const fs::path& path, uint64_t size);
+
+// the archive being written: buffered writes plus whole-file copies. copies pass through one
+// reused buffer so their checksum is taken on the way; on linux they are positioned writes on
+// the archive fd with the page cache trimmed behind us, elsewhere they go through iostreams
+class archive_sink {
+public:
+    // append continues after the current end of an existing file instead of truncating it
+    explicit archive_sink(const fs::path& path, bool append = false);
+    ~archive_sink();
+
+    void write(const char* data, size_t size);
+    // appends size bytes of the file at source (from its start). with extents, appends just
+    // those ranges back to back (size is then their total length). returns xxh64 of the bytes
+    uint64_t copy_file(const fs::path& source, uint64_t size, const std::vector<file_extent>* extents = nullptr);
+#if defined(OS_LINUX)
+    // appends size bytes of in_fd starting at in_offset
+    void copy_range(int in_fd, uint64_t in_offset, uint64_t size);
+#endif
+    void flush();
+    uint64_t offset() const;
+
+private:
+    fs::path path_;
+    std::unique_ptr<char[]> copy_buffer_;
+#if defined(OS_LINUX)
+    unique_fd fd_;
+    fd_writer writer_;
+    page_cache_trimmer trimmer_;
+#else
+    std::unique_ptr<std::ofstream> out_;
+#endif
+};
+
+// sequential reader for a source file. with extents, only those ranges are read, back to back.
+class source_file {
+public:
+    explicit source_file(const fs::path& path, const std::vector<file_extent>* extents = nullptr);
+    // reads exactly size bytes, throws if the file is shorter
+    void read(char* data, size_t size);
+#if defined(OS_LINUX)
+    // drops what was read from the page cache
+    void drop_cache();
+#endif
+
+private:
+    // the extent to read from next, moving on from exhausted ones. false if none is left
+    bool next_extent();
+
+    fs::path path_;
+    std::vector<file_extent> extents_;
+    size_t extent_ = 0;
+    uint64_t extent_pos_ = 0;
+#if defined(OS_LINUX)
+    unique_fd fd_;
+#else
+    std::unique_ptr<std::ifstream> in_;
+#endif
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include "kser_log.h"
+
+#include <mutex>
+
+static std::atomic<log_level> min_log_level{log_level::info};
+static std::atomic<log_queue*> current_log_queue{nullptr};
+static std::mutex log_mutex;
+static log_handler current_log_handler;
+
+const char* log_level_name(log_level level) {
+    switch (level) {
+    case log_level::debug: return "debug";
+    case log_level::info: return "info";
+    case log_level::warning: return "warning";
+    case log_level::error: return "error";
+    }
+    return "info";
+}
+
+void set_log_level(log_level level) {
+    min_log_level.store(level, std::memory_order_relaxed);
+}
+
+bool log_enabled(log_level level) {
+    return level >= min_log_level.load(std::memory_order_relaxed);
+}
+
+void set_log_handler(log_handler handler) {
+    std::lock_guard<std::mutex> lock(log_mutex);
+    current_log_handler = std::move(handler);
+}
+
+void set_log_queue(log_queue* queue) {
+    current_log_queue.store(queue, std::memory_order_release);
+}
+
+void addToLog(log_level level, std::u8string message) {
+    if (!log_enabled(level)) {
+        return;
+    }
+    if (log_queue* queue = current_log_queue.load(std::memory_order_acquire)) {
+        queue->push(level, std::move(message));
+        return;
+    }
+    std::lock_guard<std::mutex> lock(log_mutex);
+    if (current_log_handler) {
+        current_log_handler(level, message);
+    }
+}
+
+void addToLog(std::u8string message) {
+    addToLog(log_level::info, std::move(message));
+}
+
+log_queue::log_queue(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    cells_ = std::make_unique<cell[]>(size);
+    mask_ = size - 1;
+    for (size_t i = 0; i < size; ++i) {
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+// a cell whose sequence equals the position is free for the producer that claims that
+// position; after the write it becomes position + 1, which the consumer waits for. the
+// consumer hands it back as position + capacity for the next round.
+bool log_queue::push(log_level level, std::u8string message) {
+    size_t position = head_.load(std::memory_order_relaxed);
+    for (;;) {
+        cell& c = cells_[position & mask_];
+        size_t sequence = c.sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+        if (diff == 0) {
+            if (head_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                c.level = level;
+                c.message = std::move(message);
+                c.sequence.store(position + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        else {
+            position = head_.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+size_t log_queue::drain(const std::function<void(log_level, std::u8string&)>& consume) {
+    size_t count = 0;
+    for (;;) {
+        cell& c = cells_[tail_ & mask_];
+        if (c.sequence.load(std::memory_order_acquire) != tail_ + 1) {
+            // empty, or the producer of this cell hasn't finished writing it yet
+            return count;
+        }
+        consume(c.level, c.message);
+        c.message.clear();
+        c.message.shrink_to_fit();
+        c.sequence.store(tail_ + mask_ + 1, std::memory_order_release);
+        ++tail_;
+        ++count;
+    }
+}
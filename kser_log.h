@@ -0,0 +1,71 @@
+#pragma once
+#ifndef K_SER_LOG_IMPL
+#define K_SER_LOG_IMPL
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+// per-file messages (created, wrote data to, ...) are debug, messages about the whole run info
+enum class log_level : uint8_t { debug, info, warning, error };
+
+// "debug", "info", ...
+const char* log_level_name(log_level level);
+
+// messages below level are dropped before they reach a handler or queue. default: info
+void set_log_level(log_level level);
+bool log_enabled(log_level level);
+
+// the engine reports progress through addToLog. the cli prints it to stderr from the calling
+// thread, the gui has it queued (set_log_queue) and shows it from a timer.
+// without a handler or queue messages are dropped.
+using log_handler = std::function<void(log_level, const std::u8string&)>;
+void set_log_handler(log_handler handler);
+
+// bounded lock-free queue of log messages (vyukov's array queue). any thread may push, one
+// thread drains. push never blocks or waits for the consumer: when the queue is full the
+// message is dropped and counted, so a slow log view can't slow down the engine.
+class log_queue {
+public:
+    // capacity is rounded up to a power of two
+    explicit log_queue(size_t capacity = 1 << 16);
+
+    log_queue(const log_queue&) = delete;
+    log_queue& operator=(const log_queue&) = delete;
+
+    // false when the queue was full and the message was dropped
+    bool push(log_level level, std::u8string message);
+
+    // calls consume for every queued message in push order, returns how many there were.
+    // only one thread may drain at a time.
+    size_t drain(const std::function<void(log_level, std::u8string&)>& consume);
+
+    // messages dropped since the last call
+    uint64_t take_dropped() { return dropped_.exchange(0, std::memory_order_relaxed); }
+
+private:
+    struct cell {
+        std::atomic<size_t> sequence;
+        log_level level = log_level::info;
+        std::u8string message;
+    };
+
+    std::unique_ptr<cell[]> cells_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) size_t tail_ = 0;
+    alignas(64) std::atomic<uint64_t> dropped_{0};
+};
+
+// while a queue is set, addToLog pushes to it instead of calling the handler. the queue must
+// outlive every engine call made while it is set; nullptr switches back to the handler.
+void set_log_queue(log_queue* queue);
+
+void addToLog(log_level level, std::u8string message);
+// info
+void addToLog(std::u8string message);
+
+#endif
@@ -0,0 +1,128 @@
+#include "kser_pool.h"
+
+static thread_local const work_stealing_pool* current_pool = nullptr;
+static thread_local int current_worker = -1;
+
+unsigned work_stealing_pool::resolve_thread_count(unsigned threads) {
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    return threads == 0 ? 1 : threads;
+}
+
+work_stealing_pool::work_stealing_pool(unsigned threads) {
+    threads = resolve_thread_count(threads);
+    for (unsigned i = 0; i < threads; i++) {
+        queues.push_back(std::make_unique<task_queue>());
+    }
+    for (unsigned i = 0; i < threads; i++) {
+        workers.emplace_back([this, i] { worker_loop(i); });
+    }
+}
+
+work_stealing_pool::~work_stealing_pool() {
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        stopping = true;
+    }
+    work_available.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+int work_stealing_pool::worker_index() const {
+    return current_pool == this ? current_worker : -1;
+}
+
+void work_stealing_pool::submit(std::function<void()> task) {
+    int index = worker_index();
+    unsigned target = index >= 0 ? static_cast<unsigned>(index)
+                                 : next_queue.fetch_add(1, std::memory_order_relaxed) % size();
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        pending++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(queues[target]->mutex);
+        queues[target]->tasks.push_back(std::move(task));
+    }
+    {
+        // published under state_mutex so a worker going to sleep can't miss it
+        std::lock_guard<std::mutex> lock(state_mutex);
+        queued.fetch_add(1, std::memory_order_release);
+    }
+    work_available.notify_one();
+}
+
+bool work_stealing_pool::pop_task(unsigned index, std::function<void()>& task) {
+    {
+        task_queue& own = *queues[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (unsigned i = 1; i < size(); i++) {
+        task_queue& victim = *queues[(index + i) % size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void work_stealing_pool::worker_loop(unsigned index) {
+    current_pool = this;
+    current_worker = static_cast<int>(index);
+
+    for (;;) {
+        std::function<void()> task;
+        if (queued.load(std::memory_order_acquire) > 0 && pop_task(index, task)) {
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            if (!failed.load(std::memory_order_relaxed)) {
+                try {
+                    task();
+                }
+                catch (...) {
+                    std::lock_guard<std::mutex> lock(state_mutex);
+                    if (!first_error) {
+                        first_error = std::current_exception();
+                    }
+                    failed.store(true, std::memory_order_relaxed);
+                }
+            }
+            task = nullptr;
+
+            std::lock_guard<std::mutex> lock(state_mutex);
+            if (--pending == 0) {
+                all_done.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(state_mutex);
+        work_available.wait(lock, [this] {
+            return stopping || queued.load(std::memory_order_acquire) > 0;
+        });
+        if (stopping && queued.load(std::memory_order_acquire) == 0) {
+            return;
+        }
+    }
+}
+
+void work_stealing_pool::wait() {
+    std::unique_lock<std::mutex> lock(state_mutex);
+    all_done.wait(lock, [this] { return pending == 0; });
+    if (first_error) {
+        std::exception_ptr error = first_error;
+        first_error = nullptr;
+        failed.store(false, std::memory_order_relaxed);
+        std::rethrow_exception(error);
+    }
+}
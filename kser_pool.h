@@ -0,0 +1,62 @@
+#pragma once
+#ifndef K_SER_POOL_IMPL
+#define K_SER_POOL_IMPL
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// fixed set of worker threads, each with its own task deque.
+// a worker pops its newest task first (depth first, good locality for tree walks)
+// and steals the oldest task of another worker when its own deque is empty.
+// tasks may submit more tasks. the first exception thrown by a task is kept,
+// the remaining queued tasks are dropped and wait() rethrows it.
+class work_stealing_pool {
+public:
+    // threads == 0 uses std::thread::hardware_concurrency()
+    explicit work_stealing_pool(unsigned threads = 0);
+    ~work_stealing_pool();
+
+    work_stealing_pool(const work_stealing_pool&) = delete;
+    work_stealing_pool& operator=(const work_stealing_pool&) = delete;
+
+    void submit(std::function<void()> task);
+    void wait();
+
+    unsigned size() const { return static_cast<unsigned>(workers.size()); }
+
+    // index of the calling worker thread of this pool, or -1 for other threads
+    int worker_index() const;
+
+    static unsigned resolve_thread_count(unsigned threads);
+
+private:
+    struct task_queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    bool pop_task(unsigned index, std::function<void()>& task);
+    void worker_loop(unsigned index);
+
+    std::vector<std::unique_ptr<task_queue>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex state_mutex;
+    std::condition_variable work_available;
+    std::condition_variable all_done;
+    std::atomic<size_t> queued{ 0 };
+    size_t pending = 0;
+    bool stopping = false;
+    std::atomic<bool> failed{ false };
+    std::exception_ptr first_error;
+    std::atomic<unsigned> next_queue{ 0 };
+};
+
+#endif
@@ -0,0 +1,204 @@
+#include "kser_stats.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstdarg>
+#include <cstdio>
+
+const char* kser_phase_name(kser_phase phase) {
+    switch (phase) {
+    case kser_phase::old_archive: return "old_archive";
+    case kser_phase::scan: return "scan";
+    case kser_phase::sort: return "sort";
+    case kser_phase::dedup: return "dedup";
+    case kser_phase::sparse: return "sparse";
+    case kser_phase::payloads: return "payloads";
+    case kser_phase::index: return "index";
+    case kser_phase::parse: return "parse";
+    case kser_phase::directories: return "directories";
+    case kser_phase::files: return "files";
+    case kser_phase::file_permissions: return "file_permissions";
+    case kser_phase::permissions: return "permissions";
+    case kser_phase::verify: return "verify";
+    }
+    return "unknown";
+}
+
+const char* kser_counter_name(kser_counter counter) {
+    switch (counter) {
+    case kser_counter::entries: return "entries";
+    case kser_counter::bytes: return "bytes";
+    case kser_counter::archive_bytes: return "archive_bytes";
+    case kser_counter::scan_syscalls: return "scan_syscalls";
+    case kser_counter::errors: return "errors";
+    }
+    return "unknown";
+}
+
+kser_stats::kser_stats(size_t slowest) : slowest_limit_(slowest) {
+    slowest_.reserve(slowest);
+}
+
+static bool faster(const kser_stats::slow_file& a, const kser_stats::slow_file& b) {
+    return a.ns > b.ns;
+}
+
+void kser_stats::add_file(std::string_view name, uint64_t ns, uint64_t bytes) {
+    uint64_t us = ns / 1000;
+    size_t bucket = std::min<size_t>(std::bit_width(us), latency_buckets - 1);
+    latency_[bucket].fetch_add(1, std::memory_order_relaxed);
+
+    if (slowest_limit_ == 0 || ns <= slowest_threshold_.load(std::memory_order_relaxed)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(slowest_mutex_);
+    if (slowest_.size() == slowest_limit_) {
+        if (ns <= slowest_.front().ns) {
+            return;
+        }
+        std::pop_heap(slowest_.begin(), slowest_.end(), faster);
+        slowest_.pop_back();
+    }
+    slowest_.push_back({ std::string(name), ns, bytes });
+    std::push_heap(slowest_.begin(), slowest_.end(), faster);
+    if (slowest_.size() == slowest_limit_) {
+        slowest_threshold_.store(slowest_.front().ns, std::memory_order_relaxed);
+    }
+}
+
+std::vector<kser_stats::slow_file> kser_stats::slowest() const {
+    std::vector<slow_file> files;
+    {
+        std::lock_guard<std::mutex> lock(slowest_mutex_);
+        files = slowest_;
+    }
+    std::sort(files.begin(), files.end(), faster);
+    return files;
+}
+
+// bounds of a latency bucket in us, see kser_stats::latency_buckets
+static uint64_t bucket_low_us(size_t bucket) {
+    return bucket == 0 ? 0 : uint64_t(1) << (bucket - 1);
+}
+
+static uint64_t bucket_high_us(size_t bucket) {
+    return uint64_t(1) << bucket;
+}
+
+static std::string format(const char* pattern, ...) {
+    char buffer[256];
+    va_list args;
+    va_start(args, pattern);
+    std::vsnprintf(buffer, sizeof(buffer), pattern, args);
+    va_end(args);
+    return buffer;
+}
+
+std::string kser_stats::summary() const {
+    std::string out;
+    uint64_t total_ns = 0;
+    for (size_t p = 0; p < kser_phase_count; p++) {
+        if (static_cast<kser_phase>(p) != kser_phase::file_permissions) {
+            total_ns += time_ns(static_cast<kser_phase>(p));
+        }
+    }
+    out += format("%-17s %12s %7s\n", "phase", "seconds", "share");
+    for (size_t p = 0; p < kser_phase_count; p++) {
+        kser_phase phase = static_cast<kser_phase>(p);
+        uint64_t ns = time_ns(phase);
+        if (ns == 0) {
+            continue;
+        }
+        out += format("%-17s %12.6f %6.1f%%\n", kser_phase_name(phase), ns / 1e9,
+            total_ns ? 100.0 * ns / total_ns : 0.0);
+    }
+    for (size_t c = 0; c < kser_counter_count; c++) {
+        kser_counter counter = static_cast<kser_counter>(c);
+        out += format("%s%s=%llu", c ? " " : "", kser_counter_name(counter), static_cast<unsigned long long>(count(counter)));
+    }
+    out += "\n";
+
+    uint64_t files = 0;
+    for (size_t b = 0; b < latency_buckets; b++) {
+        files += latency_count(b);
+    }
+    if (files > 0) {
+        out += "file latency:\n";
+        for (size_t b = 0; b < latency_buckets; b++) {
+            uint64_t n = latency_count(b);
+            if (n == 0) {
+                continue;
+            }
+            if (b + 1 == latency_buckets) {
+                out += format("  >= %llu us: %llu\n", static_cast<unsigned long long>(bucket_low_us(b)),
+                    static_cast<unsigned long long>(n));
+            }
+            else {
+                out += format("  %llu-%llu us: %llu (%.1f%%)\n", static_cast<unsigned long long>(bucket_low_us(b)),
+                    static_cast<unsigned long long>(bucket_high_us(b)), static_cast<unsigned long long>(n), 100.0 * n / files);
+            }
+        }
+    }
+    std::vector<slow_file> slow = slowest();
+    if (!slow.empty()) {
+        out += "slowest files:\n";
+        for (const slow_file& file : slow) {
+            out += format("  %.6f s %12llu bytes  ", file.ns / 1e9, static_cast<unsigned long long>(file.bytes));
+            out += file.name;
+            out += "\n";
+        }
+    }
+    return out;
+}
+
+// names are utf-8 already, only quotes, backslashes and control characters need escaping
+static void append_json_string(std::string& out, std::string_view value) {
+    out += '"';
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20) {
+            out += format("\\u%04x", static_cast<unsigned>(c));
+        }
+        else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+std::string kser_stats::json() const {
+    std::string out = "{\"phases\":{";
+    for (size_t p = 0; p < kser_phase_count; p++) {
+        kser_phase phase = static_cast<kser_phase>(p);
+        out += format("%s\"%s\":%.6f", p ? "," : "", kser_phase_name(phase), time_ns(phase) / 1e9);
+    }
+    out += "},\"counters\":{";
+    for (size_t c = 0; c < kser_counter_count; c++) {
+        kser_counter counter = static_cast<kser_counter>(c);
+        out += format("%s\"%s\":%llu", c ? "," : "", kser_counter_name(counter), static_cast<unsigned long long>(count(counter)));
+    }
+    out += "},\"file_latency\":[";
+    bool first = true;
+    for (size_t b = 0; b < latency_buckets; b++) {
+        uint64_t n = latency_count(b);
+        if (n == 0) {
+            continue;
+        }
+        out += format("%s{\"min_us\":%llu,\"max_us\":", first ? "" : ",", static_cast<unsigned long long>(bucket_low_us(b)));
+        out += b + 1 == latency_buckets ? std::string("null") : std::to_string(bucket_high_us(b));
+        out += format(",\"files\":%llu}", static_cast<unsigned long long>(n));
+        first = false;
+    }
+    out += "],\"slowest_files\":[";
+    std::vector<slow_file> slow = slowest();
+    for (size_t k = 0; k < slow.size(); k++) {
+        out += k ? ",{\"name\":" : "{\"name\":";
+        append_json_string(out, slow[k].name);
+        out += format(",\"seconds\":%.6f,\"bytes\":%llu}", slow[k].ns / 1e9, static_cast<unsigned long long>(slow[k].bytes));
+    }
+    out += "]}";
+    return out;
+}
@@ -0,0 +1,145 @@
+#pragma once
+#ifndef K_SER_STATS_IMPL
+#define K_SER_STATS_IMPL
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// parts of a run that are timed on their own. serialize goes through scan .. index,
+// deserialize through parse .. permissions, verify through parse and verify
+enum class kser_phase : uint8_t {
+    // reading the previous archive at the output for its permissions (and payloads)
+    old_archive,
+    scan,
+    sort,
+    dedup,
+    sparse,
+    payloads,
+    index,
+    parse,
+    directories,
+    files,
+    // chmod of files, added up over the workers, so it's part of files and not wall time
+    file_permissions,
+    permissions,
+    verify,
+};
+constexpr size_t kser_phase_count = static_cast<size_t>(kser_phase::verify) + 1;
+
+enum class kser_counter : uint8_t {
+    // entries and file bytes done, as reported to kser_progress
+    entries,
+    bytes,
+    // size of the archive written or read
+    archive_bytes,
+    // syscalls of the directory scan
+    scan_syscalls,
+    // entries that failed. a run stops at its first error, workers already busy may add more
+    errors,
+};
+constexpr size_t kser_counter_count = static_cast<size_t>(kser_counter::errors) + 1;
+
+const char* kser_phase_name(kser_phase phase);
+const char* kser_counter_name(kser_counter counter);
+
+// timings and counters of a run, filled in by the engine from any thread when
+// kser_options::stats points at one. without it a run pays a null check per phase and per file.
+// per-file time (reading and writing one file's data, compression included) goes into a
+// histogram with power-of-two buckets, and the slowest files are kept with their names.
+class kser_stats {
+public:
+    // bucket 0 is under 1 us, bucket b covers [2^(b-1), 2^b) us, the last one everything above
+    static constexpr size_t latency_buckets = 32;
+
+    struct slow_file {
+        std::string name;
+        uint64_t ns = 0;
+        uint64_t bytes = 0;
+    };
+
+    // slowest is how many of the slowest files are kept
+    explicit kser_stats(size_t slowest = 10);
+
+    kser_stats(const kser_stats&) = delete;
+    kser_stats& operator=(const kser_stats&) = delete;
+
+    void add_time(kser_phase phase, uint64_t ns) { phase_ns_[static_cast<size_t>(phase)].fetch_add(ns, std::memory_order_relaxed); }
+    void add(kser_counter counter, uint64_t value) { counters_[static_cast<size_t>(counter)].fetch_add(value, std::memory_order_relaxed); }
+    // one file took ns; name is its archive name
+    void add_file(std::string_view name, uint64_t ns, uint64_t bytes);
+
+    uint64_t time_ns(kser_phase phase) const { return phase_ns_[static_cast<size_t>(phase)].load(std::memory_order_relaxed); }
+    uint64_t count(kser_counter counter) const { return counters_[static_cast<size_t>(counter)].load(std::memory_order_relaxed); }
+    uint64_t latency_count(size_t bucket) const { return latency_[bucket].load(std::memory_order_relaxed); }
+    // slowest first
+    std::vector<slow_file> slowest() const;
+
+    // readable report: phases with their share of the total, counters, the latency histogram
+    // and the slowest files, one item per line
+    std::string summary() const;
+    // the same as one json object
+    std::string json() const;
+
+private:
+    std::atomic<uint64_t> phase_ns_[kser_phase_count] = {};
+    std::atomic<uint64_t> counters_[kser_counter_count] = {};
+    std::atomic<uint64_t> latency_[latency_buckets] = {};
+
+    size_t slowest_limit_;
+    // once the list is full, files at most this slow can't get in and skip the lock
+    std::atomic<uint64_t> slowest_threshold_{0};
+    mutable std::mutex slowest_mutex_;
+    // min-heap on ns
+    std::vector<slow_file> slowest_;
+};
+
+inline uint64_t stats_now_ns() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// adds the time until stop() or the end of the scope to a phase. does nothing without stats
+class phase_timer {
+public:
+    phase_timer(kser_stats* stats, kser_phase phase) : stats_(stats), phase_(phase) {
+        if (stats_) {
+            start_ = stats_now_ns();
+        }
+    }
+    ~phase_timer() { stop(); }
+
+    phase_timer(const phase_timer&) = delete;
+    phase_timer& operator=(const phase_timer&) = delete;
+
+    void stop() {
+        if (stats_) {
+            stats_->add_time(phase_, stats_now_ns() - start_);
+            stats_ = nullptr;
+        }
+    }
+
+private:
+    kser_stats* stats_;
+    kser_phase phase_;
+    uint64_t start_ = 0;
+};
+
+// runs step and with stats records its time as the time of one file
+template <typename Step>
+void time_file(kser_stats* stats, std::string_view name, uint64_t bytes, Step step) {
+    if (!stats) {
+        step();
+        return;
+    }
+    uint64_t start = stats_now_ns();
+    step();
+    stats->add_file(name, stats_now_ns() - start, bytes);
+}
+
+#endif
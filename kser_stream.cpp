@@ -0,0 +1,271 @@
+#include "kser_stream.h"
+#include "kser_format.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+
+static constexpr uint32_t max_stream_filename = 1 << 20;
+
+bool is_kser_stream(const fs::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    kser_file_header header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        return false;
+    }
+    return std::memcmp(header.magic, kser_magic, sizeof(kser_magic)) == 0 && (header.flags & kser_archive_stream) != 0;
+}
+
+stream_sink::stream_sink(std::ostream& out) : out_(out) {}
+
+void stream_sink::write(const char* data, size_t size) {
+    if (!out_.write(data, static_cast<std::streamsize>(size))) {
+        throw_u8string_error(u8"failed to write to the archive stream");
+    }
+    offset_ += size;
+}
+
+uint64_t stream_sink::copy_file(const fs::path& source, uint64_t size, const std::vector<file_extent>* extents) {
+    source_file in(source, extents);
+    if (!copy_buffer_) {
+        copy_buffer_.reset(new char[copy_buffer_size]);
+    }
+    xxh64_stream hash;
+    for (uint64_t left = size; left > 0;) {
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(left, copy_buffer_size));
+        in.read(copy_buffer_.get(), chunk);
+        hash.update(copy_buffer_.get(), chunk);
+        write(copy_buffer_.get(), chunk);
+        left -= chunk;
+    }
+#if defined(OS_LINUX)
+    in.drop_cache();
+#endif
+    return hash.digest();
+}
+
+void stream_sink::flush() {
+    if (!out_.flush()) {
+        throw_u8string_error(u8"failed to write to the archive stream");
+    }
+}
+
+kser_stream_reader::kser_stream_reader(std::istream& in, std::u8string name)
+    : in_(in), name_(std::move(name)) {
+    kser_file_header header;
+    read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (std::memcmp(header.magic, kser_magic, sizeof(kser_magic)) != 0) {
+        fail("not a .kser archive");
+    }
+    if (header.version != kser_version) {
+        fail("unsupported .kser version " + std::to_string(header.version));
+    }
+    if (!(header.flags & kser_archive_stream)) {
+        fail("not a streaming archive");
+    }
+    if ((header.flags & ~(kser_archive_stream | kser_archive_checksums)) != 0) {
+        fail("unsupported archive flags " + std::to_string(header.flags));
+    }
+}
+
+void kser_stream_reader::fail(const std::string& reason) const {
+    throw_u8string_error(u8"error reading from " + name_ + u8" (possibly incorrect data format): "
+        + std::u8string(reason.begin(), reason.end()));
+}
+
+void kser_stream_reader::read(char* data, size_t size) {
+    if (!in_.read(data, static_cast<std::streamsize>(size))) {
+        fail("archive ends early");
+    }
+    offset_ += size;
+}
+
+// record fields also go into the checksum of all records
+template <typename T>
+T kser_stream_reader::field() {
+    T value;
+    read(reinterpret_cast<char*>(&value), sizeof(T));
+    record_hash_.update(&value, sizeof(T));
+    return value;
+}
+
+bool kser_stream_reader::next() {
+    if (payload_pending_) {
+        read_payload(nullptr);
+    }
+
+    uint8_t is_dir;
+    read(reinterpret_cast<char*>(&is_dir), sizeof(is_dir));
+    if (is_dir == kser_stream_end) {
+        uint64_t end[2];
+        read(reinterpret_cast<char*>(end), sizeof(end));
+        if (end[0] != count_) {
+            fail("entry count doesn't match the entries");
+        }
+        if (end[1] != record_hash_.digest()) {
+            fail("record checksum mismatch (archive damaged)");
+        }
+        return false;
+    }
+    if (is_dir > 1) {
+        fail("invalid entry record");
+    }
+    record_hash_.update(&is_dir, sizeof(is_dir));
+
+    entry_ = kser_entry();
+    entry_.isDir = is_dir;
+    entry_.record_offset = offset_ - 1;
+    uint8_t entry_flags = field<uint8_t>();
+    if ((entry_flags & ~(kser_entry_codec | kser_entry_hard_link | kser_entry_stat | kser_entry_sparse | kser_entry_checksum
+                         | kser_entry_shared)) != 0) {
+        fail("unsupported entry flags " + std::to_string(entry_flags));
+    }
+    uint32_t filename_len = field<uint32_t>();
+    // a damaged length would otherwise allocate up to 4 GiB before the read fails
+    if (filename_len > max_stream_filename) {
+        fail("filename too long");
+    }
+    filename_.resize(filename_len);
+    read(filename_.data(), filename_len);
+    record_hash_.update(filename_.data(), filename_len);
+    entry_.filename = filename_;
+    entry_.win_permissions = field<int32_t>();
+    entry_.linux_permissions = field<int32_t>();
+    entry_.file_size = field<uint64_t>();
+    entry_.data_size = entry_.file_size;
+
+    auto earlier_file = [&](uint64_t target) {
+        return !entry_.isDir && target < count_ && !is_dir_[target];
+    };
+    if (entry_flags & kser_entry_codec) {
+        uint8_t codec = field<uint8_t>();
+        if (codec != static_cast<uint8_t>(kser_codec::none) && codec != static_cast<uint8_t>(kser_codec::klz)) {
+            fail("unsupported codec " + std::to_string(codec));
+        }
+        entry_.codec = static_cast<kser_codec>(codec);
+    }
+    if (entry_flags & kser_entry_hard_link) {
+        entry_.link_target = field<uint64_t>();
+        if (!earlier_file(entry_.link_target)) {
+            fail("hard link to an invalid entry");
+        }
+    }
+    if (entry_flags & kser_entry_stat) {
+        entry_.mtime_ns = field<int64_t>();
+        entry_.inode = field<uint64_t>();
+    }
+    extents_.clear();
+    if (entry_flags & kser_entry_sparse) {
+        uint32_t extent_count = field<uint32_t>();
+        if (entry_.isDir) {
+            fail("invalid sparse file extents");
+        }
+        entry_.sparse = true;
+        entry_.extent_count = extent_count;
+        entry_.data_size = 0;
+        uint64_t previous_end = 0;
+        for (uint32_t k = 0; k < extent_count; k++) {
+            file_extent extent;
+            extent.offset = field<uint64_t>();
+            extent.length = field<uint64_t>();
+            if (extent.offset < previous_end || extent.length == 0 || extent.offset > entry_.file_size
+                || entry_.file_size - extent.offset < extent.length) {
+                fail("invalid sparse file extents");
+            }
+            previous_end = extent.offset + extent.length;
+            entry_.data_size += extent.length;
+            extents_.push_back(extent);
+        }
+    }
+    same_as_ = kser_entry::no_link;
+    if (entry_flags & kser_entry_shared) {
+        same_as_ = field<uint64_t>();
+        if (!earlier_file(same_as_)) {
+            fail("shared payload of an invalid entry");
+        }
+    }
+    entry_.has_checksum = (entry_flags & kser_entry_checksum) != 0;
+
+    has_payload_ = !entry_.isDir && entry_.link_target == kser_entry::no_link && same_as_ == kser_entry::no_link;
+    if (entry_.has_checksum && !has_payload_) {
+        fail("checksum on an entry without payload");
+    }
+    payload_pending_ = has_payload_;
+    entry_.record_size = offset_ - entry_.record_offset;
+    entry_.data_offset = offset_;
+    is_dir_.push_back(entry_.isDir);
+    count_++;
+    return true;
+}
+
+fs::path kser_stream_reader::filename() const {
+    std::string utf8_str(filename_);
+#if defined(OS_WIN)
+    std::replace(utf8_str.begin(), utf8_str.end(), u8'/', u8'\\');
+    fs::path u8path = fs::u8path(utf8_str);
+    return fs::path(u8path.wstring());
+#else
+    return fs::u8path(utf8_str);
+#endif
+}
+
+void kser_stream_reader::read_payload(const std::function<void(const char* data, size_t size)>& sink) {
+    if (!payload_pending_) {
+        return;
+    }
+    payload_pending_ = false;
+    if (!block_) {
+        block_.reset(new char[klz_block_size]);
+        packed_.reset(new char[klz_block_size]);
+    }
+
+    xxh64_stream hash;
+    uint64_t left = entry_.data_size;
+    if (entry_.codec == kser_codec::none) {
+        while (left > 0) {
+            size_t chunk = static_cast<size_t>(std::min<uint64_t>(left, klz_block_size));
+            read(block_.get(), chunk);
+            hash.update(block_.get(), chunk);
+            if (sink) {
+                sink(block_.get(), chunk);
+            }
+            left -= chunk;
+        }
+    }
+    else {
+        while (left > 0) {
+            uint32_t header[2];
+            read(reinterpret_cast<char*>(header), sizeof(header));
+            hash.update(header, sizeof(header));
+            uint32_t block_raw = header[0];
+            uint32_t block_stored = header[1];
+            if (block_raw == 0 || block_raw > klz_block_size || block_raw > left || block_stored > block_raw) {
+                fail("corrupt compressed block header");
+            }
+            read(packed_.get(), block_stored);
+            hash.update(packed_.get(), block_stored);
+            if (sink) {
+                if (block_stored == block_raw) {
+                    sink(packed_.get(), block_raw);
+                }
+                else {
+                    if (!klz_decompress(packed_.get(), block_stored, block_.get(), block_raw)) {
+                        fail("corrupt compressed block");
+                    }
+                    sink(block_.get(), block_raw);
+                }
+            }
+            left -= block_raw;
+        }
+    }
+
+    if (entry_.has_checksum) {
+        read(reinterpret_cast<char*>(&entry_.checksum), sizeof(entry_.checksum));
+        if (hash.digest() != entry_.checksum) {
+            throw_u8string_error(u8"checksum mismatch: data of " + filename().u8string() + u8" is damaged in " + name_);
+        }
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+#ifndef K_SER_STREAM_IMPL
+#define K_SER_STREAM_IMPL
+
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "kserialize.h"
+#include "kser_hash.h"
+#include "kser_io.h"
+#include "kser_view.h"
+
+// true when the file starts with the header of a streaming archive (see kser_format.h)
+bool is_kser_stream(const fs::path& path);
+
+// the streaming archive being written: sequential writes only, so out may be a pipe.
+// offset() counts the bytes written so far.
+class stream_sink {
+public:
+    explicit stream_sink(std::ostream& out);
+
+    void write(const char* data, size_t size);
+    // appends size bytes of the file at source (with extents, just those ranges back to back)
+    // and returns xxh64 of the bytes, like archive_sink::copy_file
+    uint64_t copy_file(const fs::path& source, uint64_t size, const std::vector<file_extent>* extents = nullptr);
+    void flush();
+    uint64_t offset() const { return offset_; }
+
+private:
+    std::ostream& out_;
+    uint64_t offset_ = 0;
+    std::unique_ptr<char[]> copy_buffer_;
+};
+
+// reads a streaming archive front to back. next() moves to the next entry, read_payload()
+// decodes its data. only one klz block is held at a time, so memory use doesn't depend on the
+// archive. malformed or damaged input throws, naming the archive.
+class kser_stream_reader {
+public:
+    // reads and checks the header. name is how the archive is called in errors
+    kser_stream_reader(std::istream& in, std::u8string name);
+
+    // reads the next record, skipping the payload of the current entry if it wasn't read.
+    // false at the end record, after checking the entry count and the records' checksum
+    bool next();
+
+    // number of the current entry, counting from 0
+    size_t index() const { return count_ - 1; }
+    // link_target is an entry number; data_offset is where the payload starts in the stream
+    const kser_entry& entry() const { return entry_; }
+    // entry name as a native path
+    fs::path filename() const;
+    const std::vector<file_extent>& extents() const { return extents_; }
+    // earlier entry whose payload this file shares (dedup), kser_entry::no_link if none
+    uint64_t same_as() const { return same_as_; }
+    // false for directories, hard links and shared payloads: their data isn't repeated
+    bool has_payload() const { return has_payload_; }
+
+    // passes the entry's data (file data, the extents of a sparse file back to back) to sink
+    // in order and checks the checksum. without a sink the payload is only checked, klz blocks
+    // aren't decoded
+    void read_payload(const std::function<void(const char* data, size_t size)>& sink);
+
+    // bytes read so far
+    uint64_t offset() const { return offset_; }
+
+private:
+    void read(char* data, size_t size);
+    template <typename T>
+    T field();
+    void fail(const std::string& reason) const;
+
+    std::istream& in_;
+    std::u8string name_;
+    uint64_t offset_ = 0;
+    uint64_t count_ = 0;
+    bool payload_pending_ = false;
+    bool has_payload_ = false;
+
+    kser_entry entry_;
+    std::string filename_;
+    std::vector<file_extent> extents_;
+    uint64_t same_as_ = kser_entry::no_link;
+    std::vector<uint8_t> is_dir_;
+
+    xxh64_stream record_hash_;
+    std::unique_ptr<char[]> block_;
+    std::unique_ptr<char[]> packed_;
+};
+
+#endif
@@ -0,0 +1,321 @@
+#include "kser_table.h"
+#include "kserialize.h"
+#include "kser_pool.h"
+
+#include <algorithm>
+
+void entry_table::reserve(size_t entries, size_t name_bytes) {
+    is_dir.reserve(entries);
+    win_permissions.reserve(entries);
+    linux_permissions.reserve(entries);
+    file_size.reserve(entries);
+    device.reserve(entries);
+    inode.reserve(entries);
+    link_count.reserve(entries);
+    mtime_ns.reserve(entries);
+    disk_size.reserve(entries);
+    name_offset_.reserve(entries);
+    name_length_.reserve(entries);
+    names_.reserve(name_bytes);
+}
+
+void entry_table::clear() {
+    *this = entry_table(std::move(root_));
+}
+
+size_t entry_table::add(std::string_view name) {
+    size_t i = size();
+    name_offset_.push_back(names_.size());
+    name_length_.push_back(static_cast<uint32_t>(name.size()));
+    names_.append(name);
+    is_dir.push_back(0);
+    win_permissions.push_back(0);
+    linux_permissions.push_back(0);
+    file_size.push_back(0);
+    device.push_back(0);
+    inode.push_back(0);
+    link_count.push_back(1);
+    mtime_ns.push_back(0);
+    disk_size.push_back(0);
+    return i;
+}
+
+void entry_table::append(const entry_table& other) {
+    uint64_t base = names_.size();
+    names_.append(other.names_);
+    for (uint64_t offset : other.name_offset_) {
+        name_offset_.push_back(base + offset);
+    }
+    name_length_.insert(name_length_.end(), other.name_length_.begin(), other.name_length_.end());
+    is_dir.insert(is_dir.end(), other.is_dir.begin(), other.is_dir.end());
+    win_permissions.insert(win_permissions.end(), other.win_permissions.begin(), other.win_permissions.end());
+    linux_permissions.insert(linux_permissions.end(), other.linux_permissions.begin(), other.linux_permissions.end());
+    file_size.insert(file_size.end(), other.file_size.begin(), other.file_size.end());
+    device.insert(device.end(), other.device.begin(), other.device.end());
+    inode.insert(inode.end(), other.inode.begin(), other.inode.end());
+    link_count.insert(link_count.end(), other.link_count.begin(), other.link_count.end());
+    mtime_ns.insert(mtime_ns.end(), other.mtime_ns.begin(), other.mtime_ns.end());
+    disk_size.insert(disk_size.end(), other.disk_size.begin(), other.disk_size.end());
+}
+
+fs::path entry_table::filename(size_t i) const {
+    std::string_view utf8 = name(i);
+#if defined(OS_WIN)
+    fs::path path = fs::u8path(utf8.begin(), utf8.end());
+    path.make_preferred();
+    return path;
+#else
+    return fs::path(utf8);
+#endif
+}
+
+fs::path entry_table::full_path(size_t i) const {
+#if defined(OS_WIN)
+    return root_ / filename(i);
+#else
+    // root / name without splitting either into components
+    const std::string& root = root_.native();
+    std::string_view relative = name(i);
+    std::string path;
+    path.reserve(root.size() + 1 + relative.size());
+    path = root;
+    if (!path.empty() && path.back() != '/') {
+        path += '/';
+    }
+    path.append(relative);
+    return fs::path(std::move(path));
+#endif
+}
+
+// byte k of a name's sort key. '/' becomes 0, which no name contains otherwise, so it sorts
+// below every other byte; a name that ends sorts before any longer one. on windows fs::path
+// compares utf-16 code units, which puts characters above U+FFFF (lead bytes f0-f4) before
+// U+E000-U+FFFF (lead bytes ee, ef); the lead bytes are swapped to match
+static inline uint8_t key_byte(std::string_view name, size_t k) {
+    uint8_t byte = static_cast<uint8_t>(name[k]);
+    if (byte == '/') {
+        return 0;
+    }
+#if defined(OS_WIN)
+    if (byte >= 0xee && byte <= 0xf4) {
+        return static_cast<uint8_t>(byte >= 0xf0 ? byte - 2 : byte + 5);
+    }
+#endif
+    return byte;
+}
+
+// compares the keys of two names that are equal before byte from
+static bool key_less(std::string_view a, std::string_view b, size_t from) {
+    size_t length = std::min(a.size(), b.size());
+    size_t k = from;
+    while (k < length && a[k] == b[k]) {
+        k++;
+    }
+    if (k == length) {
+        return a.size() < b.size();
+    }
+    return key_byte(a, k) < key_byte(b, k);
+}
+
+bool name_less(std::string_view a, std::string_view b) {
+    return key_less(a, b, 0);
+}
+
+bool entry_table::sorted_by_name() const {
+    for (size_t i = 1; i < size(); i++) {
+        if (name_less(name(i), name(i - 1))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+namespace {
+
+// an entry being sorted, with the next eight bytes of its key from the current depth so that
+// seven of eight radix passes don't touch the names. the name's place in the arena is copied
+// in so that refilling the key is one memory access rather than three
+struct sort_item {
+    uint64_t key;
+    uint64_t name_offset;
+    uint32_t name_length;
+    uint32_t entry;
+};
+
+// below this many entries a range is sorted by comparing names
+constexpr size_t radix_min = 128;
+// ranges of at least this many entries are sorted as tasks of their own
+constexpr size_t parallel_min = 1 << 14;
+
+// msd radix sort of the entries by name key, one byte per pass. the buckets of a pass are
+// independent, so large ones go to the pool
+class name_sorter {
+public:
+    name_sorter(const char* names, std::vector<sort_item>& items, work_stealing_pool* pool)
+        : names_(names), items_(items), pool_(pool) {}
+
+    // sorts items[begin, end), whose names are equal before byte depth
+    void sort(size_t begin, size_t end, size_t depth) {
+        for (;;) {
+            if (end - begin < radix_min) {
+                std::sort(items_.begin() + begin, items_.begin() + end, [&](const sort_item& a, const sort_item& b) {
+                    return key_less(name(a), name(b), depth);
+                });
+                return;
+            }
+            if (depth % 8 == 0) {
+                for (size_t i = begin; i < end; i++) {
+                    items_[i].key = load_key(name(items_[i]), depth);
+                }
+            }
+            unsigned shift = 56 - 8 * (depth % 8);
+
+            // bytes every key has in common are skipped without a pass, up to the first 0: names
+            // may end there, which only a pass tells apart from a '/'
+            uint64_t differ = 0;
+            for (size_t i = begin + 1; i < end; i++) {
+                differ |= items_[i].key ^ items_[begin].key;
+            }
+            size_t same = 0;
+            while (depth % 8 + same < 8 && !((differ >> (shift - 8 * same)) & 0xff)
+                   && ((items_[begin].key >> (shift - 8 * same)) & 0xff)) {
+                same++;
+            }
+            if (same > 0) {
+                depth += same;
+                continue;
+            }
+
+            size_t count[256] = {};
+            for (size_t i = begin; i < end; i++) {
+                count[(items_[i].key >> shift) & 0xff]++;
+            }
+            size_t start[257];
+            size_t next[256];
+            start[0] = begin;
+            for (unsigned b = 0; b < 256; b++) {
+                next[b] = start[b];
+                start[b + 1] = start[b] + count[b];
+            }
+            // in place: every item is swapped straight into its bucket
+            for (unsigned b = 0; b < 256; b++) {
+                while (next[b] < start[b + 1]) {
+                    sort_item item = items_[next[b]];
+                    unsigned item_bucket = (item.key >> shift) & 0xff;
+                    while (item_bucket != b) {
+                        std::swap(item, items_[next[item_bucket]++]);
+                        item_bucket = (item.key >> shift) & 0xff;
+                    }
+                    items_[next[b]++] = item;
+                }
+            }
+
+            // bucket 0 holds the names that end here as well as those with a '/'. the ended
+            // ones are a prefix of all the others, so they go first and are done
+            size_t zero_begin = start[0];
+            for (size_t i = start[0]; i < start[1]; i++) {
+                if (items_[i].name_length <= depth) {
+                    std::swap(items_[i], items_[zero_begin++]);
+                }
+            }
+            start[0] = zero_begin;
+
+            // the largest bucket continues in this loop, so the stack stays logarithmic
+            unsigned largest = 0;
+            for (unsigned b = 1; b < 256; b++) {
+                if (start[b + 1] - start[b] > start[largest + 1] - start[largest]) {
+                    largest = b;
+                }
+            }
+            for (unsigned b = 0; b < 256; b++) {
+                if (b != largest && start[b + 1] - start[b] > 1) {
+                    sort_bucket(start[b], start[b + 1], depth + 1);
+                }
+            }
+            begin = start[largest];
+            end = start[largest + 1];
+            depth++;
+        }
+    }
+
+private:
+    void sort_bucket(size_t begin, size_t end, size_t depth) {
+        if (pool_ && end - begin >= parallel_min) {
+            pool_->submit([this, begin, end, depth] {
+                sort(begin, end, depth);
+            });
+        }
+        else {
+            sort(begin, end, depth);
+        }
+    }
+
+    std::string_view name(const sort_item& item) const {
+        return std::string_view(names_ + item.name_offset, item.name_length);
+    }
+
+    // key bytes depth to depth + 7, big endian, zero past the end of the name
+    static uint64_t load_key(std::string_view name, size_t depth) {
+        uint64_t key = 0;
+        for (size_t k = depth; k < depth + 8; k++) {
+            key = (key << 8) | (k < name.size() ? key_byte(name, k) : 0);
+        }
+        return key;
+    }
+
+    const char* names_;
+    std::vector<sort_item>& items_;
+    work_stealing_pool* pool_;
+};
+
+}
+
+template <typename T>
+static void permute(std::vector<T>& values, const std::vector<sort_item>& order) {
+    std::vector<T> sorted;
+    sorted.reserve(values.size());
+    for (const sort_item& item : order) {
+        sorted.push_back(values[item.entry]);
+    }
+    values = std::move(sorted);
+}
+
+void entry_table::sort_by_name(unsigned threads) {
+    if (sorted_by_name()) {
+        return;
+    }
+    if (size() > UINT32_MAX) {
+        throw_u8string_error(u8"too many entries to sort");
+    }
+    std::vector<sort_item> order(size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i].name_offset = name_offset_[i];
+        order[i].name_length = name_length_[i];
+        order[i].entry = static_cast<uint32_t>(i);
+    }
+    if (size() >= parallel_min && work_stealing_pool::resolve_thread_count(threads) > 1) {
+        work_stealing_pool pool(threads);
+        name_sorter sorter(names_.data(), order, &pool);
+        pool.submit([&] {
+            sorter.sort(0, order.size(), 0);
+        });
+        pool.wait();
+    }
+    else {
+        name_sorter sorter(names_.data(), order, nullptr);
+        sorter.sort(0, order.size(), 0);
+    }
+
+    // one array at a time, so only one extra array is alive at any point
+    permute(name_offset_, order);
+    permute(name_length_, order);
+    permute(is_dir, order);
+    permute(win_permissions, order);
+    permute(linux_permissions, order);
+    permute(file_size, order);
+    permute(device, order);
+    permute(inode, order);
+    permute(link_count, order);
+    permute(mtime_ns, order);
+    permute(disk_size, order);
+}
@@ -0,0 +1,74 @@
+#pragma once
+#ifndef K_SER_TABLE_IMPL
+#define K_SER_TABLE_IMPL
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// the entries of a tree as parallel arrays, element i of every array belongs to entry i.
+// names are packed back to back into one arena and entries refer to them by offset, so a
+// table costs a handful of large allocations however many entries it has. names are relative
+// to the root (the parent of the serialized input), utf-8 with '/' between components like
+// in the archive. paths on disk are built from the root when they are needed.
+class entry_table {
+public:
+    entry_table() = default;
+    explicit entry_table(fs::path root) : root_(std::move(root)) {}
+
+    size_t size() const { return is_dir.size(); }
+    bool empty() const { return is_dir.empty(); }
+    // bytes of all names in the arena
+    size_t name_bytes() const { return names_.size(); }
+    void reserve(size_t entries, size_t name_bytes);
+    void clear();
+
+    // appends an entry with zeroed attributes (one link), returns its number
+    size_t add(std::string_view name);
+    // appends every entry of other, in its order
+    void append(const entry_table& other);
+
+    std::string_view name(size_t i) const { return std::string_view(names_.data() + name_offset_[i], name_length_[i]); }
+    // name as a relative native path
+    fs::path filename(size_t i) const;
+    // where the entry is on disk: root / name
+    fs::path full_path(size_t i) const;
+    const fs::path& root() const { return root_; }
+
+    // puts the entries in archive order (see name_less) with a radix sort of the name keys on
+    // threads workers (0 = one per hardware thread). only the arrays are permuted, names stay
+    // where they are in the arena
+    void sort_by_name(unsigned threads = 0);
+    bool sorted_by_name() const;
+
+    std::vector<uint8_t> is_dir;
+    std::vector<int32_t> win_permissions;
+    std::vector<int32_t> linux_permissions;
+    std::vector<uint64_t> file_size;
+    // identity on disk, used to find hard links. 0 where the scan can't tell
+    std::vector<uint64_t> device;
+    std::vector<uint64_t> inode;
+    std::vector<uint32_t> link_count;
+    // last modification, nanoseconds since the epoch (0 = unknown)
+    std::vector<int64_t> mtime_ns;
+    // bytes allocated on disk, less than file_size for sparse files (0 = unknown)
+    std::vector<uint64_t> disk_size;
+
+private:
+    fs::path root_;
+    std::string names_;
+    std::vector<uint64_t> name_offset_;
+    std::vector<uint32_t> name_length_;
+};
+
+// archive order of two entry names: the order of the names as fs::path, which compares them
+// component by component. that is byte order with '/' below every other byte (and utf-16
+// order on windows), so no path has to be built
+bool name_less(std::string_view a, std::string_view b);
+
+#endif
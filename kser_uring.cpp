@@ -0,0 +1,406 @@
+#include "kser_uring.h"
+#include "kser_io.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#if defined(OS_LINUX)
+
+#include <atomic>
+#include <memory>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// the average file size below which kser_io_backend::automatic picks io_uring, and the
+// number of files that makes setting up rings worth it
+static constexpr uint64_t uring_auto_file_size = 32 << 10;
+static constexpr uint64_t uring_auto_min_files = 1000;
+
+static int sys_io_uring_setup(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+static void throw_errno_error(const std::u8string& what, int error) {
+    std::string reason = std::strerror(error);
+    throw_u8string_error(what + u8": " + std::u8string(reason.begin(), reason.end()));
+}
+
+static bool probe_io_uring() {
+    io_uring_params params{};
+    int fd = sys_io_uring_setup(4, &params);
+    if (fd < 0) {
+        // no io_uring in this kernel, or switched off (io_uring_disabled, seccomp)
+        return false;
+    }
+    size_t probe_size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    std::unique_ptr<char[]> buffer(new char[probe_size]());
+    auto* probe = reinterpret_cast<io_uring_probe*>(buffer.get());
+    bool ok = sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (int op : { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE }) {
+        ok = ok && op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+    ::close(fd);
+    return ok;
+}
+
+bool io_ring::available() {
+    static const bool supported = probe_io_uring();
+    return supported;
+}
+
+io_ring::io_ring(unsigned entries) {
+    io_uring_params params{};
+    ring_fd_ = sys_io_uring_setup(entries, &params);
+    if (ring_fd_ < 0) {
+        throw_errno_error(u8"failed to set up io_uring", errno);
+    }
+    entries_ = params.sq_entries;
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+        sq_ring_ = nullptr;
+        int error = errno;
+        ::close(ring_fd_);
+        throw_errno_error(u8"failed to map io_uring", error);
+    }
+    if (single_mmap) {
+        cq_ring_ = sq_ring_;
+    }
+    else {
+        cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (cq_ring_ == MAP_FAILED || sqes_ == MAP_FAILED) {
+        int error = errno;
+        if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+            munmap(cq_ring_, cq_ring_size_);
+        }
+        if (sqes_ != MAP_FAILED) {
+            munmap(sqes_, sqes_size_);
+        }
+        munmap(sq_ring_, sq_ring_size_);
+        ::close(ring_fd_);
+        throw_errno_error(u8"failed to map io_uring", error);
+    }
+
+    char* sq = static_cast<char*>(sq_ring_);
+    char* cq = static_cast<char*>(cq_ring_);
+    sq_tail_ptr_ = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+    sq_tail_ = *sq_tail_ptr_;
+    cq_head_ptr_ = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+    cq_tail_ptr_ = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+    cqes_ = cq + params.cq_off.cqes;
+}
+
+io_ring::~io_ring() {
+    munmap(sqes_, sqes_size_);
+    if (cq_ring_ != sq_ring_) {
+        munmap(cq_ring_, cq_ring_size_);
+    }
+    munmap(sq_ring_, sq_ring_size_);
+    ::close(ring_fd_);
+}
+
+io_uring_sqe* io_ring::next_sqe() {
+    if (queued_ + in_flight_ >= entries_) {
+        throw_u8string_error(u8"io_uring submission queue is full");
+    }
+    uint32_t index = sq_tail_ & sq_mask_;
+    io_uring_sqe* sqe = static_cast<io_uring_sqe*>(sqes_) + index;
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    sq_tail_++;
+    queued_++;
+    return sqe;
+}
+
+void io_ring::openat(int dir_fd, const char* path, int flags, uint32_t mode, uint64_t tag) {
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dir_fd;
+    sqe->addr = reinterpret_cast<uint64_t>(path);
+    sqe->len = mode;
+    sqe->open_flags = static_cast<uint32_t>(flags);
+    sqe->user_data = tag;
+}
+
+void io_ring::read(int fd, char* data, size_t size, uint64_t offset, uint64_t tag) {
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = static_cast<uint32_t>(size);
+    sqe->off = offset;
+    sqe->user_data = tag;
+}
+
+void io_ring::write(int fd, const char* data, size_t size, uint64_t offset, uint64_t tag) {
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = static_cast<uint32_t>(size);
+    sqe->off = offset;
+    sqe->user_data = tag;
+}
+
+void io_ring::close(int fd, uint64_t tag) {
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = tag;
+}
+
+void io_ring::run(const std::function<void(uint64_t tag, int result)>& done) {
+    // the kernel reads the entries once it sees the new tail
+    std::atomic_ref<uint32_t>(*sq_tail_ptr_).store(sq_tail_, std::memory_order_release);
+    const io_uring_cqe* cqes = static_cast<const io_uring_cqe*>(cqes_);
+    while (queued_ + in_flight_ > 0) {
+        int submitted = sys_io_uring_enter(ring_fd_, queued_, 1, IORING_ENTER_GETEVENTS);
+        if (submitted < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            throw_errno_error(u8"io_uring_enter failed", errno);
+        }
+        queued_ -= static_cast<unsigned>(submitted);
+        in_flight_ += static_cast<unsigned>(submitted);
+
+        uint32_t head = *cq_head_ptr_;
+        uint32_t tail = std::atomic_ref<uint32_t>(*cq_tail_ptr_).load(std::memory_order_acquire);
+        for (; head != tail; head++) {
+            const io_uring_cqe& cqe = cqes[head & cq_mask_];
+            done(cqe.user_data, cqe.res);
+            in_flight_--;
+        }
+        std::atomic_ref<uint32_t>(*cq_head_ptr_).store(head, std::memory_order_release);
+    }
+}
+
+// results of one batch, kept until every opened file is closed again
+struct batch_state {
+    std::vector<int> fds;
+    std::vector<int> results;
+
+    explicit batch_state(size_t count) : fds(count, -1), results(count, 0) {}
+};
+
+static void close_batch(io_ring& ring, batch_state& state) {
+    for (size_t k = 0; k < state.fds.size(); k++) {
+        if (state.fds[k] >= 0) {
+            ring.close(state.fds[k], k);
+        }
+    }
+    ring.run([&](uint64_t tag, int result) {
+        state.results[tag] = result;
+    });
+}
+
+void read_files(io_ring& ring, const std::vector<batch_read>& files) {
+    for (size_t begin = 0; begin < files.size(); begin += ring.capacity()) {
+        size_t count = std::min<size_t>(files.size() - begin, ring.capacity());
+        batch_state state(count);
+
+        for (size_t k = 0; k < count; k++) {
+            if (files[begin + k].size > 0) {
+                ring.openat(AT_FDCWD, files[begin + k].path.c_str(), O_RDONLY | O_CLOEXEC, 0, k);
+            }
+        }
+        ring.run([&](uint64_t tag, int result) {
+            if (result >= 0) {
+                state.fds[tag] = result;
+            }
+            state.results[tag] = result;
+        });
+
+        for (size_t k = 0; k < count; k++) {
+            if (state.fds[k] >= 0) {
+                ring.read(state.fds[k], files[begin + k].data, files[begin + k].size, 0, k);
+            }
+        }
+        ring.run([&](uint64_t tag, int result) {
+            state.results[tag] = result;
+        });
+
+        // a read may come back short, the rest is read synchronously while the fd is still open
+        std::u8string error;
+        for (size_t k = 0; k < count && error.empty(); k++) {
+            const batch_read& file = files[begin + k];
+            if (file.size == 0) {
+                continue;
+            }
+            if (state.fds[k] < 0) {
+                error = u8"failed to open source file: " + file.path.u8string();
+                break;
+            }
+            if (state.results[k] < 0) {
+                error = u8"failed to read " + file.path.u8string();
+                break;
+            }
+            size_t done = static_cast<size_t>(state.results[k]);
+            while (done < file.size) {
+                ssize_t n = pread(state.fds[k], file.data + done, file.size - done, static_cast<off_t>(done));
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    error = n < 0 ? u8"failed to read " + file.path.u8string()
+                                  : u8"file got shorter while serializing: " + file.path.u8string();
+                    break;
+                }
+                done += static_cast<size_t>(n);
+            }
+        }
+
+        close_batch(ring, state);
+        if (!error.empty()) {
+            throw_u8string_error(error);
+        }
+    }
+}
+
+void write_new_files(io_ring& ring, const std::vector<batch_write>& files) {
+    for (size_t begin = 0; begin < files.size(); begin += ring.capacity()) {
+        size_t count = std::min<size_t>(files.size() - begin, ring.capacity());
+        batch_state state(count);
+
+        for (size_t k = 0; k < count; k++) {
+            const batch_write& file = files[begin + k];
+            if (file.dir_fd >= 0) {
+                ring.openat(file.dir_fd, file.name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, file.mode, k);
+            }
+            else {
+                ring.openat(AT_FDCWD, file.path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, file.mode, k);
+            }
+        }
+        ring.run([&](uint64_t tag, int result) {
+            if (result >= 0) {
+                state.fds[tag] = result;
+            }
+            state.results[tag] = result;
+        });
+
+        for (size_t k = 0; k < count; k++) {
+            if (state.fds[k] >= 0 && files[begin + k].size > 0) {
+                ring.write(state.fds[k], files[begin + k].data, files[begin + k].size, 0, k);
+            }
+        }
+        ring.run([&](uint64_t tag, int result) {
+            state.results[tag] = result;
+        });
+
+        std::u8string error;
+        for (size_t k = 0; k < count && error.empty(); k++) {
+            const batch_write& file = files[begin + k];
+            if (state.fds[k] < 0) {
+                error = state.results[k] == -EEXIST
+                    ? u8"can't deserialize " + file.path.u8string() + u8" because it already exists"
+                    : u8"failed to create " + file.path.u8string();
+                break;
+            }
+            if (file.size == 0) {
+                continue;
+            }
+            if (state.results[k] < 0) {
+                error = u8"failed to write data to " + file.path.u8string();
+                break;
+            }
+            // finish a short write synchronously
+            size_t done = static_cast<size_t>(state.results[k]);
+            try {
+                write_fd_range(state.fds[k], done, file.data + done, file.size - done);
+            }
+            catch (const std::exception&) {
+                error = u8"failed to write data to " + file.path.u8string();
+            }
+        }
+
+        close_batch(ring, state);
+        for (size_t k = 0; k < count && error.empty(); k++) {
+            if (state.fds[k] >= 0 && state.results[k] < 0) {
+                error = u8"failed to write data to " + files[begin + k].path.u8string();
+            }
+        }
+        if (!error.empty()) {
+            throw_u8string_error(error);
+        }
+    }
+}
+
+bool use_io_uring(const kser_options& options, uint64_t files, uint64_t bytes) {
+    if (options.io == kser_io_backend::sync) {
+        return false;
+    }
+    if (options.io == kser_io_backend::automatic &&
+        (files < uring_auto_min_files || bytes / files > uring_auto_file_size)) {
+        return false;
+    }
+    if (!io_ring::available()) {
+        if (options.io == kser_io_backend::io_uring) {
+            addToLog(log_level::warning, u8"io_uring is not available, using synchronous i/o");
+        }
+        return false;
+    }
+    addToLog(u8"batching small files through io_uring");
+    return true;
+}
+
+#else
+
+bool use_io_uring(const kser_options&, uint64_t, uint64_t) {
+    return false;
+}
+
+bool io_ring::available() {
+    return false;
+}
+
+io_ring::io_ring(unsigned) {
+    throw_u8string_error(u8"io_uring is only available on linux");
+}
+
+io_ring::~io_ring() = default;
+
+io_uring_sqe* io_ring::next_sqe() {
+    return nullptr;
+}
+
+void io_ring::openat(int, const char*, int, uint32_t, uint64_t) {}
+void io_ring::read(int, char*, size_t, uint64_t, uint64_t) {}
+void io_ring::write(int, const char*, size_t, uint64_t, uint64_t) {}
+void io_ring::close(int, uint64_t) {}
+void io_ring::run(const std::function<void(uint64_t, int)>&) {}
+
+void read_files(io_ring&, const std::vector<batch_read>&) {
+    throw_u8string_error(u8"io_uring is only available on linux");
+}
+
+void write_new_files(io_ring&, const std::vector<batch_write>&) {
+    throw_u8string_error(u8"io_uring is only available on linux");
+}
+
+#endif
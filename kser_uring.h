@@ -0,0 +1,103 @@
+#pragma once
+#ifndef K_SER_URING_IMPL
+#define K_SER_URING_IMPL
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "kserialize.h"
+
+struct io_uring_sqe;
+
+// files up to this size are read and written in batches when the io_uring backend is used
+constexpr uint64_t uring_small_file = 64 << 10;
+
+// true when a run over files files holding bytes bytes should batch its small files through
+// io_uring: always with kser_io_backend::io_uring, with kser_io_backend::automatic when the
+// files are small on average. false also where the kernel has no usable io_uring, the caller
+// then stays on the synchronous path.
+bool use_io_uring(const kser_options& options, uint64_t files, uint64_t bytes);
+
+// a minimal io_uring on raw syscalls (no liburing). operations are queued, then run() submits
+// them all with one io_uring_enter and waits for their completions. only linux has it,
+// elsewhere available() is false and the constructor throws.
+class io_ring {
+public:
+    explicit io_ring(unsigned entries = 256);
+    ~io_ring();
+
+    io_ring(const io_ring&) = delete;
+    io_ring& operator=(const io_ring&) = delete;
+
+    // true when the kernel supports io_uring with openat, read, write and close (probed once)
+    static bool available();
+
+    // operations that can be queued before run() has to be called
+    unsigned capacity() const { return entries_; }
+
+    // path is relative to dir_fd unless it's absolute, AT_FDCWD for the working directory
+    void openat(int dir_fd, const char* path, int flags, uint32_t mode, uint64_t tag);
+    void read(int fd, char* data, size_t size, uint64_t offset, uint64_t tag);
+    void write(int fd, const char* data, size_t size, uint64_t offset, uint64_t tag);
+    void close(int fd, uint64_t tag);
+
+    // submits the queued operations and waits for all of them. done gets each operation's tag
+    // and result (what the syscall would return, or -errno) and must not throw.
+    void run(const std::function<void(uint64_t tag, int result)>& done);
+
+private:
+    io_uring_sqe* next_sqe();
+
+    int ring_fd_ = -1;
+    unsigned entries_ = 0;
+    unsigned queued_ = 0;
+    unsigned in_flight_ = 0;
+    uint32_t sq_tail_ = 0;
+
+    void* sq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    void* cq_ring_ = nullptr;
+    size_t cq_ring_size_ = 0;
+    void* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+
+    uint32_t* sq_tail_ptr_ = nullptr;
+    uint32_t sq_mask_ = 0;
+    uint32_t* sq_array_ = nullptr;
+    uint32_t* cq_head_ptr_ = nullptr;
+    uint32_t* cq_tail_ptr_ = nullptr;
+    uint32_t cq_mask_ = 0;
+    void* cqes_ = nullptr;
+};
+
+// a file read whole into data
+struct batch_read {
+    fs::path path;
+    char* data = nullptr;
+    size_t size = 0;
+};
+
+// a file that is created (it must not exist yet) with mode and gets size bytes of data
+struct batch_write {
+    fs::path path;
+    // with dir_fd set the file is created as name in that directory, path is then only used
+    // in messages
+    int dir_fd = -1;
+    std::string name;
+    const char* data = nullptr;
+    size_t size = 0;
+    uint32_t mode = 0666;
+};
+
+// every open, then every read, then every close of up to ring.capacity() files goes to the
+// kernel in one io_uring_enter. throws like source_file when a file can't be read in full,
+// after closing whatever was opened.
+void read_files(io_ring& ring, const std::vector<batch_read>& files);
+
+// the same for new files: open with O_CREAT | O_EXCL, write, close
+void write_new_files(io_ring& ring, const std::vector<batch_write>& files);
+
+#endif
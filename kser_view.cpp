@@ -0,0 +1,523 @@
+#include "kser_view.h"
+#include "kser_format.h"
+#include "kser_hash.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#if defined(OS_WIN)
+#include <windows.h>
+#elif defined(OS_LINUX)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+KserView::KserView(const fs::path& path) : path_(path) {
+#if defined(OS_LINUX)
+    fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ == -1) {
+        throw_u8string_error(u8"falied to open " + path.u8string() + u8" for reading");
+    }
+    struct stat st;
+    if (fstat(fd_, &st) == -1) {
+        close(fd_);
+        throw_u8string_error(u8"failed to read size of " + path.u8string());
+    }
+    size_ = static_cast<uint64_t>(st.st_size);
+    if (size_ > 0) {
+        void* mapping = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+        if (mapping == MAP_FAILED) {
+            close(fd_);
+            throw_u8string_error(u8"failed to map " + path.u8string() + u8" into memory");
+        }
+        madvise(mapping, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const char*>(mapping);
+    }
+#elif defined(OS_WIN)
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        throw_u8string_error(u8"falied to open " + path.u8string() + u8" for reading");
+    }
+    file_handle_ = file;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size)) {
+        CloseHandle(file);
+        throw_u8string_error(u8"failed to read size of " + path.u8string());
+    }
+    size_ = static_cast<uint64_t>(file_size.QuadPart);
+    if (size_ > 0) {
+        HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping == NULL) {
+            CloseHandle(file);
+            throw_u8string_error(u8"failed to map " + path.u8string() + u8" into memory");
+        }
+        mapping_handle_ = mapping;
+        data_ = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (data_ == nullptr) {
+            CloseHandle(mapping);
+            CloseHandle(file);
+            throw_u8string_error(u8"failed to map " + path.u8string() + u8" into memory");
+        }
+    }
+#endif
+
+    try {
+        parse();
+    }
+    catch (...) {
+        unmap();
+        throw;
+    }
+}
+
+KserView::~KserView() {
+    unmap();
+}
+
+void KserView::unmap() {
+#if defined(OS_LINUX)
+    if (data_ != nullptr) {
+        munmap(const_cast<char*>(data_), size_);
+    }
+    if (fd_ != -1) {
+        close(fd_);
+    }
+    fd_ = -1;
+#elif defined(OS_WIN)
+    if (data_ != nullptr) {
+        UnmapViewOfFile(data_);
+    }
+    if (mapping_handle_ != nullptr) {
+        CloseHandle(mapping_handle_);
+    }
+    if (file_handle_ != nullptr) {
+        CloseHandle(file_handle_);
+    }
+    mapping_handle_ = nullptr;
+    file_handle_ = nullptr;
+#endif
+    data_ = nullptr;
+}
+
+template <typename T>
+static T read_field(const char* data, uint64_t size, uint64_t& pos) {
+    if (pos > size || size - pos < sizeof(T)) {
+        throw std::runtime_error("unexpected end of header");
+    }
+    T value;
+    std::memcpy(&value, data + pos, sizeof(T));
+    pos += sizeof(T);
+    return value;
+}
+
+static inline uint64_t read_varint(const char* data, uint64_t size, uint64_t& pos) {
+    // most fields of a compact record fit one byte
+    if (pos < size && !(data[pos] & 0x80)) {
+        return static_cast<uint8_t>(data[pos++]);
+    }
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (pos >= size) {
+            throw std::runtime_error("unexpected end of index");
+        }
+        uint8_t byte = static_cast<uint8_t>(data[pos++]);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    throw std::runtime_error("invalid varint in index");
+}
+
+void KserView::parse() {
+    try {
+        if (is_kser_v2(data_, size_)) {
+            parse_v2();
+        }
+        else {
+            parse_v1();
+        }
+    }
+    catch (const std::exception& e) {
+        std::string reason = e.what();
+        throw_u8string_error(u8"error reading from file (possibly incorrect data format): " + path_.u8string()
+            + u8": " + std::u8string(reason.begin(), reason.end()));
+    }
+}
+
+// v1 layout: count, then per entry isDir, filename_len, filename, win_perms, linux_perms, filesize,
+// then the payloads of all files in entry order
+void KserView::parse_v1() {
+    version_ = 1;
+    uint64_t pos = 0;
+    uint32_t num_objects = read_field<uint32_t>(data_, size_, pos);
+
+    // every record takes at least 21 bytes, so a bogus count fails here instead of allocating
+    constexpr uint64_t min_record_size = sizeof(uint8_t) + sizeof(uint32_t) * 3 + sizeof(uint64_t);
+    if (num_objects > (size_ - pos) / min_record_size) {
+        throw std::runtime_error("entry count larger than the file");
+    }
+    entries_.resize(num_objects);
+
+    for (auto& entry : entries_) {
+        entry.record_offset = pos;
+        entry.isDir = read_field<uint8_t>(data_, size_, pos);
+        uint32_t filename_len = read_field<uint32_t>(data_, size_, pos);
+        if (size_ - pos < filename_len) {
+            throw std::runtime_error("unexpected end of header");
+        }
+        entry.filename = std::string_view(data_ + pos, filename_len);
+        pos += filename_len;
+        entry.win_permissions = read_field<int32_t>(data_, size_, pos);
+        entry.linux_permissions = read_field<int32_t>(data_, size_, pos);
+        entry.file_size = read_field<uint64_t>(data_, size_, pos);
+        entry.stored_size = entry.file_size;
+        entry.data_size = entry.file_size;
+        entry.record_size = pos - entry.record_offset;
+    }
+    index_size_ = pos;
+
+    // v1 has no offsets, they are the running sum of the sizes before
+    uint64_t data_offset = pos;
+    for (auto& entry : entries_) {
+        entry.data_offset = data_offset;
+        if (!entry.isDir) {
+            if (size_ - data_offset < entry.file_size) {
+                throw std::runtime_error("payloads extend past the end of the file");
+            }
+            data_offset += entry.file_size;
+        }
+    }
+}
+
+// v2: the trailer at the end of the file points at the index, which has every entry's data offset
+void KserView::parse_v2() {
+    uint64_t pos = 0;
+    kser_file_header header = read_field<kser_file_header>(data_, size_, pos);
+    if (header.version != kser_version) {
+        throw std::runtime_error("unsupported .kser version " + std::to_string(header.version));
+    }
+    version_ = header.version;
+    archive_flags_ = header.flags;
+
+    if (archive_flags_ & kser_archive_stream) {
+        throw std::runtime_error("streaming archive, it has no index and can only be read front to back");
+    }
+
+    uint64_t trailer_pos = size_ - sizeof(kser_trailer);
+    kser_trailer trailer = read_field<kser_trailer>(data_, size_, trailer_pos);
+    if (std::memcmp(trailer.magic, kser_trailer_magic, sizeof(trailer.magic)) != 0) {
+        throw std::runtime_error("missing index trailer (archive incomplete?)");
+    }
+    if ((archive_flags_ & ~(kser_archive_checksums | kser_archive_compact_index | kser_archive_metadata_only)) != 0
+        || ((archive_flags_ & kser_archive_metadata_only) && !(archive_flags_ & kser_archive_compact_index))) {
+        throw std::runtime_error("unsupported archive flags " + std::to_string(archive_flags_));
+    }
+    uint64_t index_end = size_ - sizeof(kser_trailer);
+    if (archive_flags_ & kser_archive_checksums) {
+        if (index_end < sizeof(kser_file_header) + sizeof(uint64_t)) {
+            throw std::runtime_error("missing index checksum");
+        }
+        index_end -= sizeof(uint64_t);
+    }
+    if (trailer.index_offset < sizeof(kser_file_header) || trailer.index_offset > index_end ||
+        trailer.index_length != index_end - trailer.index_offset) {
+        throw std::runtime_error("index position out of range");
+    }
+    // a damaged index is caught here, before anything is allocated for its entries
+    if (archive_flags_ & kser_archive_checksums) {
+        uint64_t checksum_pos = index_end;
+        uint64_t checksum = read_field<uint64_t>(data_, size_, checksum_pos);
+        if (xxh64(data_ + trailer.index_offset, trailer.index_length) != checksum) {
+            throw std::runtime_error("index checksum mismatch (archive damaged)");
+        }
+    }
+
+    index_size_ = trailer.index_length;
+    if (archive_flags_ & kser_archive_compact_index) {
+        parse_compact_index(trailer.index_offset, index_end);
+    }
+    else {
+        parse_fixed_index(trailer.index_offset, index_end);
+    }
+}
+
+// a payload must lie between the header and the index
+void KserView::check_payload(const kser_entry& entry, uint64_t index_offset) const {
+    if (!entry.isDir && (entry.data_offset > index_offset || index_offset - entry.data_offset < entry.stored_size)) {
+        throw std::runtime_error("payload outside of the data section");
+    }
+}
+
+// the index of archives written before the compact index: fixed-width fields, names in full
+void KserView::parse_fixed_index(uint64_t pos, uint64_t index_end) {
+    uint64_t index_offset = pos;
+    uint64_t num_objects = read_field<uint64_t>(data_, index_end, pos);
+    if (num_objects > (index_end - pos) / kser_min_index_record) {
+        throw std::runtime_error("entry count larger than the index");
+    }
+    entries_.resize(num_objects);
+
+    for (auto& entry : entries_) {
+        entry.record_offset = pos;
+        entry.isDir = read_field<uint8_t>(data_, index_end, pos);
+        uint8_t entry_flags = read_field<uint8_t>(data_, index_end, pos);
+        if ((entry_flags & ~(kser_entry_codec | kser_entry_hard_link | kser_entry_stat | kser_entry_sparse | kser_entry_checksum)) != 0) {
+            throw std::runtime_error("unsupported entry flags " + std::to_string(entry_flags));
+        }
+        uint32_t filename_len = read_field<uint32_t>(data_, index_end, pos);
+        if (index_end - pos < filename_len) {
+            throw std::runtime_error("unexpected end of index");
+        }
+        entry.filename = std::string_view(data_ + pos, filename_len);
+        pos += filename_len;
+        entry.win_permissions = read_field<int32_t>(data_, index_end, pos);
+        entry.linux_permissions = read_field<int32_t>(data_, index_end, pos);
+        entry.file_size = read_field<uint64_t>(data_, index_end, pos);
+        entry.data_offset = read_field<uint64_t>(data_, index_end, pos);
+        entry.stored_size = entry.file_size;
+        if (entry_flags & kser_entry_codec) {
+            uint8_t codec = read_field<uint8_t>(data_, index_end, pos);
+            if (codec != static_cast<uint8_t>(kser_codec::none) && codec != static_cast<uint8_t>(kser_codec::klz)) {
+                throw std::runtime_error("unsupported codec " + std::to_string(codec));
+            }
+            entry.codec = static_cast<kser_codec>(codec);
+            entry.stored_size = read_field<uint64_t>(data_, index_end, pos);
+        }
+        if (entry_flags & kser_entry_hard_link) {
+            entry.link_target = read_field<uint64_t>(data_, index_end, pos);
+            size_t self = static_cast<size_t>(&entry - entries_.data());
+            if (entry.isDir || entry.link_target >= self || entries_[entry.link_target].isDir) {
+                throw std::runtime_error("hard link to an invalid entry");
+            }
+        }
+        if (entry_flags & kser_entry_stat) {
+            entry.mtime_ns = read_field<int64_t>(data_, index_end, pos);
+            entry.inode = read_field<uint64_t>(data_, index_end, pos);
+        }
+        entry.data_size = entry.file_size;
+        if (entry_flags & kser_entry_sparse) {
+            uint32_t extent_count = read_field<uint32_t>(data_, index_end, pos);
+            if (entry.isDir) {
+                throw std::runtime_error("invalid sparse file extents");
+            }
+            if ((index_end - pos) / (2 * sizeof(uint64_t)) < extent_count) {
+                throw std::runtime_error("unexpected end of index");
+            }
+            entry.sparse = true;
+            entry.extent_count = extent_count;
+            entry.extents_offset = pos;
+            uint64_t previous_end = 0;
+            entry.data_size = 0;
+            for (uint32_t k = 0; k < extent_count; k++) {
+                uint64_t offset = read_field<uint64_t>(data_, index_end, pos);
+                uint64_t length = read_field<uint64_t>(data_, index_end, pos);
+                if (offset < previous_end || length == 0 || offset > entry.file_size || entry.file_size - offset < length) {
+                    throw std::runtime_error("invalid sparse file extents");
+                }
+                previous_end = offset + length;
+                entry.data_size += length;
+            }
+            if (!(entry_flags & kser_entry_codec)) {
+                entry.stored_size = entry.data_size;
+            }
+        }
+        if (entry_flags & kser_entry_checksum) {
+            entry.has_checksum = true;
+            entry.checksum = read_field<uint64_t>(data_, index_end, pos);
+        }
+        entry.record_size = pos - entry.record_offset;
+        check_payload(entry, index_offset);
+    }
+    if (pos != index_end) {
+        throw std::runtime_error("trailing bytes after the index");
+    }
+}
+
+// compact index (see kser_format.h), decoded front to back. names are rebuilt into names_, which
+// is sized from the index up front
+void KserView::parse_compact_index(uint64_t pos, uint64_t index_end) {
+    uint64_t index_offset = pos;
+    uint64_t num_objects = read_varint(data_, index_end, pos);
+    uint64_t name_bytes = read_varint(data_, index_end, pos);
+    uint64_t permission_count = read_varint(data_, index_end, pos);
+    if (permission_count > (index_end - pos) / (2 * sizeof(int32_t))) {
+        throw std::runtime_error("permission count larger than the index");
+    }
+    std::vector<std::pair<int32_t, int32_t>> permissions(permission_count);
+    for (auto& [win_permissions, linux_permissions] : permissions) {
+        win_permissions = read_field<int32_t>(data_, index_end, pos);
+        linux_permissions = read_field<int32_t>(data_, index_end, pos);
+    }
+    if (num_objects > (index_end - pos) / kser_min_compact_record) {
+        throw std::runtime_error("entry count larger than the index");
+    }
+    entries_.resize(num_objects);
+    names_.reset(new char[std::max<uint64_t>(name_bytes, 1)]);
+    uint64_t names_used = 0;
+
+    std::string_view previous_name(names_.get(), 0);
+    uint64_t next_offset = 0;
+    int64_t previous_mtime = 0;
+    uint64_t previous_inode = 0;
+    for (size_t i = 0; i < entries_.size(); i++) {
+        kser_entry& entry = entries_[i];
+        entry.record_offset = pos;
+        uint8_t entry_flags = read_field<uint8_t>(data_, index_end, pos);
+        if ((entry_flags & ~(kser_entry_codec | kser_entry_hard_link | kser_entry_stat | kser_entry_sparse
+                             | kser_entry_checksum | kser_entry_dir)) != 0) {
+            throw std::runtime_error("unsupported entry flags " + std::to_string(entry_flags));
+        }
+        entry.isDir = (entry_flags & kser_entry_dir) ? 1 : 0;
+
+        uint64_t shared = read_varint(data_, index_end, pos);
+        uint64_t suffix_length = read_varint(data_, index_end, pos);
+        if (shared > previous_name.size() || suffix_length > index_end - pos ||
+            shared + suffix_length > name_bytes - names_used) {
+            throw std::runtime_error("invalid entry name");
+        }
+        char* name = names_.get() + names_used;
+        std::memcpy(name, previous_name.data(), shared);
+        std::memcpy(name + shared, data_ + pos, suffix_length);
+        pos += suffix_length;
+        names_used += shared + suffix_length;
+        entry.filename = std::string_view(name, shared + suffix_length);
+        previous_name = entry.filename;
+
+        uint64_t permission = read_varint(data_, index_end, pos);
+        if (permission >= permissions.size()) {
+            throw std::runtime_error("permissions out of range");
+        }
+        entry.win_permissions = permissions[permission].first;
+        entry.linux_permissions = permissions[permission].second;
+
+        if (!entry.isDir) {
+            entry.file_size = read_varint(data_, index_end, pos);
+            entry.data_offset = next_offset + static_cast<uint64_t>(unzigzag(read_varint(data_, index_end, pos)));
+        }
+        entry.stored_size = entry.file_size;
+        if (entry_flags & kser_entry_codec) {
+            uint8_t codec = read_field<uint8_t>(data_, index_end, pos);
+            if (codec != static_cast<uint8_t>(kser_codec::none) && codec != static_cast<uint8_t>(kser_codec::klz)) {
+                throw std::runtime_error("unsupported codec " + std::to_string(codec));
+            }
+            entry.codec = static_cast<kser_codec>(codec);
+            entry.stored_size = read_varint(data_, index_end, pos);
+        }
+        if (entry_flags & kser_entry_hard_link) {
+            uint64_t distance = read_varint(data_, index_end, pos);
+            if (entry.isDir || distance == 0 || distance > i || entries_[i - distance].isDir) {
+                throw std::runtime_error("hard link to an invalid entry");
+            }
+            entry.link_target = i - distance;
+        }
+        if (entry_flags & kser_entry_stat) {
+            entry.mtime_ns = static_cast<int64_t>(static_cast<uint64_t>(previous_mtime)
+                + static_cast<uint64_t>(unzigzag(read_varint(data_, index_end, pos))));
+            entry.inode = previous_inode + static_cast<uint64_t>(unzigzag(read_varint(data_, index_end, pos)));
+            previous_mtime = entry.mtime_ns;
+            previous_inode = entry.inode;
+        }
+        entry.data_size = entry.file_size;
+        if (entry_flags & kser_entry_sparse) {
+            uint64_t extent_count = read_varint(data_, index_end, pos);
+            // every extent takes at least two bytes
+            if (entry.isDir || extent_count > UINT32_MAX || extent_count > (index_end - pos) / 2) {
+                throw std::runtime_error("invalid sparse file extents");
+            }
+            entry.sparse = true;
+            entry.extent_count = static_cast<uint32_t>(extent_count);
+            entry.extents_offset = pos;
+            uint64_t previous_end = 0;
+            entry.data_size = 0;
+            for (uint64_t k = 0; k < extent_count; k++) {
+                uint64_t gap = read_varint(data_, index_end, pos);
+                uint64_t length = read_varint(data_, index_end, pos);
+                if (gap > entry.file_size - previous_end || length == 0 || entry.file_size - previous_end - gap < length) {
+                    throw std::runtime_error("invalid sparse file extents");
+                }
+                previous_end += gap + length;
+                entry.data_size += length;
+            }
+            if (!(entry_flags & kser_entry_codec)) {
+                entry.stored_size = entry.data_size;
+            }
+        }
+        if (entry_flags & kser_entry_checksum) {
+            entry.has_checksum = true;
+            entry.checksum = read_field<uint64_t>(data_, index_end, pos);
+        }
+        if (archive_flags_ & kser_archive_metadata_only) {
+            entry.stored_size = 0;
+        }
+        entry.record_size = pos - entry.record_offset;
+        check_payload(entry, index_offset);
+        if (!entry.isDir) {
+            next_offset = entry.data_offset + entry.stored_size;
+        }
+    }
+    if (pos != index_end) {
+        throw std::runtime_error("trailing bytes after the index");
+    }
+    if (names_used != name_bytes) {
+        throw std::runtime_error("entry names don't add up to their size");
+    }
+}
+
+bool KserView::has_checksums() const {
+    return (archive_flags_ & kser_archive_checksums) != 0;
+}
+
+bool KserView::metadata_only() const {
+    return (archive_flags_ & kser_archive_metadata_only) != 0;
+}
+
+bool KserView::compact_index() const {
+    return (archive_flags_ & kser_archive_compact_index) != 0;
+}
+
+std::span<const char> KserView::metadata(size_t i) const {
+    const kser_entry& e = entries_[i];
+    return std::span<const char>(data_ + e.record_offset, e.record_size);
+}
+
+std::span<const char> KserView::payload(size_t i) const {
+    const kser_entry& e = entries_[i];
+    if (e.isDir) {
+        return {};
+    }
+    return std::span<const char>(data_ + e.data_offset, e.stored_size);
+}
+
+std::vector<file_extent> KserView::extents(size_t i) const {
+    const kser_entry& e = entries_[i];
+    std::vector<file_extent> result(e.extent_count);
+    uint64_t pos = e.extents_offset;
+    uint64_t previous_end = 0;
+    for (auto& extent : result) {
+        if (compact_index()) {
+            extent.offset = previous_end + read_varint(data_, size_, pos);
+            extent.length = read_varint(data_, size_, pos);
+            previous_end = extent.offset + extent.length;
+        }
+        else {
+            extent.offset = read_field<uint64_t>(data_, size_, pos);
+            extent.length = read_field<uint64_t>(data_, size_, pos);
+        }
+    }
+    return result;
+}
+
+fs::path KserView::filename(size_t i) const {
+    std::string utf8_str(entries_[i].filename);
+#if defined(OS_WIN)
+    std::replace(utf8_str.begin(), utf8_str.end(), u8'/', u8'\\');
+    fs::path u8path = fs::u8path(utf8_str);
+    return fs::path(u8path.wstring());
+#else
+    return fs::u8path(utf8_str);
+#endif
+}
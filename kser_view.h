@@ -0,0 +1,117 @@
+#pragma once
+#ifndef K_SER_VIEW_IMPL
+#define K_SER_VIEW_IMPL
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "kserialize.h"
+#include "kser_codec.h"
+#include "kser_io.h"
+
+// one header (v1) or index (v2) record of a .kser archive. filename is utf-8, '/' separated, and
+// points into the mapping, or into the view's names for a compact index.
+struct kser_entry {
+    uint8_t isDir = 0;
+    std::string_view filename;
+    int32_t win_permissions = 0;
+    int32_t linux_permissions = 0;
+    uint64_t file_size = 0;
+    // how the payload is stored; stored_size equals data_size for raw payloads
+    kser_codec codec = kser_codec::none;
+    uint64_t stored_size = 0;
+    // earlier entry this one was hard linked to, kser_entry::no_link if none
+    static constexpr uint64_t no_link = static_cast<uint64_t>(-1);
+    uint64_t link_target = no_link;
+    // state of the source file when it was serialized, 0 if not recorded
+    int64_t mtime_ns = 0;
+    uint64_t inode = 0;
+    // bytes of file data in the payload before any codec: file_size, or the total length of the
+    // extents of a sparse file (see KserView::extents)
+    uint64_t data_size = 0;
+    bool sparse = false;
+    uint32_t extent_count = 0;
+    uint64_t extents_offset = 0;
+    // xxh64 of the stored payload bytes, written since archives have checksums
+    bool has_checksum = false;
+    uint64_t checksum = 0;
+    // absolute offsets in the archive. data_offset is shared with the next payload when
+    // stored_size is 0 (see kser_format.h)
+    uint64_t record_offset = 0;
+    uint64_t record_size = 0;
+    uint64_t data_offset = 0;
+};
+
+// read-only memory mapping of a .kser archive (see kser_format.h). the header or index is parsed in one linear pass into
+// an entry table; metadata and payloads are handed out as spans into the mapping. only the names of
+// a compact index are copied out, as they are stored front-coded.
+// a malformed header is reported when the view is opened, before anything is extracted.
+class KserView {
+public:
+    explicit KserView(const fs::path& path);
+    ~KserView();
+
+    KserView(const KserView&) = delete;
+    KserView& operator=(const KserView&) = delete;
+
+    size_t size() const { return entries_.size(); }
+    const kser_entry& entry(size_t i) const { return entries_[i]; }
+    const std::vector<kser_entry>& entries() const { return entries_; }
+
+    std::span<const char> metadata(size_t i) const;
+    // stored payload bytes, still compressed if the entry has a codec
+    std::span<const char> payload(size_t i) const;
+
+    // entry name as a native path
+    fs::path filename(size_t i) const;
+
+    // data extents of a sparse entry, in the order their data is stored in the payload
+    std::vector<file_extent> extents(size_t i) const;
+
+    const fs::path& path() const { return path_; }
+    // format version of the archive (1 or 2)
+    int version() const { return version_; }
+    // true when the index was checked against its checksum while opening
+    bool has_checksums() const;
+    // true when the index is in the compact encoding
+    bool compact_index() const;
+    // true when the archive has no payloads (kser_archive_metadata_only), every stored_size is 0
+    bool metadata_only() const;
+    // bytes of the index (the header of v1 archives)
+    uint64_t index_size() const { return index_size_; }
+    uint64_t file_size() const { return size_; }
+#if defined(OS_LINUX)
+    // the archive stays open for kernel-side copies out of it
+    int fd() const { return fd_; }
+#endif
+
+private:
+    void parse();
+    void parse_v1();
+    void parse_v2();
+    void parse_fixed_index(uint64_t pos, uint64_t index_end);
+    void parse_compact_index(uint64_t pos, uint64_t index_end);
+    void check_payload(const kser_entry& entry, uint64_t index_offset) const;
+    void unmap();
+
+    fs::path path_;
+    const char* data_ = nullptr;
+    uint64_t size_ = 0;
+    int version_ = 0;
+    uint16_t archive_flags_ = 0;
+    uint64_t index_size_ = 0;
+    std::vector<kser_entry> entries_;
+    // names of a compact index, back to back
+    std::unique_ptr<char[]> names_;
+#if defined(OS_LINUX)
+    int fd_ = -1;
+#elif defined(OS_WIN)
+    void* file_handle_ = nullptr;
+    void* mapping_handle_ = nullptr;
+#endif
+};
+
+#endif
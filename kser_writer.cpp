@@ -0,0 +1,1021 @@
+#include "kser_writer.h"
+#include "kser_dedup.h"
+#include "kser_view.h"
+#include "kser_format.h"
+#include "kser_hash.h"
+#include "kser_io.h"
+#include "kser_pool.h"
+#include "kser_uring.h"
+#include "kser_stream.h"
+#include "kser_stats.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+
+static std::u8string to_u8string(uint64_t value) {
+    std::string text = std::to_string(value);
+    return std::u8string(text.begin(), text.end());
+}
+
+// files smaller than this are stored raw, the block header would eat most of the gain
+static constexpr uint64_t min_compress_size = 64;
+
+// compressed data is only kept if it saves at least a tenth of the size
+static bool worth_compressing(size_t raw_size, size_t packed_size) {
+    return packed_size <= raw_size - raw_size / 10;
+}
+
+static bool shares_payload(const dedup_plan& plan, size_t entry) {
+    return !plan.same_as.empty() && plan.same_as[entry] != dedup_plan::no_entry;
+}
+
+static constexpr size_t no_entry = static_cast<size_t>(-1);
+
+// a file is only looked at for holes when at least this much of it isn't allocated
+static constexpr uint64_t sparse_min_hole = 4096;
+
+// data extents of the sparse files among the entries, by entry
+using extent_map = std::unordered_map<size_t, std::vector<file_extent>>;
+
+// extents to store for entry i, nullptr for a file stored whole
+static const std::vector<file_extent>* sparse_extents(const extent_map& sparse, size_t i) {
+    auto it = sparse.find(i);
+    return it == sparse.end() ? nullptr : &it->second;
+}
+
+static bool same_extents(const std::vector<file_extent>& a, const std::vector<file_extent>& b) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const file_extent& x, const file_extent& y) {
+        return x.offset == y.offset && x.length == y.length;
+    });
+}
+
+// bytes of file data the payload holds before compression
+static uint64_t data_size(const entry_table& table, size_t i, const std::vector<file_extent>* extents) {
+    if (!extents) {
+        return table.file_size[i];
+    }
+    uint64_t size = 0;
+    for (const file_extent& extent : *extents) {
+        size += extent.length;
+    }
+    return size;
+}
+
+namespace {
+
+// one unit of work of the payload pipeline: a block of a file that is compressed,
+// or a whole file that is copied as it is
+struct work_item {
+    size_t entry = 0;
+    bool whole_file = false;
+    bool first_block = false;
+    bool last_block = false;
+    bool packed_ready = false;
+    // stored as it is, without trying the codec (files too small to compress)
+    bool keep_raw = false;
+    // time spent on this block (reading and compressing it), only counted with stats
+    uint64_t ns = 0;
+    size_t raw_size = 0;
+    size_t packed_size = 0;
+    std::unique_ptr<char[]> raw;
+    std::unique_ptr<char[]> packed;
+
+    void ensure_buffers() {
+        if (!raw) {
+            raw.reset(new char[klz_block_size]);
+            packed.reset(new char[klz_bound(klz_block_size)]);
+        }
+    }
+};
+
+// called around each payload the pipeline writes: before its first byte (the codec is known
+// by then) and after its last (the checksum is known). a streaming archive puts the entry's
+// record and checksum there
+struct payload_hooks {
+    std::function<void(size_t entry)> before;
+    std::function<void(size_t entry)> after;
+};
+
+// writes the payloads of the entries with own_payload set. reads batch n+1 and writes batch n
+// on the calling thread while the pool compresses the blocks of batch n+1. memory use is
+// bounded by two batches of blocks. with a ring, the small files of a batch are read through
+// it together instead of one after another. Sink is archive_sink or stream_sink.
+// with stats a file's time is what its blocks took to read, compress and write, not how long
+// they waited in the batches; small files read through the ring share the batch's read time.
+template <typename Sink>
+class payload_pipeline {
+public:
+    payload_pipeline(Sink& out, const entry_table& table, const std::vector<uint8_t>& own_payload,
+                     const extent_map& sparse, std::vector<entry_payload>& payloads, const kser_options& options,
+                     io_ring* ring, const payload_hooks* hooks = nullptr)
+        : out_(out), table_(table), own_payload_(own_payload), sparse_(sparse), options_(options), pool_(options.threads),
+          payloads_(payloads), ring_(ring), hooks_(hooks) {
+        batch_size_ = std::max<size_t>(ring_ ? 64 : 8, pool_.size() * 4);
+    }
+
+    void run() {
+        std::vector<work_item> current(batch_size_);
+        std::vector<work_item> next(batch_size_);
+        try {
+            size_t current_count = fill(current);
+            compress(current, current_count);
+            while (current_count > 0) {
+                size_t next_count = fill(next);
+                pool_.wait();
+                compress(next, next_count);
+                write(current, current_count);
+                std::swap(current, next);
+                current_count = next_count;
+            }
+            pool_.wait();
+        }
+        catch (...) {
+            // workers may still hold blocks of the batches, let them finish before unwinding
+            try {
+                pool_.wait();
+            }
+            catch (...) {
+            }
+            throw;
+        }
+    }
+
+private:
+    size_t fill(std::vector<work_item>& batch) {
+        size_t count = 0;
+        while (count < batch.size()) {
+            work_item& item = batch[count];
+            item.whole_file = false;
+            item.packed_ready = false;
+            item.keep_raw = false;
+            item.ns = 0;
+            uint64_t start = clock();
+
+            if (source_) {
+                // next block of a file that is being compressed
+                item.ensure_buffers();
+                item.entry = source_entry_;
+                item.first_block = false;
+                item.raw_size = static_cast<size_t>(std::min<uint64_t>(source_left_, klz_block_size));
+                source_->read(item.raw.get(), item.raw_size);
+                item.ns = clock() - start;
+                source_left_ -= item.raw_size;
+                item.last_block = source_left_ == 0;
+                if (item.last_block) {
+                    source_.reset();
+                }
+                count++;
+                continue;
+            }
+
+            if (next_entry_ == table_.size()) {
+                break;
+            }
+            size_t entry = next_entry_++;
+            if (!own_payload_[entry]) {
+                continue;
+            }
+            check_cancelled(options_);
+
+            item.entry = entry;
+            const std::vector<file_extent>* extents = sparse_extents(sparse_, entry);
+            uint64_t size = data_size(table_, entry, extents);
+            if (ring_ && !extents && size <= uring_small_file) {
+                // read with the rest of the batch's small files once the batch is full
+                item.ensure_buffers();
+                item.first_block = true;
+                item.last_block = true;
+                item.raw_size = static_cast<size_t>(size);
+                if (size < min_compress_size) {
+                    item.keep_raw = true;
+                    item.packed_ready = true;
+                }
+                ring_reads_.push_back({ table_.full_path(entry), item.raw.get(), item.raw_size });
+                ring_items_.push_back(&item);
+                count++;
+                continue;
+            }
+            if (size < min_compress_size) {
+                item.whole_file = true;
+                count++;
+                continue;
+            }
+
+            auto source = std::make_unique<source_file>(table_.full_path(entry), extents);
+            item.ensure_buffers();
+            item.first_block = true;
+            item.raw_size = static_cast<size_t>(std::min<uint64_t>(size, klz_block_size));
+            source->read(item.raw.get(), item.raw_size);
+            item.last_block = size == item.raw_size;
+
+            if (!item.last_block) {
+                // a multi-block file is sampled here: if its first block doesn't compress,
+                // the whole file is copied raw instead of going through the workers
+                item.packed_size = klz_compress(item.raw.get(), item.raw_size, item.packed.get());
+                item.packed_ready = true;
+                if (!worth_compressing(item.raw_size, item.packed_size)) {
+                    item.whole_file = true;
+                    item.ns = clock() - start;
+                    count++;
+                    continue;
+                }
+                source_ = std::move(source);
+                source_entry_ = entry;
+                source_left_ = size - item.raw_size;
+            }
+            item.ns = clock() - start;
+            count++;
+        }
+        if (!ring_reads_.empty()) {
+            uint64_t start = clock();
+            read_files(*ring_, ring_reads_);
+            uint64_t each = (clock() - start) / ring_items_.size();
+            for (work_item* item : ring_items_) {
+                item->ns += each;
+            }
+            ring_reads_.clear();
+            ring_items_.clear();
+        }
+        return count;
+    }
+
+    void compress(std::vector<work_item>& batch, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            work_item& item = batch[i];
+            if (item.whole_file || item.packed_ready) {
+                continue;
+            }
+            pool_.submit([this, &item] {
+                uint64_t start = clock();
+                item.packed_size = klz_compress(item.raw.get(), item.raw_size, item.packed.get());
+                item.packed_ready = true;
+                item.ns += clock() - start;
+            });
+        }
+    }
+
+    void write(std::vector<work_item>& batch, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            work_item& item = batch[i];
+            entry_payload& payload = payloads_[item.entry];
+            uint64_t start = clock();
+
+            if (item.whole_file) {
+                const std::vector<file_extent>* extents = sparse_extents(sparse_, item.entry);
+                uint64_t size = data_size(table_, item.entry, extents);
+                payload.codec = kser_codec::none;
+                before(item.entry);
+                payload.data_offset = out_.offset();
+                payload.stored_size = size;
+                payload.has_checksum = true;
+                payload.checksum = size > 0 ? out_.copy_file(table_.full_path(item.entry), size, extents) : xxh64(nullptr, 0);
+                after(item.entry);
+                file_done(item.entry, item.ns + clock() - start);
+                report_progress(options_, 1, table_.file_size[item.entry]);
+                continue;
+            }
+
+            if (item.first_block) {
+                // multi-block files were already judged by their first block
+                payload.codec = !item.keep_raw && (!item.last_block || worth_compressing(item.raw_size, item.packed_size))
+                    ? kser_codec::klz : kser_codec::none;
+                before(item.entry);
+                payload.data_offset = out_.offset();
+                payload.stored_size = 0;
+                hash_.reset();
+                file_ns_ = 0;
+            }
+
+            if (payload.codec == kser_codec::none) {
+                store(item.raw.get(), item.raw_size, payload);
+            }
+            else {
+                bool use_packed = item.packed_size < item.raw_size;
+                uint32_t header[2] = {
+                    static_cast<uint32_t>(item.raw_size),
+                    static_cast<uint32_t>(use_packed ? item.packed_size : item.raw_size)
+                };
+                store(reinterpret_cast<const char*>(header), sizeof(header), payload);
+                store(use_packed ? item.packed.get() : item.raw.get(), header[1], payload);
+            }
+            file_ns_ += item.ns + clock() - start;
+            if (item.last_block) {
+                payload.has_checksum = true;
+                payload.checksum = hash_.digest();
+                after(item.entry);
+                file_done(item.entry, file_ns_);
+                report_progress(options_, 1, table_.file_size[item.entry]);
+            }
+        }
+    }
+
+    // now in nanoseconds with stats, 0 without
+    uint64_t clock() const {
+        return options_.stats ? stats_now_ns() : 0;
+    }
+
+    void file_done(size_t entry, uint64_t ns) {
+        if (options_.stats) {
+            options_.stats->add_file(table_.name(entry), ns, table_.file_size[entry]);
+        }
+    }
+
+    void before(size_t entry) {
+        if (hooks_ && hooks_->before) {
+            hooks_->before(entry);
+        }
+    }
+
+    void after(size_t entry) {
+        if (hooks_ && hooks_->after) {
+            hooks_->after(entry);
+        }
+    }
+
+    // appends payload bytes of the entry being written
+    void store(const char* data, size_t size, entry_payload& payload) {
+        out_.write(data, size);
+        hash_.update(data, size);
+        payload.stored_size += size;
+    }
+
+    Sink& out_;
+    const entry_table& table_;
+    const std::vector<uint8_t>& own_payload_;
+    const extent_map& sparse_;
+    const kser_options& options_;
+    work_stealing_pool pool_;
+    size_t batch_size_;
+    std::vector<entry_payload>& payloads_;
+    io_ring* ring_;
+    std::vector<batch_read> ring_reads_;
+    std::vector<work_item*> ring_items_;
+    const payload_hooks* hooks_;
+
+    xxh64_stream hash_;
+    // time of the blocks of the file being written so far
+    uint64_t file_ns_ = 0;
+
+    size_t next_entry_ = 0;
+    std::unique_ptr<source_file> source_;
+    size_t source_entry_ = 0;
+    uint64_t source_left_ = 0;
+};
+
+}
+
+static void write_archive_header(archive_sink& out, uint16_t extra_flags = 0) {
+    kser_file_header header;
+    std::memcpy(header.magic, kser_magic, sizeof(header.magic));
+    header.version = kser_version;
+    header.flags = kser_archive_checksums | kser_archive_compact_index | extra_flags;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+// writes the index (compact encoding, see kser_format.h) and the trailer pointing at it
+static void write_archive_index(archive_sink& out, const entry_table& table,
+                                const std::vector<entry_payload>& payloads, const dedup_plan& plan,
+                                const extent_map& sparse) {
+    uint64_t index_offset = out.offset();
+    uint64_t index_length = 0;
+    xxh64_stream index_hash;
+    auto put = [&](const void* data, size_t size) {
+        out.write(reinterpret_cast<const char*>(data), size);
+        index_hash.update(data, size);
+        index_length += size;
+    };
+    auto put_number = [&](uint64_t value) {
+        char buffer[10];
+        put(buffer, put_varint(buffer, value));
+    };
+
+    // distinct (win, linux) pairs in order of first use
+    std::vector<uint32_t> permission_of(table.size());
+    std::vector<std::pair<int32_t, int32_t>> permissions;
+    {
+        std::unordered_map<uint64_t, uint32_t> numbers;
+        for (size_t i = 0; i < table.size(); i++) {
+            uint64_t key = (static_cast<uint64_t>(static_cast<uint32_t>(table.win_permissions[i])) << 32)
+                | static_cast<uint32_t>(table.linux_permissions[i]);
+            auto [it, inserted] = numbers.emplace(key, static_cast<uint32_t>(permissions.size()));
+            if (inserted) {
+                permissions.emplace_back(table.win_permissions[i], table.linux_permissions[i]);
+            }
+            permission_of[i] = it->second;
+        }
+    }
+
+    uint64_t name_bytes = 0;
+    for (size_t i = 0; i < table.size(); i++) {
+        name_bytes += table.name(i).size();
+    }
+    put_number(table.size());
+    put_number(name_bytes);
+    put_number(permissions.size());
+    for (const auto& [win_permissions, linux_permissions] : permissions) {
+        put(&win_permissions, sizeof(win_permissions));
+        put(&linux_permissions, sizeof(linux_permissions));
+    }
+
+    // what the same index takes in the fixed-width layout, for the log
+    uint64_t fixed_length = sizeof(uint64_t);
+    std::string_view previous_name;
+    uint64_t next_offset = 0;
+    int64_t previous_mtime = 0;
+    uint64_t previous_inode = 0;
+    for (size_t i = 0; i < table.size(); i++) {
+        const entry_payload& payload = payloads[i];
+        bool hard_link = !plan.hard_link.empty() && plan.hard_link[i];
+        uint8_t entry_flags = payload.codec != kser_codec::none ? kser_entry_codec : 0;
+        if (hard_link) {
+            entry_flags |= kser_entry_hard_link;
+        }
+        if (!table.is_dir[i] && (table.mtime_ns[i] != 0 || table.inode[i] != 0)) {
+            entry_flags |= kser_entry_stat;
+        }
+        const std::vector<file_extent>* extents = sparse_extents(sparse, i);
+        if (extents) {
+            entry_flags |= kser_entry_sparse;
+        }
+        if (!table.is_dir[i] && payload.has_checksum) {
+            entry_flags |= kser_entry_checksum;
+        }
+        if (table.is_dir[i]) {
+            entry_flags |= kser_entry_dir;
+        }
+        put(&entry_flags, sizeof(entry_flags));
+
+        std::string_view name = table.name(i);
+        size_t shared = 0;
+        size_t limit = std::min(name.size(), previous_name.size());
+        while (shared < limit && name[shared] == previous_name[shared]) {
+            shared++;
+        }
+        put_number(shared);
+        put_number(name.size() - shared);
+        put(name.data() + shared, name.size() - shared);
+        previous_name = name;
+
+        put_number(permission_of[i]);
+        fixed_length += 1 + 1 + 4 + name.size() + 4 + 4 + 8 + 8;
+
+        if (!table.is_dir[i]) {
+            put_number(table.file_size[i]);
+            put_number(zigzag(static_cast<int64_t>(payload.data_offset - next_offset)));
+            next_offset = payload.data_offset + payload.stored_size;
+        }
+        if (entry_flags & kser_entry_codec) {
+            uint8_t codec = static_cast<uint8_t>(payload.codec);
+            put(&codec, sizeof(codec));
+            put_number(payload.stored_size);
+            fixed_length += 1 + 8;
+        }
+        if (entry_flags & kser_entry_hard_link) {
+            put_number(i - plan.same_as[i]);
+            fixed_length += 8;
+        }
+        if (entry_flags & kser_entry_stat) {
+            put_number(zigzag(static_cast<int64_t>(static_cast<uint64_t>(table.mtime_ns[i]) - static_cast<uint64_t>(previous_mtime))));
+            put_number(zigzag(static_cast<int64_t>(table.inode[i] - previous_inode)));
+            previous_mtime = table.mtime_ns[i];
+            previous_inode = table.inode[i];
+            fixed_length += 8 + 8;
+        }
+        if (entry_flags & kser_entry_sparse) {
+            put_number(extents->size());
+            uint64_t previous_end = 0;
+            for (const file_extent& extent : *extents) {
+                put_number(extent.offset - previous_end);
+                put_number(extent.length);
+                previous_end = extent.offset + extent.length;
+            }
+            fixed_length += 4 + 16 * extents->size();
+        }
+        if (entry_flags & kser_entry_checksum) {
+            put(&payload.checksum, sizeof(payload.checksum));
+            fixed_length += 8;
+        }
+    }
+
+    uint64_t index_checksum = index_hash.digest();
+    out.write(reinterpret_cast<const char*>(&index_checksum), sizeof(index_checksum));
+
+    kser_trailer trailer;
+    trailer.index_offset = index_offset;
+    trailer.index_length = index_length;
+    std::memcpy(trailer.magic, kser_trailer_magic, sizeof(trailer.magic));
+    out.write(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+
+    addToLog(u8"index: " + to_u8string(index_length) + u8" bytes for " + to_u8string(table.size()) + u8" entries ("
+        + to_u8string(fixed_length) + u8" in the fixed-width layout, " + to_u8string(permissions.size())
+        + u8" distinct permissions)");
+}
+
+// files that are unchanged since the previous archive: same size, mtime and inode.
+// returns the old entry for every entry that can keep its payload, no_entry for the others
+static std::vector<size_t> find_unchanged(const entry_table& table, const KserView& previous) {
+    std::unordered_map<std::string_view, size_t> old_files;
+    old_files.reserve(previous.size());
+    for (size_t j = 0; j < previous.size(); j++) {
+        const kser_entry& entry = previous.entry(j);
+        if (!entry.isDir && entry.mtime_ns != 0) {
+            old_files.emplace(entry.filename, j);
+        }
+    }
+
+    std::vector<size_t> reuse(table.size(), no_entry);
+    for (size_t i = 0; i < table.size(); i++) {
+        if (table.is_dir[i] || table.mtime_ns[i] == 0) {
+            continue;
+        }
+        auto it = old_files.find(table.name(i));
+        if (it == old_files.end()) {
+            continue;
+        }
+        const kser_entry& old = previous.entry(it->second);
+        if (old.file_size == table.file_size[i] && old.mtime_ns == table.mtime_ns[i] && old.inode == table.inode[i]) {
+            reuse[i] = it->second;
+        }
+    }
+    return reuse;
+}
+
+// adds the data extents of files with holes to sparse (entries not settled yet) and stops
+// dedup from sharing a payload between entries that store different extents
+static void find_sparse_files(const entry_table& table, const std::vector<uint8_t>& settled,
+                              dedup_plan& plan, extent_map& sparse) {
+    // files with fewer blocks allocated than their size suggests may have holes
+    for (size_t i = 0; i < table.size(); i++) {
+        if (table.is_dir[i] || settled[i] || table.disk_size[i] + sparse_min_hole > table.file_size[i]) {
+            continue;
+        }
+        std::vector<file_extent> extents = find_data_extents(table.full_path(i), table.file_size[i]);
+        if (extents.size() == 1 && extents[0].offset == 0 && extents[0].length == table.file_size[i]) {
+            continue;
+        }
+        sparse.emplace(i, std::move(extents));
+    }
+    // a payload is only shared between entries that store the same extents. hard links have
+    // the same extents anyway, a sparse and a dense copy of the same contents don't
+    for (size_t i = 0; i < plan.same_as.size(); i++) {
+        if (plan.same_as[i] == no_entry || plan.hard_link[i]) {
+            continue;
+        }
+        const std::vector<file_extent>* a = sparse_extents(sparse, i);
+        const std::vector<file_extent>* b = sparse_extents(sparse, plan.same_as[i]);
+        if ((a || b) && (!a || !b || !same_extents(*a, *b))) {
+            plan.same_as[i] = no_entry;
+            plan.duplicates--;
+            plan.saved_bytes -= table.file_size[i];
+        }
+    }
+}
+
+// reads the small files entries through the ring in one go and appends them raw. with stats
+// every file gets the batch's average time
+static void copy_small_files(archive_sink& out, const entry_table& table, const std::vector<size_t>& entries,
+                             io_ring& ring, std::vector<entry_payload>& payloads, const kser_options& options) {
+    if (entries.empty()) {
+        return;
+    }
+    check_cancelled(options);
+    uint64_t start = options.stats ? stats_now_ns() : 0;
+    std::vector<batch_read> reads;
+    reads.reserve(entries.size());
+    size_t total = 0;
+    for (size_t i : entries) {
+        total += static_cast<size_t>(table.file_size[i]);
+    }
+    std::unique_ptr<char[]> buffer(new char[std::max<size_t>(total, 1)]);
+    size_t pos = 0;
+    for (size_t i : entries) {
+        size_t size = static_cast<size_t>(table.file_size[i]);
+        reads.push_back({ table.full_path(i), buffer.get() + pos, size });
+        pos += size;
+    }
+    read_files(ring, reads);
+
+    for (size_t k = 0; k < entries.size(); k++) {
+        entry_payload& payload = payloads[entries[k]];
+        payload.data_offset = out.offset();
+        payload.stored_size = reads[k].size;
+        payload.codec = kser_codec::none;
+        payload.has_checksum = true;
+        payload.checksum = xxh64(reads[k].data, reads[k].size);
+        out.write(reads[k].data, reads[k].size);
+    }
+    if (options.stats) {
+        uint64_t each = (stats_now_ns() - start) / entries.size();
+        for (size_t i : entries) {
+            options.stats->add_file(table.name(i), each, table.file_size[i]);
+        }
+    }
+    report_progress(options, entries.size(), pos);
+}
+
+// payloads of all entries with own_payload set, then the shared ones, then the index.
+// payloads already holds the entries kept from a previous archive.
+static void write_entries(archive_sink& out, const entry_table& table, const kser_options& options,
+                          const dedup_plan& plan, const std::vector<uint8_t>& own_payload,
+                          const std::vector<uint8_t>& settled, const extent_map& sparse,
+                          std::vector<entry_payload>& payloads) {
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+    uint64_t total_bytes = 0;
+    for (size_t i = 0; i < table.size(); i++) {
+        total_bytes += table.file_size[i];
+        if (own_payload[i]) {
+            files++;
+            bytes += table.file_size[i];
+        }
+    }
+    // directories, kept and shared entries cost nothing more
+    report_progress(options, table.size() - files, total_bytes - bytes);
+    phase_timer payloads_timer(options.stats, kser_phase::payloads);
+    std::unique_ptr<io_ring> ring;
+    if (use_io_uring(options, files, bytes)) {
+        ring = std::make_unique<io_ring>();
+    }
+
+    if (options.compression == kser_codec::klz) {
+        payload_pipeline<archive_sink> pipeline(out, table, own_payload, sparse, payloads, options, ring.get());
+        pipeline.run();
+    }
+    else {
+        std::vector<size_t> small_files;
+        uint64_t small_bytes = 0;
+        for (size_t i = 0; i < table.size(); i++) {
+            if (!own_payload[i]) {
+                continue;
+            }
+            const std::vector<file_extent>* extents = sparse_extents(sparse, i);
+            uint64_t size = data_size(table, i, extents);
+            if (ring && !extents && size <= uring_small_file) {
+                small_files.push_back(i);
+                small_bytes += size;
+                if (small_files.size() == ring->capacity() || small_bytes >= copy_buffer_size * 16) {
+                    copy_small_files(out, table, small_files, *ring, payloads, options);
+                    small_files.clear();
+                    small_bytes = 0;
+                }
+                continue;
+            }
+            check_cancelled(options);
+            payloads[i].data_offset = out.offset();
+            payloads[i].stored_size = size;
+            payloads[i].codec = kser_codec::none;
+            payloads[i].has_checksum = true;
+            time_file(options.stats, table.name(i), table.file_size[i], [&] {
+                payloads[i].checksum = size > 0 ? out.copy_file(table.full_path(i), size, extents) : xxh64(nullptr, 0);
+            });
+            report_progress(options, 1, table.file_size[i]);
+        }
+        if (ring) {
+            copy_small_files(out, table, small_files, *ring, payloads, options);
+        }
+    }
+
+    // shared entries point at an earlier entry, which already has its final payload
+    for (size_t i = 0; i < table.size(); i++) {
+        if (!settled[i] && shares_payload(plan, i)) {
+            payloads[i] = payloads[plan.same_as[i]];
+        }
+    }
+    payloads_timer.stop();
+
+    phase_timer index_timer(options.stats, kser_phase::index);
+    write_archive_index(out, table, payloads, plan, sparse);
+    out.flush();
+}
+
+// header and index only (kser_archive_metadata_only): no file is opened, every payload is empty
+static void write_metadata_archive(const fs::path& output_file, const entry_table& table, const kser_options& options) {
+    uint64_t total_bytes = 0;
+    for (size_t i = 0; i < table.size(); i++) {
+        total_bytes += table.file_size[i];
+    }
+    bool opened = false;
+    try {
+        archive_sink out(output_file);
+        opened = true;
+        write_archive_header(out, kser_archive_metadata_only);
+        phase_timer timer(options.stats, kser_phase::index);
+        write_archive_index(out, table, std::vector<entry_payload>(table.size()), dedup_plan(), extent_map());
+        out.flush();
+    }
+    catch (...) {
+        if (opened) {
+            std::error_code ec;
+            fs::remove(output_file, ec);
+        }
+        throw;
+    }
+    report_progress(options, table.size(), total_bytes);
+}
+
+// payloads are written first and the index after them, so every entry's data offset and
+// stored size is known when the index is written.
+//
+// incremental: unchanged files keep their payload in the previous archive. the changed ones and
+// a new index are appended after it, the old index stays behind as dead space. once dead space
+// outgrows the payloads still in use, the archive is rewritten instead, copying the kept
+// payloads out of the old archive (inside the kernel on linux) into a fresh file.
+uint64_t write_archive(const fs::path& output_file, const entry_table& table, const kser_options& options,
+                       const KserView* previous) {
+    if (options.metadata_only) {
+        write_metadata_archive(output_file, table, options);
+        return 0;
+    }
+    std::vector<size_t> reuse;
+    if (options.incremental && previous) {
+        reuse = find_unchanged(table, *previous);
+    }
+    std::vector<uint8_t> settled(table.size(), 0);
+    std::vector<entry_payload> payloads(table.size());
+    uint64_t reused_files = 0;
+    uint64_t reused_bytes = 0;
+    std::unordered_map<uint64_t, uint64_t> kept_offsets;
+    extent_map sparse;
+    for (size_t i = 0; i < reuse.size(); i++) {
+        if (reuse[i] == no_entry) {
+            continue;
+        }
+        const kser_entry& old = previous->entry(reuse[i]);
+        settled[i] = 1;
+        payloads[i].data_offset = old.data_offset;
+        payloads[i].stored_size = old.stored_size;
+        payloads[i].codec = old.codec;
+        payloads[i].has_checksum = old.has_checksum;
+        payloads[i].checksum = old.checksum;
+        if (old.sparse) {
+            sparse.emplace(i, previous->extents(reuse[i]));
+        }
+        reused_files++;
+        if (old.stored_size > 0 && kept_offsets.emplace(old.data_offset, 0).second) {
+            reused_bytes += old.stored_size;
+        }
+    }
+
+    dedup_plan plan;
+    if (options.dedup) {
+        phase_timer timer(options.stats, kser_phase::dedup);
+        plan = find_duplicate_payloads(table, options.threads, settled);
+        addToLog(u8"dedup: " + to_u8string(plan.hard_links) + u8" hard links, " + to_u8string(plan.duplicates)
+            + u8" duplicate files, " + to_u8string(plan.saved_bytes) + u8" bytes stored once");
+    }
+
+    {
+        phase_timer timer(options.stats, kser_phase::sparse);
+        find_sparse_files(table, settled, plan, sparse);
+    }
+
+    std::vector<uint8_t> own_payload(table.size(), 0);
+    for (size_t i = 0; i < table.size(); i++) {
+        own_payload[i] = !table.is_dir[i] && !settled[i] && !shares_payload(plan, i);
+    }
+
+    if (reused_files == 0) {
+        bool opened = false;
+        try {
+            archive_sink out(output_file);
+            opened = true;
+            write_archive_header(out);
+            write_entries(out, table, options, plan, own_payload, settled, sparse, payloads);
+        }
+        catch (...) {
+            // a partial archive has no index, nothing could read it
+            if (opened) {
+                std::error_code ec;
+                fs::remove(output_file, ec);
+            }
+            throw;
+        }
+        return 0;
+    }
+
+    uint64_t old_size = previous->file_size();
+    uint64_t dead_bytes = old_size - std::min(old_size, reused_bytes);
+    // an archive from before checksums or the compact index is rewritten, its header doesn't
+    // announce them
+    if (dead_bytes <= reused_bytes && previous->has_checksums() && previous->compact_index()) {
+        try {
+            archive_sink out(output_file, true);
+            write_entries(out, table, options, plan, own_payload, settled, sparse, payloads);
+        }
+        catch (...) {
+            // cut the appended data off again, which leaves the previous archive as it was
+            std::error_code ec;
+            fs::resize_file(output_file, old_size, ec);
+            throw;
+        }
+        addToLog(u8"kept " + to_u8string(reused_files) + u8" unchanged files, appended the rest to " + output_file.u8string());
+        return reused_files;
+    }
+
+    fs::path temp_file = output_file;
+    temp_file += u8".tmp";
+    try {
+        {
+            archive_sink out(temp_file);
+            write_archive_header(out);
+            phase_timer timer(options.stats, kser_phase::payloads);
+            for (size_t i = 0; i < table.size(); i++) {
+                if (!settled[i]) {
+                    continue;
+                }
+                if (payloads[i].stored_size == 0) {
+                    // the old offset may lie past the end of the smaller data section. empty
+                    // payloads have no identity of their own (see kser_format.h), kept_offsets
+                    // leaves them out
+                    payloads[i].data_offset = out.offset();
+                    continue;
+                }
+                uint64_t& new_offset = kept_offsets[payloads[i].data_offset];
+                if (new_offset == 0) {
+                    new_offset = out.offset();
+#if defined(OS_LINUX)
+                    out.copy_range(previous->fd(), payloads[i].data_offset, payloads[i].stored_size);
+#else
+                    auto payload = previous->payload(reuse[i]);
+                    out.write(payload.data(), payload.size());
+#endif
+                }
+                payloads[i].data_offset = new_offset;
+            }
+            timer.stop();
+            write_entries(out, table, options, plan, own_payload, settled, sparse, payloads);
+        }
+        {
+            // read the new archive back before it replaces the previous one, closed again
+            // before the rename
+            KserView check(temp_file);
+        }
+        fs::rename(temp_file, output_file);
+    }
+    catch (...) {
+        std::error_code ec;
+        fs::remove(temp_file, ec);
+        throw;
+    }
+    addToLog(u8"kept " + to_u8string(reused_files) + u8" unchanged files, rewrote " + output_file.u8string()
+        + u8" to drop " + to_u8string(dead_bytes) + u8" bytes of old data");
+    return reused_files;
+}
+
+// record of entry i of a streaming archive (see kser_format.h). own is set when the entry's
+// payload follows the record
+static void write_stream_record(stream_sink& out, xxh64_stream& records_hash, const entry_table& table,
+                                size_t i, const entry_payload& payload, const dedup_plan& plan, const extent_map& sparse,
+                                bool own) {
+    auto put = [&](const void* data, size_t size) {
+        out.write(reinterpret_cast<const char*>(data), size);
+        records_hash.update(data, size);
+    };
+
+    bool hard_link = !plan.hard_link.empty() && plan.hard_link[i];
+    bool shared = !hard_link && shares_payload(plan, i);
+    uint8_t entry_flags = own && payload.codec != kser_codec::none ? kser_entry_codec : 0;
+    if (hard_link) {
+        entry_flags |= kser_entry_hard_link;
+    }
+    const std::vector<file_extent>* extents = sparse_extents(sparse, i);
+    if (extents) {
+        entry_flags |= kser_entry_sparse;
+    }
+    if (shared) {
+        entry_flags |= kser_entry_shared;
+    }
+    if (own) {
+        entry_flags |= kser_entry_checksum;
+    }
+    put(&table.is_dir[i], sizeof(uint8_t));
+    put(&entry_flags, sizeof(entry_flags));
+
+    std::string_view name = table.name(i);
+    uint32_t filename_len_bytes = static_cast<uint32_t>(name.size());
+    put(&filename_len_bytes, sizeof(filename_len_bytes));
+    put(name.data(), filename_len_bytes);
+
+    put(&table.win_permissions[i], sizeof(int32_t));
+    put(&table.linux_permissions[i], sizeof(int32_t));
+    put(&table.file_size[i], sizeof(uint64_t));
+
+    if (entry_flags & kser_entry_codec) {
+        uint8_t codec = static_cast<uint8_t>(payload.codec);
+        put(&codec, sizeof(codec));
+    }
+    if (entry_flags & kser_entry_hard_link) {
+        uint64_t link_target = plan.same_as[i];
+        put(&link_target, sizeof(link_target));
+    }
+    if (entry_flags & kser_entry_sparse) {
+        uint32_t extent_count = static_cast<uint32_t>(extents->size());
+        put(&extent_count, sizeof(extent_count));
+        for (const file_extent& extent : *extents) {
+            put(&extent.offset, sizeof(extent.offset));
+            put(&extent.length, sizeof(extent.length));
+        }
+    }
+    if (entry_flags & kser_entry_shared) {
+        uint64_t same_as = plan.same_as[i];
+        put(&same_as, sizeof(same_as));
+    }
+}
+
+// the payload pipeline runs as for a normal archive, its hooks put each entry's record in front
+// of the payload and the checksum behind it. records of entries without a payload of their own
+// (directories, hard links, shared payloads) are written in order in between.
+void write_stream(std::ostream& stream, const entry_table& table, const kser_options& options) {
+    std::vector<uint8_t> settled(table.size(), 0);
+    dedup_plan plan;
+    if (options.dedup) {
+        phase_timer timer(options.stats, kser_phase::dedup);
+        plan = find_duplicate_payloads(table, options.threads, settled);
+        addToLog(u8"dedup: " + to_u8string(plan.hard_links) + u8" hard links, " + to_u8string(plan.duplicates)
+            + u8" duplicate files, " + to_u8string(plan.saved_bytes) + u8" bytes stored once");
+    }
+    extent_map sparse;
+    {
+        phase_timer timer(options.stats, kser_phase::sparse);
+        find_sparse_files(table, settled, plan, sparse);
+    }
+
+    std::vector<uint8_t> own_payload(table.size(), 0);
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < table.size(); i++) {
+        own_payload[i] = !table.is_dir[i] && !shares_payload(plan, i);
+        if (own_payload[i]) {
+            files++;
+            bytes += table.file_size[i];
+        }
+    }
+    std::vector<entry_payload> payloads(table.size());
+
+    stream_sink out(stream);
+    kser_file_header header;
+    std::memcpy(header.magic, kser_magic, sizeof(header.magic));
+    header.version = kser_version;
+    header.flags = kser_archive_stream | kser_archive_checksums;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    xxh64_stream records_hash;
+    size_t next_record = 0;
+    auto records_before = [&](size_t end) {
+        for (; next_record < end; next_record++) {
+            write_stream_record(out, records_hash, table, next_record, payloads[next_record], plan, sparse, false);
+            report_progress(options, 1, table.file_size[next_record]);
+        }
+    };
+    payload_hooks hooks;
+    hooks.before = [&](size_t entry) {
+        records_before(entry);
+        write_stream_record(out, records_hash, table, entry, payloads[entry], plan, sparse, true);
+        next_record = entry + 1;
+    };
+    hooks.after = [&](size_t entry) {
+        out.write(reinterpret_cast<const char*>(&payloads[entry].checksum), sizeof(payloads[entry].checksum));
+    };
+
+    // records are written along with the payloads, a streaming archive has no index phase
+    phase_timer payloads_timer(options.stats, kser_phase::payloads);
+    if (options.compression == kser_codec::klz) {
+        std::unique_ptr<io_ring> ring;
+        if (use_io_uring(options, files, bytes)) {
+            ring = std::make_unique<io_ring>();
+        }
+        payload_pipeline<stream_sink> pipeline(out, table, own_payload, sparse, payloads, options, ring.get(), &hooks);
+        pipeline.run();
+    }
+    else {
+        for (size_t i = 0; i < table.size(); i++) {
+            if (!own_payload[i]) {
+                continue;
+            }
+            check_cancelled(options);
+            const std::vector<file_extent>* extents = sparse_extents(sparse, i);
+            uint64_t size = data_size(table, i, extents);
+            payloads[i].codec = kser_codec::none;
+            hooks.before(i);
+            payloads[i].has_checksum = true;
+            time_file(options.stats, table.name(i), table.file_size[i], [&] {
+                payloads[i].checksum = size > 0 ? out.copy_file(table.full_path(i), size, extents) : xxh64(nullptr, 0);
+            });
+            hooks.after(i);
+            report_progress(options, 1, table.file_size[i]);
+        }
+    }
+    records_before(table.size());
+
+    uint8_t end = kser_stream_end;
+    uint64_t tail[2] = { table.size(), records_hash.digest() };
+    out.write(reinterpret_cast<const char*>(&end), sizeof(end));
+    out.write(reinterpret_cast<const char*>(tail), sizeof(tail));
+    out.flush();
+}
@@ -0,0 +1,41 @@
+#pragma once
+#ifndef K_SER_WRITER_IMPL
+#define K_SER_WRITER_IMPL
+
+#include <cstdint>
+#include <iosfwd>
+#include <vector>
+
+#include "kserialize.h"
+#include "kser_codec.h"
+
+class KserView;
+
+// where and how one entry's payload ended up in the archive
+struct entry_payload {
+    uint64_t data_offset = 0;
+    uint64_t stored_size = 0;
+    kser_codec codec = kser_codec::none;
+    // xxh64 of the stored bytes. payloads kept from an archive written before checksums have none
+    bool has_checksum = false;
+    uint64_t checksum = 0;
+};
+
+// writes a complete v2 archive: header, the payloads of the entries in table and the index.
+// with options.compression set, files are split into blocks that are compressed on worker
+// threads while the next blocks are read and the previous ones written. files whose first
+// block doesn't compress are copied raw. with options.dedup,
+// identical files and hard links are written once and share that payload in the index.
+//
+// previous is the archive currently at output_file. with options.incremental, files that are
+// unchanged since it keep their payload there. returns the number of such files.
+// with options.metadata_only only the index is written and previous isn't used.
+uint64_t write_archive(const fs::path& output_file, const entry_table& table, const kser_options& options,
+                       const KserView* previous = nullptr);
+
+// writes table as a streaming archive (see kser_format.h) with sequential writes only, so out
+// can be a pipe or stdout. same payloads and options as write_archive, except incremental
+// and metadata_only.
+void write_stream(std::ostream& out, const entry_table& table, const kser_options& options);
+
+#endif
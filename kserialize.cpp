@@ -0,0 +1,1686 @@
+#include "kserialize.h"
+#include "kser_pool.h"
+#include "kser_io.h"
+#include "kser_view.h"
+#include "kser_writer.h"
+#include "kser_hash.h"
+#include "kser_uring.h"
+#include "kser_stream.h"
+#include "kser_stats.h"
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+
+#include <fcntl.h>
+
+#if defined(OS_WIN)
+#include "permwin.h"
+#elif defined(OS_LINUX)
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+static std::u8string errno_u8string() {
+    std::string message = std::strerror(errno);
+    return std::u8string(message.begin(), message.end());
+}
+
+mode_t read_umask(){
+    mode_t mask = umask (0);
+    umask(mask);
+    return mask;
+}
+
+// umask for when the mode of new entries can't be told from their create call, every mode is
+// then set explicitly
+constexpr mode_t unknown_umask = static_cast<mode_t>(-1);
+
+// the umask that new entries in dir_fd get their mode through. a default acl replaces the umask
+// and a setgid bit is passed on to new directories, so with either the modes aren't known
+static mode_t creation_umask(int dir_fd) {
+    struct stat st;
+    if (fstat(dir_fd, &st) == -1 || (st.st_mode & S_ISGID) != 0) {
+        return unknown_umask;
+    }
+    if (fgetxattr(dir_fd, "system.posix_acl_default", nullptr, 0) >= 0) {
+        return unknown_umask;
+    }
+    return read_umask();
+}
+#endif
+
+void throw_u8string_error(std::u8string s) {
+    throw std::runtime_error(std::string(reinterpret_cast<const char*>(&s[0])));
+}
+
+void report_progress(const kser_options& options, uint64_t entries, uint64_t bytes) {
+    if (options.progress) {
+        options.progress->entries_done.fetch_add(entries, std::memory_order_relaxed);
+        options.progress->bytes_done.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    if (options.stats) {
+        options.stats->add(kser_counter::entries, entries);
+        options.stats->add(kser_counter::bytes, bytes);
+    }
+}
+
+void check_cancelled(const kser_options& options) {
+    if (options.progress && options.progress->cancel.load(std::memory_order_relaxed)) {
+        throw kser_cancelled();
+    }
+}
+
+
+// carries over the permissions of the other system from the previous archive.
+// both tables are sorted by name, so this is one merge-join pass with no lookups.
+// the current system's permissions were just read from disk and are kept.
+static void fill_other_system_permissions(entry_table& new_files, entry_table& old_files) {
+    // archives written on the other system may use a slightly different path order
+    old_files.sort_by_name();
+
+    size_t j = 0;
+    for (size_t i = 0; i < new_files.size(); i++) {
+        std::string_view name = new_files.name(i);
+        while (j < old_files.size() && name_less(old_files.name(j), name)) {
+            ++j;
+        }
+        if (j == old_files.size() || name_less(name, old_files.name(j))) {
+            continue;
+        }
+#if defined(OS_WIN)
+        new_files.linux_permissions[i] = old_files.linux_permissions[j];
+#elif defined(OS_LINUX)
+        new_files.win_permissions[i] = old_files.win_permissions[j];
+#else
+        new_files.win_permissions[i] = old_files.win_permissions[j];
+        new_files.linux_permissions[i] = old_files.linux_permissions[j];
+#endif
+    }
+}
+
+// reads type, size and the current system's permissions of entry i without logging, so it can
+// run on scan workers
+static void read_fso_info(entry_table& files, size_t i, const fs::path& full_path) {
+    files.is_dir[i] = fs::is_directory(full_path) ? 1 : 0;
+    if (files.is_dir[i]) {
+        files.file_size[i] = 0;
+    }
+    else {
+        files.file_size[i] = fs::file_size(full_path);
+    }
+
+    //reading permissions
+#if defined (OS_WIN)
+    std::wstring widePath = full_path.wstring();
+    LPCWSTR filePath = widePath.c_str();
+    int32_t permissions = GetCurrentUserFilePermissionsWin(filePath);
+
+    if (permissions != 0) {
+        files.win_permissions[i] = permissions;
+    }
+    else {
+        throw_u8string_error(u8"failed to get current user's permissions or no explicit permissions found for " + full_path.u8string());
+    }
+    files.mtime_ns[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        fs::last_write_time(full_path).time_since_epoch()).count();
+#elif defined (OS_LINUX)
+    // one stat gives the permissions fs::status would, the identity for hard links and the mtime
+    struct stat st;
+    if (stat(full_path.c_str(), &st) == -1) {
+        throw_u8string_error(u8"failed to read attributes of " + full_path.u8string() + u8": " + errno_u8string());
+    }
+    files.linux_permissions[i] = static_cast<int32_t>(st.st_mode & 07777);
+    files.device[i] = (static_cast<uint64_t>(major(st.st_dev)) << 32) | minor(st.st_dev);
+    files.inode[i] = static_cast<uint64_t>(st.st_ino);
+    files.link_count[i] = static_cast<uint32_t>(st.st_nlink);
+    files.mtime_ns[i] = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    files.disk_size[i] = static_cast<uint64_t>(st.st_blocks) * 512;
+#endif
+
+}
+
+void read_fso_isDir_size_permissions(entry_table& files, size_t i) {
+    fs::path full_path = files.full_path(i);
+    read_fso_info(files, i, full_path);
+    addToLog(log_level::debug, u8"read permissions for " + full_path.u8string());
+}
+
+struct scan_result {
+    entry_table files;
+    uint64_t syscalls = 0;
+};
+
+// portable scan: std::filesystem calls, each counted as one syscall although
+// fs::relative alone walks both paths component by component, so the count is a lower bound
+static void scan_directory_portable(work_stealing_pool& pool, std::vector<scan_result>& results, const kser_options& options,
+                                    const fs::path& base_path, fs::path dir_path) {
+    check_cancelled(options);
+    scan_result& out = results[pool.worker_index()];
+    out.syscalls++;
+    for (const auto& entry : fs::directory_iterator(dir_path)) {
+        std::u8string name = fs::relative(entry.path(), base_path).generic_u8string();
+        size_t i = out.files.add(std::string_view(reinterpret_cast<const char*>(name.data()), name.size()));
+        read_fso_info(out.files, i, entry.path());
+        out.syscalls += out.files.is_dir[i] ? 3 : 4;
+
+        // like recursive_directory_iterator, symlinks to directories are not followed
+        if (out.files.is_dir[i] && !entry.is_symlink()) {
+            pool.submit([&pool, &results, &options, &base_path, sub_path = entry.path()] {
+                scan_directory_portable(pool, results, options, base_path, sub_path);
+            });
+        }
+    }
+}
+
+#if defined(OS_LINUX)
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// linux scan: the directory is opened once and read with getdents64. d_type says whether an
+// entry is a directory to descend into, and a single statx relative to the directory fd
+// gives mode and size. entry names are built by appending to the parent's name, full paths
+// only for subdirectories and errors.
+static void scan_directory_linux(work_stealing_pool& pool, std::vector<scan_result>& results, const kser_options& options,
+                                 std::string full_path, std::string rel_path) {
+    check_cancelled(options);
+    scan_result& out = results[pool.worker_index()];
+
+    int dir_fd = open(full_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    out.syscalls++;
+    if (dir_fd == -1) {
+        throw_u8string_error(u8"failed to open directory " + fs::path(full_path).u8string() + u8": " + errno_u8string());
+    }
+
+    try {
+        alignas(linux_dirent64) char buffer[64 * 1024];
+        std::string entry_name;
+        for (;;) {
+            long read_bytes = syscall(SYS_getdents64, dir_fd, buffer, sizeof(buffer));
+            out.syscalls++;
+            if (read_bytes == -1) {
+                throw_u8string_error(u8"failed to read directory " + fs::path(full_path).u8string() + u8": " + errno_u8string());
+            }
+            if (read_bytes == 0) {
+                break;
+            }
+
+            for (long pos = 0; pos < read_bytes;) {
+                auto* dirent = reinterpret_cast<linux_dirent64*>(buffer + pos);
+                pos += dirent->d_reclen;
+
+                const char* name = dirent->d_name;
+                if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                    continue;
+                }
+
+                bool descend = dirent->d_type == DT_DIR;
+
+                struct statx stx;
+                const unsigned scan_mask = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_INO | STATX_NLINK | STATX_MTIME | STATX_BLOCKS;
+                int flags = AT_NO_AUTOMOUNT;
+                if (dirent->d_type == DT_UNKNOWN) {
+                    // file system without d_type: find out about symlinks ourselves
+                    flags |= AT_SYMLINK_NOFOLLOW;
+                }
+                int rc = statx(dir_fd, name, flags, scan_mask, &stx);
+                out.syscalls++;
+                if (rc == 0 && dirent->d_type == DT_UNKNOWN) {
+                    descend = S_ISDIR(stx.stx_mode);
+                    if (S_ISLNK(stx.stx_mode)) {
+                        rc = statx(dir_fd, name, AT_NO_AUTOMOUNT, scan_mask, &stx);
+                        out.syscalls++;
+                    }
+                }
+                if (rc == -1) {
+                    throw_u8string_error(u8"failed to read attributes of " + fs::path(full_path + '/' + name).u8string() + u8": " + errno_u8string());
+                }
+
+                // same results as is_directory/file_size/status, which all follow symlinks
+                bool is_dir = S_ISDIR(stx.stx_mode);
+                if (!is_dir && !S_ISREG(stx.stx_mode)) {
+                    throw_u8string_error(u8"can't serialize " + fs::path(full_path + '/' + name).u8string() + u8": not a regular file or directory");
+                }
+                entry_name.assign(rel_path).append(1, '/').append(name);
+                entry_table& files = out.files;
+                size_t i = files.add(entry_name);
+                files.is_dir[i] = is_dir ? 1 : 0;
+                files.file_size[i] = is_dir ? 0 : stx.stx_size;
+                files.linux_permissions[i] = static_cast<int32_t>(stx.stx_mode & 07777);
+                files.device[i] = (static_cast<uint64_t>(stx.stx_dev_major) << 32) | stx.stx_dev_minor;
+                files.inode[i] = stx.stx_ino;
+                files.link_count[i] = stx.stx_nlink;
+                files.mtime_ns[i] = stx.stx_mtime.tv_sec * 1000000000 + stx.stx_mtime.tv_nsec;
+                files.disk_size[i] = stx.stx_blocks * 512;
+
+                if (descend) {
+                    pool.submit([&pool, &results, &options, sub_full = full_path + '/' + name, sub_rel = entry_name] {
+                        scan_directory_linux(pool, results, options, sub_full, sub_rel);
+                    });
+                }
+            }
+        }
+    }
+    catch (...) {
+        close(dir_fd);
+        throw;
+    }
+    close(dir_fd);
+    out.syscalls++;
+}
+#endif
+
+// every directory is one task on the pool. entries are collected per worker and merged
+// at the end, the caller sorts them so the result doesn't depend on scheduling.
+// returns the number of syscalls the scan made.
+uint64_t process_directory(const fs::path& directory_path, entry_table& new_files, const kser_options& options) {
+    const fs::path base_path = directory_path.parent_path();
+    work_stealing_pool pool(options.threads);
+    std::vector<scan_result> results(pool.size());
+
+#if defined(OS_LINUX)
+    if (options.fast_scan) {
+        pool.submit([&] {
+            scan_directory_linux(pool, results, options, directory_path.native(), directory_path.filename().native());
+        });
+    }
+    else
+#endif
+    {
+        pool.submit([&] {
+            scan_directory_portable(pool, results, options, base_path, directory_path);
+        });
+    }
+    pool.wait();
+
+    uint64_t syscalls = 0;
+    size_t entries = new_files.size();
+    size_t name_bytes = new_files.name_bytes();
+    for (const auto& result : results) {
+        entries += result.files.size();
+        name_bytes += result.files.name_bytes();
+    }
+    new_files.reserve(entries, name_bytes);
+    bool log_files = log_enabled(log_level::debug);
+    for (auto& result : results) {
+        syscalls += result.syscalls;
+        for (size_t i = 0; log_files && i < result.files.size(); i++) {
+            addToLog(log_level::debug, u8"read permissions for " + (new_files.root() / result.files.filename(i)).u8string());
+        }
+        new_files.append(result.files);
+        result.files.clear();
+    }
+    return syscalls;
+}
+
+// the entries of an archive without their payloads, for their names and permissions
+static void read_archive_entries(const KserView& view, entry_table& old_files) {
+    size_t name_bytes = 0;
+    for (size_t i = 0; i < view.size(); i++) {
+        name_bytes += view.entry(i).filename.size();
+    }
+    old_files.reserve(old_files.size() + view.size(), old_files.name_bytes() + name_bytes);
+    for (size_t i = 0; i < view.size(); i++) {
+        const kser_entry& entry = view.entry(i);
+        size_t j = old_files.add(entry.filename);
+        old_files.is_dir[j] = entry.isDir;
+        old_files.win_permissions[j] = entry.win_permissions;
+        old_files.linux_permissions[j] = entry.linux_permissions;
+        old_files.file_size[j] = entry.file_size;
+    }
+}
+
+// the same from a streaming archive, whose payloads are skipped. returns the bytes read
+static uint64_t read_stream_entries(std::istream& in, const std::u8string& name, entry_table& old_files) {
+    kser_stream_reader reader(in, name);
+    while (reader.next()) {
+        const kser_entry& entry = reader.entry();
+        size_t j = old_files.add(entry.filename);
+        old_files.is_dir[j] = entry.isDir;
+        old_files.win_permissions[j] = entry.win_permissions;
+        old_files.linux_permissions[j] = entry.linux_permissions;
+        old_files.file_size[j] = entry.file_size;
+    }
+    return reader.offset();
+}
+
+void extract_old_fso_info(const fs::path& output_file, entry_table& old_files) {
+    KserView view(output_file);
+    read_archive_entries(view, old_files);
+}
+
+uint64_t write_fso_map_to_file(const fs::path& output_file, const entry_table& table,
+                               const kser_options& options, const KserView* previous) {
+    return write_archive(output_file, table, options, previous);
+}
+
+// runs one step of extracting an entry and names the entry in any error
+template <typename Step>
+static void for_entry(const kser_options& options, std::string_view filename, Step step) {
+    try {
+        step();
+    }
+    catch (const std::exception& e) {
+        if (options.stats) {
+            options.stats->add(kser_counter::errors, 1);
+        }
+        throw std::runtime_error(std::string("Failed to process file '") + std::string(filename) + "': " + e.what());
+    }
+}
+
+template <typename Step>
+static void for_entry(const kser_options& options, const KserView& view, size_t i, Step step) {
+    for_entry(options, view.entry(i).filename, step);
+}
+
+static void throw_exists(const fs::path& new_file_path) {
+    throw_u8string_error(u8"can't deserialize " + new_file_path.u8string() + u8" because it already exists");
+}
+
+// a failed hard link is only made up for with a copy of the data when the file system can't
+// link (at all, or that many times). any other failure, a missing target above all, is an error
+#if defined(OS_WIN)
+static bool links_unsupported(DWORD error) {
+    return error == ERROR_NOT_SUPPORTED || error == ERROR_INVALID_FUNCTION || error == ERROR_TOO_MANY_LINKS;
+}
+#elif defined(OS_LINUX)
+static bool links_unsupported(int error) {
+    return error == EPERM || error == EOPNOTSUPP || error == EMLINK || error == EXDEV;
+}
+#endif
+
+#if defined(OS_WIN)
+// on linux the entry is created with mkdir or O_EXCL instead, which fail on their own when it
+// exists, without a window between the check and the create
+static void check_not_exists(const fs::path& new_file_path) {
+    if (fs::exists(new_file_path)) {
+        throw_exists(new_file_path);
+    }
+}
+#endif
+
+// splits an entry name into the directory it is in ("" at the top) and its own name
+static std::pair<std::string_view, std::string_view> split_parent(std::string_view name) {
+    size_t slash = name.rfind('/');
+    if (slash == std::string_view::npos) {
+        return { std::string_view(), name };
+    }
+    return { name.substr(0, slash), name.substr(slash + 1) };
+}
+
+static void create_directory_at(const fs::path& new_file_path, int32_t win_permissions) {
+#if defined(OS_WIN)
+    check_not_exists(new_file_path);
+    std::wstring widePath = new_file_path.wstring();
+    LPWSTR output_file_path = (LPWSTR)(widePath.c_str());
+    if (!CreateDirectoryWithInheritedPermissions(output_file_path)) {
+        throw_u8string_error(u8"failed to create folder " + new_file_path.u8string());
+    }
+    addToLog(log_level::debug, u8"created " + new_file_path.u8string());
+
+    // set right away: files created below inherit from the folder
+    if (win_permissions != 0) {
+        if (!SetCurrentUserPermissionsWin(output_file_path, win_permissions)) {
+            throw_u8string_error(u8"failed to set permissions for " + new_file_path.u8string());
+        }
+        addToLog(log_level::debug, u8"set permissions for " + new_file_path.u8string());
+    } else {
+        addToLog(log_level::warning, u8"no permissions found for windows operating system for file" + new_file_path.u8string());
+        addToLog(log_level::warning, u8"created file with default permissions on your machine");
+    }
+#elif defined(OS_LINUX)
+    (void)win_permissions;
+    if (mkdir(reinterpret_cast<const char*>(&(new_file_path.u8string()[0])), 0777) == -1){
+        if (errno == EEXIST) {
+            throw_exists(new_file_path);
+        }
+        throw_u8string_error(u8"failed to create dir " +  new_file_path.u8string());
+    }
+    addToLog(log_level::debug, u8"created " + new_file_path.u8string());
+#endif
+}
+
+#if defined(OS_WIN)
+static void create_directory_entry(const KserView& view, size_t i, const fs::path& output_dir_path) {
+    create_directory_at(output_dir_path / view.filename(i), view.entry(i).win_permissions);
+}
+#elif defined(OS_LINUX)
+// the fd of the directory entry name is in. new_file_path is the entry's path for messages
+static int parent_fd(dir_fd_cache& dirs, std::string_view name, const fs::path& new_file_path) {
+    int fd = dirs.get(split_parent(name).first);
+    if (fd == -1) {
+        throw_u8string_error(u8"failed to open the folder of " + new_file_path.u8string() + u8": " + errno_u8string());
+    }
+    return fd;
+}
+
+// mkdirat in the parent's fd, then the new directory is opened for the entries below it
+static void create_directory_entry(const KserView& view, size_t i, const fs::path& output_dir_path, dir_fd_cache& dirs) {
+    std::string_view name = view.entry(i).filename;
+    fs::path new_file_path = output_dir_path / view.filename(i);
+    int dir_fd = parent_fd(dirs, name, new_file_path);
+    std::string base(split_parent(name).second);
+    if (mkdirat(dir_fd, base.c_str(), 0777) == -1) {
+        if (errno == EEXIST) {
+            throw_exists(new_file_path);
+        }
+        throw_u8string_error(u8"failed to create dir " + new_file_path.u8string() + u8": " + errno_u8string());
+    }
+    unique_fd fd(openat(dir_fd, base.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+    if (fd) {
+        dirs.put(name, std::move(fd));
+    }
+    addToLog(log_level::debug, u8"created " + new_file_path.u8string());
+}
+#endif
+
+// linux directories get their mode after everything below them exists
+static void set_directory_mode(const fs::path& new_file_path, int32_t linux_permissions) {
+#if defined(OS_LINUX)
+    if (linux_permissions != 0){
+        fs::permissions(new_file_path, static_cast<fs::perms>(linux_permissions));
+        addToLog(log_level::debug, u8"set permissions for " + new_file_path.u8string());
+    } else {
+        addToLog(log_level::warning, u8"no permissions found for linux operating system for file " + new_file_path.u8string());
+        addToLog(log_level::warning, u8"created file with deault permissions mask");
+    }
+#else
+    (void)new_file_path;
+    (void)linux_permissions;
+#endif
+}
+
+#if defined(OS_WIN)
+static void set_directory_permissions(const KserView& view, size_t i, const fs::path& output_dir_path) {
+    set_directory_mode(output_dir_path / view.filename(i), view.entry(i).linux_permissions);
+}
+#elif defined(OS_LINUX)
+// fchmodat in the parent's fd. mkdir already gave the directory 0777 without the umask (mask),
+// that mode needs no chmod unless mask is unknown_umask
+static void set_directory_permissions(const KserView& view, size_t i, const fs::path& output_dir_path, dir_fd_cache& dirs,
+                                      mode_t mask) {
+    const kser_entry& fso = view.entry(i);
+    fs::path new_file_path = output_dir_path / view.filename(i);
+    if (fso.linux_permissions == 0) {
+        addToLog(log_level::warning, u8"no permissions found for linux operating system for file " + new_file_path.u8string());
+        addToLog(log_level::warning, u8"created file with deault permissions mask");
+        return;
+    }
+    mode_t mode = static_cast<mode_t>(fso.linux_permissions) & 07777;
+    if (mask == unknown_umask || mode != (0777 & ~mask)) {
+        int dir_fd = parent_fd(dirs, fso.filename, new_file_path);
+        std::string base(split_parent(fso.filename).second);
+        if (fchmodat(dir_fd, base.c_str(), mode, 0) == -1) {
+            throw_u8string_error(u8"failed to set permissions for " + new_file_path.u8string() + u8": " + errno_u8string());
+        }
+    }
+    addToLog(log_level::debug, u8"set permissions for " + new_file_path.u8string());
+}
+#endif
+
+// the mode (linux) or the current user's permissions (windows) of a file that was just written
+static void apply_file_permissions(const fs::path& new_file_path, int32_t win_permissions, int32_t linux_permissions) {
+#if defined(OS_WIN)
+    (void)linux_permissions;
+    std::wstring widePath = new_file_path.wstring();
+    if (win_permissions != 0){
+        if (!SetCurrentUserPermissionsWin((LPWSTR)(widePath.c_str()), win_permissions)) {
+            throw_u8string_error(u8"failed to set permissions for " + new_file_path.u8string());
+        }
+        addToLog(log_level::debug, u8"set permissions for " + new_file_path.u8string());
+    } else {
+        addToLog(log_level::warning, u8"no permissions found for windows operating system for file" + new_file_path.u8string());
+        addToLog(log_level::warning, u8"created file with default permissions on your machine");
+    }
+#elif defined(OS_LINUX)
+    (void)win_permissions;
+    if (linux_permissions != 0){
+        fs::permissions(new_file_path, static_cast<fs::perms>(linux_permissions));
+        addToLog(log_level::debug, u8"set permissions for " + new_file_path.u8string());
+    } else {
+        addToLog(log_level::warning, u8"no permissions found for linux operating system for file " + new_file_path.u8string());
+        addToLog(log_level::warning, u8"created file with deault permissions mask");
+    }
+#endif
+}
+
+// the entry a hard link is made to: its link_target, or that entry's target if it's a link too,
+// so the target is never from the same round of create_files
+static uint64_t link_source(const KserView& view, size_t i) {
+    uint64_t target = view.entry(i).link_target;
+    while (view.entry(target).link_target != kser_entry::no_link) {
+        target = view.entry(target).link_target;
+    }
+    return target;
+}
+
+// creates file entry i with its data and permissions. clone_source is an earlier entry with the
+// same payload that is already extracted (reflinked where possible) or kser_entry::no_link.
+#if defined(OS_WIN)
+static void extract_file_entry(const KserView& view, size_t i, const fs::path& output_dir_path, uint64_t clone_source,
+                               const kser_options& options) {
+    const kser_entry& fso = view.entry(i);
+    fs::path new_file_path = output_dir_path / view.filename(i);
+    check_not_exists(new_file_path);
+
+    std::wstring widePath = new_file_path.wstring();
+    LPWSTR output_file_path = (LPWSTR)(widePath.c_str());
+
+    // hard links are recreated when the file system allows it, otherwise the data is written again
+    bool linked = false;
+    if (fso.link_target != kser_entry::no_link) {
+        fs::path target_path = output_dir_path / view.filename(link_source(view, i));
+        linked = CreateHardLinkW(output_file_path, target_path.wstring().c_str(), NULL) != 0;
+        if (linked) {
+            addToLog(log_level::debug, u8"linked " + new_file_path.u8string() + u8" to " + target_path.u8string());
+        }
+        else if (!links_unsupported(GetLastError())) {
+            throw_u8string_error(u8"failed to link " + new_file_path.u8string() + u8" to " + target_path.u8string());
+        }
+    }
+
+    if (!linked) {
+        if (!CreateFileWithInheritanceWin(output_file_path)) {
+            throw_u8string_error(u8"failed to create file " + new_file_path.u8string());
+        }
+        addToLog(log_level::debug, u8"created " + new_file_path.u8string());
+
+        std::ofstream output_file(output_file_path, std::ios::binary);
+        if (!output_file) {
+            throw_u8string_error(u8"failed to open " + new_file_path.u8string());
+        }
+
+        // a sparse file's data goes to its extents, the gaps are left to resize_file below
+        std::vector<file_extent> extents = fso.sparse ? view.extents(i) : std::vector<file_extent>{ { 0, fso.file_size } };
+        size_t extent = 0;
+        uint64_t extent_pos = 0;
+        auto write_data = [&](const char* data, size_t size) {
+            while (size > 0) {
+                while (extent_pos == extents[extent].length) {
+                    extent++;
+                    extent_pos = 0;
+                    output_file.seekp(static_cast<std::streamoff>(extents[extent].offset));
+                }
+                size_t chunk = static_cast<size_t>(std::min<uint64_t>(size, extents[extent].length - extent_pos));
+                if (!output_file.write(data, chunk)) {
+                    throw_u8string_error(u8"failed to write data to " + new_file_path.u8string());
+                }
+                data += chunk;
+                size -= chunk;
+                extent_pos += chunk;
+            }
+        };
+        if (!extents.empty()) {
+            output_file.seekp(static_cast<std::streamoff>(extents[0].offset));
+        }
+        if (fso.codec == kser_codec::klz) {
+            klz_unpack_payload(view.payload(i), fso.data_size, write_data);
+        }
+        else {
+            auto payload = view.payload(i);
+            write_data(payload.data(), payload.size());
+        }
+        output_file.close();
+        if (fso.sparse) {
+            fs::resize_file(new_file_path, fso.file_size);
+        }
+        addToLog(log_level::debug, u8"wrote data to " + new_file_path.u8string());
+    }
+
+    phase_timer timer(options.stats, kser_phase::file_permissions);
+    apply_file_permissions(new_file_path, fso.win_permissions, fso.linux_permissions);
+}
+#elif defined(OS_LINUX)
+// the file is made in its directory's fd from dirs: linkat, or openat with O_CREAT | O_EXCL and
+// the final mode, so an existing file is an error rather than overwritten, and its path isn't
+// resolved again for the data or the permissions. mask is from creation_umask
+static void extract_file_entry(const KserView& view, size_t i, const fs::path& output_dir_path, uint64_t clone_source,
+                               dir_fd_cache& dirs, mode_t mask, const kser_options& options) {
+    const kser_entry& fso = view.entry(i);
+    fs::path new_file_path = output_dir_path / view.filename(i);
+    int dir_fd = parent_fd(dirs, fso.filename, new_file_path);
+    std::string base(split_parent(fso.filename).second);
+    mode_t mode = static_cast<mode_t>(fso.linux_permissions) & 07777;
+
+    // hard links are recreated when the file system allows it, otherwise the data is written again
+    bool linked = false;
+    if (fso.link_target != kser_entry::no_link) {
+        uint64_t target = link_source(view, i);
+        std::string_view target_name = view.entry(target).filename;
+        fs::path target_path = output_dir_path / view.filename(target);
+        int target_dir_fd = parent_fd(dirs, target_name, target_path);
+        std::string target_base(split_parent(target_name).second);
+        linked = linkat(target_dir_fd, target_base.c_str(), dir_fd, base.c_str(), 0) == 0;
+        if (linked) {
+            addToLog(log_level::debug, u8"linked " + new_file_path.u8string() + u8" to " + target_path.u8string());
+        }
+        else if (!links_unsupported(errno)) {
+            if (errno == EEXIST) {
+                throw_exists(new_file_path);
+            }
+            throw_u8string_error(u8"failed to link " + new_file_path.u8string() + u8" to " + target_path.u8string() + u8": " + errno_u8string());
+        }
+    }
+
+    unique_fd output_fd;
+    if (!linked) {
+        output_fd.reset(openat(dir_fd, base.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode != 0 ? mode : 0666));
+        if (!output_fd) {
+            if (errno == EEXIST) {
+                throw_exists(new_file_path);
+            }
+            throw_u8string_error(u8"failed to create " +  new_file_path.u8string());
+        }
+        addToLog(log_level::debug, u8"created " + new_file_path.u8string());
+
+        // a payload shared with an earlier file (dedup) is cloned from that file where the
+        // file system supports reflinks
+        bool cloned = false;
+        if (clone_source != kser_entry::no_link) {
+            std::string_view source_name = view.entry(clone_source).filename;
+            int source_dir_fd = dirs.get(split_parent(source_name).first);
+            std::string source_base(split_parent(source_name).second);
+            unique_fd source_fd(source_dir_fd != -1 ? openat(source_dir_fd, source_base.c_str(), O_RDONLY | O_CLOEXEC) : -1);
+            cloned = source_fd && clone_fd(source_fd.get(), output_fd.get());
+        }
+        if (!cloned && fso.sparse) {
+            // only the data extents are written, ftruncate leaves the rest of the file as holes
+            std::vector<file_extent> extents = view.extents(i);
+            if (ftruncate(output_fd.get(), static_cast<off_t>(fso.file_size)) != 0) {
+                throw_u8string_error(u8"failed to resize " + new_file_path.u8string());
+            }
+            if (fso.codec == kser_codec::klz) {
+                size_t extent = 0;
+                uint64_t extent_pos = 0;
+                klz_unpack_payload(view.payload(i), fso.data_size, [&](const char* data, size_t size) {
+                    while (size > 0) {
+                        while (extent_pos == extents[extent].length) {
+                            extent++;
+                            extent_pos = 0;
+                        }
+                        size_t chunk = static_cast<size_t>(std::min<uint64_t>(size, extents[extent].length - extent_pos));
+                        write_fd_range(output_fd.get(), extents[extent].offset + extent_pos, data, chunk);
+                        data += chunk;
+                        size -= chunk;
+                        extent_pos += chunk;
+                    }
+                });
+            }
+            else {
+                uint64_t data_offset = fso.data_offset;
+                for (const file_extent& extent : extents) {
+                    copy_fd_range(view.fd(), data_offset, output_fd.get(), extent.offset, extent.length);
+                    data_offset += extent.length;
+                }
+            }
+        }
+        else if (!cloned) {
+            preallocate_fd(output_fd.get(), fso.file_size);
+            if (fso.codec == kser_codec::klz) {
+                // compressed blocks are decoded from the mapping and written at their offsets
+                uint64_t offset = 0;
+                klz_unpack_payload(view.payload(i), fso.file_size, [&](const char* data, size_t size) {
+                    write_fd_range(output_fd.get(), offset, data, size);
+                    offset += size;
+                });
+            }
+            else {
+                // positioned copy out of the shared archive fd, safe to run on several workers
+                copy_fd_range(view.fd(), fso.data_offset, output_fd.get(), 0, fso.file_size);
+            }
+        }
+        addToLog(log_level::debug, (cloned ? u8"cloned data to " : u8"wrote data to ") + new_file_path.u8string());
+    }
+
+    phase_timer timer(options.stats, kser_phase::file_permissions);
+    if (mode == 0) {
+        addToLog(log_level::warning, u8"no permissions found for linux operating system for file " + new_file_path.u8string());
+        addToLog(log_level::warning, u8"created file with deault permissions mask");
+        return;
+    }
+    // a new file already has its mode unless the umask took bits away. writing clears
+    // setuid/setgid, and a hard link keeps the mode of whatever it was linked to
+    if (linked || (mode & mask) != 0 || (mode & 07000) != 0) {
+        int result = linked ? fchmodat(dir_fd, base.c_str(), mode, 0) : fchmod(output_fd.get(), mode);
+        if (result == -1) {
+            throw_u8string_error(u8"failed to set permissions for " + new_file_path.u8string() + u8": " + errno_u8string());
+        }
+    }
+    addToLog(log_level::debug, u8"set permissions for " + new_file_path.u8string());
+}
+#endif
+
+#if defined(OS_LINUX)
+// files per io_uring batch when extracting
+static constexpr unsigned uring_batch = 256;
+
+// creates the small files entries through the ring, a batch at a time. a file is created with
+// its mode, so chmod is only needed where the umask (mask) or setuid/setgid/sticky bits get in
+// the way. files are opened relative to their directory's fd from dirs. the ring needs those
+// until the batch is done, while dirs may close one once enough other directories were asked
+// for, so the batch keeps its own copy of each. with stats every file of a batch gets the
+// batch's average time.
+static void extract_small_files(const KserView& view, const std::vector<size_t>& entries, const fs::path& output_dir_path,
+                                io_ring& ring, dir_fd_cache& dirs, mode_t mask, const kser_options& options) {
+    uint64_t start = options.stats ? stats_now_ns() : 0;
+    // the directories of the batch, usually one or two: its files are in path order
+    std::vector<std::pair<std::string_view, unique_fd>> batch_dirs;
+    std::vector<batch_write> writes;
+    writes.reserve(entries.size());
+    // decoded klz payloads, reserved up front so the data pointers stay valid
+    std::vector<std::string> decoded;
+    decoded.reserve(entries.size());
+    for (size_t i : entries) {
+        const kser_entry& fso = view.entry(i);
+        batch_write file;
+        file.path = output_dir_path / view.filename(i);
+        auto [parent, base] = split_parent(fso.filename);
+        auto dir = std::find_if(batch_dirs.begin(), batch_dirs.end(), [&](const auto& known) { return known.first == parent; });
+        if (dir == batch_dirs.end()) {
+            for_entry(options, view, i, [&] {
+                unique_fd dir_fd(fcntl(parent_fd(dirs, fso.filename, file.path), F_DUPFD_CLOEXEC, 0));
+                if (!dir_fd) {
+                    throw_u8string_error(u8"failed to open the folder of " + file.path.u8string() + u8": " + errno_u8string());
+                }
+                batch_dirs.emplace_back(parent, std::move(dir_fd));
+            });
+            dir = batch_dirs.end() - 1;
+        }
+        file.dir_fd = dir->second.get();
+        file.name.assign(base);
+        uint32_t perms = static_cast<uint32_t>(fso.linux_permissions) & 07777;
+        file.mode = perms != 0 ? perms : 0666;
+        if (fso.codec == kser_codec::klz) {
+            std::string& data = decoded.emplace_back();
+            data.reserve(static_cast<size_t>(fso.data_size));
+            for_entry(options, view, i, [&] {
+                klz_unpack_payload(view.payload(i), fso.data_size, [&](const char* block, size_t size) {
+                    data.append(block, size);
+                });
+            });
+            file.data = data.data();
+            file.size = data.size();
+        }
+        else {
+            auto payload = view.payload(i);
+            file.data = payload.data();
+            file.size = payload.size();
+        }
+        writes.push_back(std::move(file));
+    }
+    write_new_files(ring, writes);
+
+    phase_timer timer(options.stats, kser_phase::file_permissions);
+    for (size_t k = 0; k < entries.size(); k++) {
+        const batch_write& file = writes[k];
+        addToLog(log_level::debug, u8"created " + file.path.u8string());
+        addToLog(log_level::debug, u8"wrote data to " + file.path.u8string());
+        int32_t perms = view.entry(entries[k]).linux_permissions;
+        if (perms != 0) {
+            if ((perms & mask) != 0 || (perms & 07000) != 0) {
+                for_entry(options, view, entries[k], [&] {
+                    if (fchmodat(file.dir_fd, file.name.c_str(), static_cast<mode_t>(perms) & 07777, 0) == -1) {
+                        throw_u8string_error(u8"failed to set permissions for " + file.path.u8string() + u8": " + errno_u8string());
+                    }
+                });
+            }
+            addToLog(log_level::debug, u8"set permissions for " + file.path.u8string());
+        }
+        else {
+            addToLog(log_level::warning, u8"no permissions found for linux operating system for file " + file.path.u8string());
+            addToLog(log_level::warning, u8"created file with deault permissions mask");
+        }
+    }
+    timer.stop();
+    if (options.stats) {
+        uint64_t each = (stats_now_ns() - start) / entries.size();
+        for (size_t i : entries) {
+            options.stats->add_file(view.entry(i).filename, each, view.entry(i).file_size);
+        }
+    }
+}
+#endif
+
+// extraction runs in phases so it can use all cores and still give the same tree as doing
+// one entry after another:
+//   1. directories, parents before children, on the calling thread
+//   2. files on the pool. payloads shared with an earlier file (dedup) are cloned from that
+//      file, so they go in a second round once it's complete. hard links go in a third: their
+//      target may be such a clone itself
+//   3. linux directory permissions, children before parents, so a read-only directory
+//      doesn't stop anything from being created or changed below it
+// on linux every entry is made relative to an open fd of its directory (dir_fd_cache), the
+// calling thread and each worker keep their own
+// true when entries a and b, which share a payload, extract to the same file: a clone of one is
+// a copy of the other
+static bool same_file_data(const KserView& view, size_t a, size_t b) {
+    const kser_entry& first = view.entry(a);
+    const kser_entry& second = view.entry(b);
+    if (first.file_size != second.file_size || first.stored_size != second.stored_size || first.codec != second.codec
+        || first.sparse != second.sparse) {
+        return false;
+    }
+    if (!first.sparse) {
+        return true;
+    }
+    std::vector<file_extent> first_extents = view.extents(a);
+    std::vector<file_extent> second_extents = view.extents(b);
+    return std::equal(first_extents.begin(), first_extents.end(), second_extents.begin(), second_extents.end(),
+        [](const file_extent& x, const file_extent& y) { return x.offset == y.offset && x.length == y.length; });
+}
+
+void create_files(const KserView& view, fs::path output_dir_path, const kser_options& options) {
+    if (view.metadata_only()) {
+        throw_u8string_error(view.path().u8string() + u8" is a metadata-only archive without file data, its permissions can only be applied onto an existing tree");
+    }
+#if defined(OS_LINUX)
+    // payloads are moved by the kernel straight from the archive fd, memory use doesn't depend on file sizes
+    posix_fadvise(view.fd(), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    unique_fd root_fd(open(output_dir_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (!root_fd) {
+        throw_u8string_error(u8"failed to open " + output_dir_path.u8string() + u8": " + errno_u8string());
+    }
+    dir_fd_cache dirs(root_fd.get());
+    mode_t mask = creation_umask(root_fd.get());
+#endif
+
+    std::vector<size_t> directories;
+    std::vector<size_t> files;
+    std::vector<size_t> cloned_files;
+    std::vector<size_t> hard_links;
+    std::vector<uint64_t> clone_source(view.size(), kser_entry::no_link);
+    // data offset -> first entry with that payload. empty payloads share their offset with the
+    // next one (see kser_format.h) and are left out
+    std::unordered_map<uint64_t, size_t> first_with_payload;
+    uint64_t total_bytes = 0;
+    for (size_t i = 0; i < view.size(); i++) {
+        const kser_entry& fso = view.entry(i);
+        total_bytes += fso.file_size;
+        if (fso.isDir) {
+            directories.push_back(i);
+            continue;
+        }
+        if (fso.stored_size > 0) {
+            auto [first, inserted] = first_with_payload.emplace(fso.data_offset, i);
+            if (!inserted && same_file_data(view, first->second, i)) {
+                clone_source[i] = first->second;
+            }
+        }
+        if (fso.link_target != kser_entry::no_link) {
+            hard_links.push_back(i);
+        }
+        else if (clone_source[i] != kser_entry::no_link) {
+            cloned_files.push_back(i);
+        }
+        else {
+            files.push_back(i);
+        }
+    }
+
+    // archives are sorted by path, which already puts parents first. sorting by depth keeps
+    // that true for archives written in some other order.
+    auto depth = [&](size_t i) {
+        std::string_view name = view.entry(i).filename;
+        return std::count(name.begin(), name.end(), '/');
+    };
+    std::stable_sort(directories.begin(), directories.end(), [&](size_t a, size_t b) {
+        return depth(a) < depth(b);
+    });
+    if (options.progress) {
+        options.progress->entries_total = view.size();
+        options.progress->bytes_total = total_bytes;
+    }
+    phase_timer directories_timer(options.stats, kser_phase::directories);
+    for (size_t i : directories) {
+        check_cancelled(options);
+#if defined(OS_LINUX)
+        for_entry(options, view, i, [&] { create_directory_entry(view, i, output_dir_path, dirs); });
+#else
+        for_entry(options, view, i, [&] { create_directory_entry(view, i, output_dir_path); });
+#endif
+        report_progress(options, 1, 0);
+    }
+    directories_timer.stop();
+
+    phase_timer files_timer(options.stats, kser_phase::files);
+    work_stealing_pool pool(options.threads);
+#if defined(OS_LINUX)
+    // small independent files go through io_uring in batches, one ring per worker
+    uint64_t file_bytes = 0;
+    for (size_t i : files) {
+        file_bytes += view.entry(i).file_size;
+    }
+    std::vector<size_t> ring_files;
+    std::vector<std::unique_ptr<io_ring>> rings(pool.size());
+    std::vector<std::unique_ptr<dir_fd_cache>> worker_dirs(pool.size());
+    auto worker_cache = [&]() -> dir_fd_cache& {
+        std::unique_ptr<dir_fd_cache>& cache = worker_dirs[pool.worker_index()];
+        if (!cache) {
+            cache = std::make_unique<dir_fd_cache>(root_fd.get());
+        }
+        return *cache;
+    };
+    if (use_io_uring(options, files.size() + cloned_files.size() + hard_links.size(), file_bytes)) {
+        std::vector<size_t> other_files;
+        for (size_t i : files) {
+            const kser_entry& fso = view.entry(i);
+            bool small = !fso.sparse && fso.data_size <= uring_small_file;
+            (small ? ring_files : other_files).push_back(i);
+        }
+        files.swap(other_files);
+
+        for (size_t begin = 0; begin < ring_files.size(); begin += uring_batch) {
+            pool.submit([&, begin] {
+                size_t end = std::min<size_t>(begin + uring_batch, ring_files.size());
+                std::unique_ptr<io_ring>& ring = rings[pool.worker_index()];
+                if (!ring) {
+                    ring = std::make_unique<io_ring>(uring_batch);
+                }
+                std::vector<size_t> batch(ring_files.begin() + begin, ring_files.begin() + end);
+                check_cancelled(options);
+                extract_small_files(view, batch, output_dir_path, *ring, worker_cache(), mask, options);
+                uint64_t bytes = 0;
+                for (size_t i : batch) {
+                    bytes += view.entry(i).file_size;
+                }
+                report_progress(options, batch.size(), bytes);
+            });
+        }
+    }
+#endif
+    for (const auto* round : { &files, &cloned_files, &hard_links }) {
+        for (size_t i : *round) {
+            pool.submit([&, i] {
+                check_cancelled(options);
+                const kser_entry& fso = view.entry(i);
+                time_file(options.stats, fso.filename, fso.file_size, [&] {
+                    for_entry(options, view, i, [&] {
+#if defined(OS_LINUX)
+                        extract_file_entry(view, i, output_dir_path, clone_source[i], worker_cache(), mask, options);
+#else
+                        extract_file_entry(view, i, output_dir_path, clone_source[i], options);
+#endif
+                    });
+                });
+                report_progress(options, 1, fso.file_size);
+            });
+        }
+        pool.wait();
+    }
+    files_timer.stop();
+
+    phase_timer permissions_timer(options.stats, kser_phase::permissions);
+    for (auto it = directories.rbegin(); it != directories.rend(); ++it) {
+        size_t i = *it;
+#if defined(OS_LINUX)
+        for_entry(options, view, i, [&] { set_directory_permissions(view, i, output_dir_path, dirs, mask); });
+#else
+        for_entry(options, view, i, [&] { set_directory_permissions(view, i, output_dir_path); });
+#endif
+    }
+}
+
+template <typename Entries>
+static run_summary summarize(const Entries& entries) {
+    run_summary summary;
+    for (const auto& fso : entries) {
+        if (fso.isDir) {
+            summary.dirs++;
+        }
+        else {
+            summary.files++;
+            summary.bytes += fso.file_size;
+        }
+    }
+    return summary;
+}
+
+static run_summary summarize(const entry_table& table) {
+    run_summary summary;
+    for (size_t i = 0; i < table.size(); i++) {
+        if (table.is_dir[i]) {
+            summary.dirs++;
+        }
+        else {
+            summary.files++;
+            summary.bytes += table.file_size[i];
+        }
+    }
+    return summary;
+}
+
+// the input and everything below it, sorted by path
+static entry_table scan_input(const fs::path& input_path, const kser_options& options, uint64_t& scan_syscalls) {
+    entry_table table(input_path.parent_path());
+
+    //first object (start dir or only file)
+    std::u8string first_name = input_path.filename().generic_u8string();
+    size_t first = table.add(std::string_view(reinterpret_cast<const char*>(first_name.data()), first_name.size()));
+    read_fso_isDir_size_permissions(table, first);
+
+
+
+    scan_syscalls = 0;
+    if (table.is_dir[first]) {
+        phase_timer timer(options.stats, kser_phase::scan);
+        scan_syscalls = process_directory(input_path, table, options);
+    }
+    if (options.stats) {
+        options.stats->add(kser_counter::scan_syscalls, scan_syscalls);
+    }
+
+    phase_timer timer(options.stats, kser_phase::sort);
+    table.sort_by_name(options.threads);
+    return table;
+}
+
+// sets the totals of options.progress once they are known
+static void start_progress(const kser_options& options, const run_summary& summary) {
+    if (options.progress) {
+        options.progress->entries_total = summary.files + summary.dirs;
+        options.progress->bytes_total = summary.bytes;
+    }
+}
+
+// a failed serialize counts as one error in options.stats
+template <typename Run>
+static run_summary counting_errors(const kser_options& options, Run run) {
+    try {
+        return run();
+    }
+    catch (const kser_cancelled&) {
+        throw;
+    }
+    catch (...) {
+        if (options.stats) {
+            options.stats->add(kser_counter::errors, 1);
+        }
+        throw;
+    }
+}
+
+static run_summary serialize_file(const fs::path& input_path, const fs::path& output_path, const kser_options& options) {
+    entry_table old_files;
+    std::unique_ptr<KserView> previous;
+    phase_timer old_archive_timer(options.stats, kser_phase::old_archive);
+    if (is_kser_stream(output_path)) {
+        // a streaming archive has no index to keep payloads from, only its permissions are used
+        std::ifstream in(output_path, std::ios::binary);
+        read_stream_entries(in, output_path.u8string(), old_files);
+    }
+    else if (fs::file_size(output_path) != 0) {
+        previous = std::make_unique<KserView>(output_path);
+        read_archive_entries(*previous, old_files);
+        // only incremental serialize needs the old payloads, and a metadata-only archive has none
+        if (!options.incremental || options.metadata_only || previous->metadata_only()) {
+            previous.reset();
+        }
+    }
+
+    old_archive_timer.stop();
+
+    uint64_t scan_syscalls = 0;
+    entry_table table = scan_input(input_path, options, scan_syscalls);
+    {
+        phase_timer timer(options.stats, kser_phase::old_archive);
+        fill_other_system_permissions(table, old_files);
+        old_files.clear();
+    }
+
+    run_summary summary = summarize(table);
+    start_progress(options, summary);
+
+    addToLog(u8"serializing...");
+    uint64_t reused_files = write_fso_map_to_file(output_path, table, options, previous.get());
+    previous.reset();
+    summary.reused_files = reused_files;
+    summary.scan_syscalls = scan_syscalls;
+    summary.archive_bytes = fs::file_size(output_path);
+    if (options.stats) {
+        options.stats->add(kser_counter::archive_bytes, summary.archive_bytes);
+    }
+    return summary;
+}
+
+run_summary serialize(fs::path input_path, fs::path output_path, const kser_options& options) {
+    return counting_errors(options, [&] { return serialize_file(input_path, output_path, options); });
+}
+
+run_summary deserialize(fs::path input_file_name, fs::path output_file_path, const kser_options& options) {
+    if (is_kser_stream(input_file_name)) {
+        std::ifstream in(input_file_name, std::ios::binary);
+        return deserialize_stream(in, input_file_name.u8string(), output_file_path, options);
+    }
+    phase_timer parse_timer(options.stats, kser_phase::parse);
+    KserView view(input_file_name);
+    parse_timer.stop();
+    addToLog(u8"extracted permissions...");
+    create_files(view, output_file_path, options);
+    run_summary summary = summarize(view.entries());
+    summary.archive_bytes = view.file_size();
+    if (options.stats) {
+        options.stats->add(kser_counter::archive_bytes, summary.archive_bytes);
+    }
+    return summary;
+}
+
+// a damaged index already fails while the view is opened, before any entry is allocated.
+// payloads are hashed straight from the mapping, one task per payload; entries sharing a
+// payload (dedup) are checked once.
+run_summary verify(fs::path input_file_name, const kser_options& options) {
+    if (is_kser_stream(input_file_name)) {
+        std::ifstream in(input_file_name, std::ios::binary);
+        return verify_stream(in, input_file_name.u8string(), options);
+    }
+    phase_timer parse_timer(options.stats, kser_phase::parse);
+    KserView view(input_file_name);
+    parse_timer.stop();
+    run_summary summary = summarize(view.entries());
+    summary.archive_bytes = view.file_size();
+    if (options.stats) {
+        options.stats->add(kser_counter::archive_bytes, summary.archive_bytes);
+    }
+
+    if (view.metadata_only()) {
+        // the index was checked while opening, there is nothing else
+        summary.unchecked_files = summary.files;
+        report_progress(options, view.size(), summary.bytes);
+        addToLog(u8"verified the index of metadata-only archive " + view.path().u8string());
+        return summary;
+    }
+
+    phase_timer verify_timer(options.stats, kser_phase::verify);
+    std::unordered_set<uint64_t> checked_offsets;
+    work_stealing_pool pool(options.threads);
+    for (size_t i = 0; i < view.size(); i++) {
+        const kser_entry& entry = view.entry(i);
+        if (entry.isDir) {
+            report_progress(options, 1, 0);
+            continue;
+        }
+        if (!entry.has_checksum) {
+            summary.unchecked_files++;
+            report_progress(options, 1, entry.file_size);
+            continue;
+        }
+        // a shared payload is hashed once. empty payloads share their offset with the next
+        // payload (see kser_format.h), they are always checked
+        if (entry.stored_size > 0 && !checked_offsets.insert(entry.data_offset).second) {
+            report_progress(options, 1, entry.file_size);
+            continue;
+        }
+        pool.submit([&view, &options, i] {
+            const kser_entry& fso = view.entry(i);
+            check_cancelled(options);
+            time_file(options.stats, fso.filename, fso.file_size, [&] {
+                auto payload = view.payload(i);
+                if (xxh64(payload.data(), payload.size()) != fso.checksum) {
+                    if (options.stats) {
+                        options.stats->add(kser_counter::errors, 1);
+                    }
+                    throw_u8string_error(u8"checksum mismatch: data of " + view.filename(i).u8string() + u8" is damaged in "
+                        + view.path().u8string());
+                }
+            });
+            report_progress(options, 1, fso.file_size);
+        });
+    }
+    pool.wait();
+    addToLog(u8"verified " + view.path().u8string());
+    return summary;
+}
+
+// what applying the permissions of one entry did
+enum class apply_result { changed, unchanged, missing };
+
+#if defined(OS_LINUX)
+// sets the mode of name in dir_fd unless it already has it. dir_path is dir_fd's path, only
+// built into messages
+static apply_result apply_mode_at(int dir_fd, const char* name, bool is_dir, int32_t linux_permissions,
+                                  const fs::path& dir_path) {
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, 0) == -1) {
+        if (errno != ENOENT && errno != ENOTDIR) {
+            throw_u8string_error(u8"failed to read the mode of " + (dir_path / name).u8string() + u8": " + errno_u8string());
+        }
+        addToLog(log_level::warning, (dir_path / name).u8string() + u8" doesn't exist, skipped");
+        return apply_result::missing;
+    }
+    if (S_ISDIR(st.st_mode) != is_dir) {
+        addToLog(log_level::warning, (dir_path / name).u8string() + (is_dir ? u8" is not a folder, skipped" : u8" is a folder, skipped"));
+        return apply_result::missing;
+    }
+    if (linux_permissions == 0) {
+        addToLog(log_level::warning, u8"no permissions found for linux operating system for file " + (dir_path / name).u8string());
+        return apply_result::unchanged;
+    }
+    mode_t mode = static_cast<mode_t>(linux_permissions) & 07777;
+    if ((st.st_mode & 07777) == mode) {
+        return apply_result::unchanged;
+    }
+    if (fchmodat(dir_fd, name, mode, 0) == -1) {
+        throw_u8string_error(u8"failed to set permissions for " + (dir_path / name).u8string() + u8": " + errno_u8string());
+    }
+    addToLog(log_level::debug, u8"set permissions for " + (dir_path / name).u8string());
+    return apply_result::changed;
+}
+#elif defined(OS_WIN)
+// sets the current user's permissions of path unless it already has them
+static apply_result apply_mode_at(const fs::path& path, bool is_dir, int32_t win_permissions) {
+    std::error_code ec;
+    fs::file_status status = fs::status(path, ec);
+    if (!fs::exists(status)) {
+        addToLog(log_level::warning, path.u8string() + u8" doesn't exist, skipped");
+        return apply_result::missing;
+    }
+    if (fs::is_directory(status) != is_dir) {
+        addToLog(log_level::warning, path.u8string() + (is_dir ? u8" is not a folder, skipped" : u8" is a folder, skipped"));
+        return apply_result::missing;
+    }
+    if (win_permissions == 0) {
+        addToLog(log_level::warning, u8"no permissions found for windows operating system for file" + path.u8string());
+        return apply_result::unchanged;
+    }
+    std::wstring widePath = path.wstring();
+    if (GetCurrentUserFilePermissionsWin(widePath.c_str()) == static_cast<DWORD>(win_permissions)) {
+        return apply_result::unchanged;
+    }
+    if (!SetCurrentUserPermissionsWin((LPWSTR)(widePath.c_str()), win_permissions)) {
+        throw_u8string_error(u8"failed to set permissions for " + path.u8string());
+    }
+    addToLog(log_level::debug, u8"set permissions for " + path.u8string());
+    return apply_result::changed;
+}
+#endif
+
+// the entries of one directory of the tree
+struct apply_group {
+    // relative to the output folder, empty for the output folder itself
+    std::string_view path;
+    size_t depth = 0;
+    std::vector<size_t> entries;
+};
+
+// the entries are grouped by the directory they are in, and the groups handled deepest first,
+// one depth after another with the groups of a depth on the pool. each group opens its
+// directory once and changes its entries relative to that fd (fstatat, fchmodat), so paths
+// aren't walked per entry. a directory's own mode is set by its parent's group, after everything
+// below it is done, so a read-only directory doesn't get in the way
+static void apply_table_permissions(const entry_table& table, const fs::path& output_dir_path, const kser_options& options,
+                                    run_summary& summary) {
+    std::vector<apply_group> groups;
+    {
+        std::unordered_map<std::string_view, size_t> group_of;
+        for (size_t i = 0; i < table.size(); i++) {
+            std::string_view parent = split_parent(table.name(i)).first;
+            auto [it, inserted] = group_of.emplace(parent, groups.size());
+            if (inserted) {
+                apply_group group;
+                group.path = parent;
+                group.depth = parent.empty() ? 0 : std::count(parent.begin(), parent.end(), '/') + 1;
+                groups.push_back(std::move(group));
+            }
+            groups[it->second].entries.push_back(i);
+            if (table.is_dir[i]) {
+                summary.dirs++;
+            }
+            else {
+                summary.files++;
+            }
+        }
+    }
+    std::stable_sort(groups.begin(), groups.end(), [](const apply_group& a, const apply_group& b) {
+        return a.depth > b.depth;
+    });
+    if (options.progress) {
+        options.progress->entries_total = table.size();
+        options.progress->bytes_total = 0;
+    }
+
+#if defined(OS_LINUX)
+    // O_PATH is all fstatat and fchmodat need, it only takes search permission: a directory
+    // without read permission is one of the things apply has to repair
+    unique_fd root_fd(open(output_dir_path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+    if (!root_fd) {
+        throw_u8string_error(u8"failed to open " + output_dir_path.u8string() + u8": " + errno_u8string());
+    }
+#endif
+    std::atomic<uint64_t> unchanged{0};
+    std::atomic<uint64_t> missing{0};
+    auto count = [&](apply_result result) {
+        if (result == apply_result::unchanged) {
+            unchanged.fetch_add(1, std::memory_order_relaxed);
+        }
+        else if (result == apply_result::missing) {
+            missing.fetch_add(1, std::memory_order_relaxed);
+        }
+    };
+
+    work_stealing_pool pool(options.threads);
+    for (size_t begin = 0; begin < groups.size();) {
+        size_t end = begin;
+        while (end < groups.size() && groups[end].depth == groups[begin].depth) {
+            const apply_group& group = groups[end++];
+            pool.submit([&] {
+                check_cancelled(options);
+#if defined(OS_LINUX)
+                std::string path(group.path);
+                fs::path dir_path = path.empty() ? output_dir_path : output_dir_path / path;
+                unique_fd dir_fd;
+                if (!path.empty()) {
+                    dir_fd.reset(openat(root_fd.get(), path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+                    if (!dir_fd) {
+                        if (errno != ENOENT && errno != ENOTDIR) {
+                            for_entry(options, group.path, [&] {
+                                throw_u8string_error(u8"failed to open " + dir_path.u8string() + u8": " + errno_u8string());
+                            });
+                        }
+                        // the directory itself is reported missing by its parent's group
+                        missing.fetch_add(group.entries.size(), std::memory_order_relaxed);
+                        report_progress(options, group.entries.size(), 0);
+                        return;
+                    }
+                }
+                int fd = path.empty() ? root_fd.get() : dir_fd.get();
+                std::string name;
+                for (size_t i : group.entries) {
+                    std::string_view full_name = table.name(i);
+                    name.assign(split_parent(full_name).second);
+                    for_entry(options, full_name, [&] {
+                        count(apply_mode_at(fd, name.c_str(), table.is_dir[i], table.linux_permissions[i], dir_path));
+                    });
+                }
+#elif defined(OS_WIN)
+                for (size_t i : group.entries) {
+                    for_entry(options, table.name(i), [&] {
+                        count(apply_mode_at(output_dir_path / table.filename(i), table.is_dir[i], table.win_permissions[i]));
+                    });
+                }
+#endif
+                report_progress(options, group.entries.size(), 0);
+            });
+        }
+        pool.wait();
+        begin = end;
+    }
+    summary.unchanged_entries = unchanged;
+    summary.missing_entries = missing;
+    addToLog(u8"applied permissions to " + output_dir_path.u8string());
+}
+
+run_summary apply_permissions(fs::path input_file_name, fs::path output_dir_path, const kser_options& options) {
+    if (is_kser_stream(input_file_name)) {
+        std::ifstream in(input_file_name, std::ios::binary);
+        return apply_permissions_stream(in, input_file_name.u8string(), output_dir_path, options);
+    }
+    entry_table table;
+    run_summary summary;
+    {
+        phase_timer parse_timer(options.stats, kser_phase::parse);
+        KserView view(input_file_name);
+        read_archive_entries(view, table);
+        summary.archive_bytes = view.file_size();
+    }
+    if (options.stats) {
+        options.stats->add(kser_counter::archive_bytes, summary.archive_bytes);
+    }
+    phase_timer permissions_timer(options.stats, kser_phase::permissions);
+    apply_table_permissions(table, output_dir_path, options, summary);
+    return summary;
+}
+
+// the data of a file in a streaming archive is written as it arrives, or copied from the
+// earlier file it shares its contents with. file_paths has the path of every entry so far
+static void extract_stream_file(kser_stream_reader& reader, const fs::path& new_file_path, const std::vector<fs::path>& file_paths) {
+    const kser_entry& fso = reader.entry();
+    uint64_t source = fso.link_target != kser_entry::no_link ? fso.link_target : reader.same_as();
+    std::vector<file_extent> extents = fso.sparse ? reader.extents() : std::vector<file_extent>{ { 0, fso.file_size } };
+
+#if defined(OS_WIN)
+    check_not_exists(new_file_path);
+    std::wstring widePath = new_file_path.wstring();
+    LPWSTR output_file_path = (LPWSTR)(widePath.c_str());
+    bool linked = false;
+    if (fso.link_target != kser_entry::no_link) {
+        linked = CreateHardLinkW(output_file_path, file_paths[source].wstring().c_str(), NULL) != 0;
+        if (linked) {
+            addToLog(log_level::debug, u8"linked " + new_file_path.u8string() + u8" to " + file_paths[source].u8string());
+        }
+        else if (!links_unsupported(GetLastError())) {
+            throw_u8string_error(u8"failed to link " + new_file_path.u8string() + u8" to " + file_paths[source].u8string());
+        }
+    }
+    if (!linked) {
+        if (!CreateFileWithInheritanceWin(output_file_path)) {
+            throw_u8string_error(u8"failed to create file " + new_file_path.u8string());
+        }
+        addToLog(log_level::debug, u8"created " + new_file_path.u8string());
+        std::ofstream output_file(output_file_path, std::ios::binary);
+        if (!output_file) {
+            throw_u8string_error(u8"failed to open " + new_file_path.u8string());
+        }
+        if (source != kser_entry::no_link) {
+            std::ifstream source_file(file_paths[source], std::ios::binary);
+            if (fso.file_size > 0 && !(output_file << source_file.rdbuf())) {
+                throw_u8string_error(u8"failed to copy data to " + new_file_path.u8string());
+            }
+        }
+        else {
+            size_t extent = 0;
+            uint64_t extent_pos = 0;
+            if (!extents.empty()) {
+                output_file.seekp(static_cast<std::streamoff>(extents[0].offset));
+            }
+            reader.read_payload([&](const char* data, size_t size) {
+                while (size > 0) {
+                    while (extent_pos == extents[extent].length) {
+                        extent++;
+                        extent_pos = 0;
+                        output_file.seekp(static_cast<std::streamoff>(extents[extent].offset));
+                    }
+                    size_t chunk = static_cast<size_t>(std::min<uint64_t>(size, extents[extent].length - extent_pos));
+                    if (!output_file.write(data, chunk)) {
+                        throw_u8string_error(u8"failed to write data to " + new_file_path.u8string());
+                    }
+                    data += chunk;
+                    size -= chunk;
+                    extent_pos += chunk;
+                }
+            });
+        }
+        output_file.close();
+        if (fso.sparse) {
+            fs::resize_file(new_file_path, fso.file_size);
+        }
+        addToLog(log_level::debug, u8"wrote data to " + new_file_path.u8string());
+    }
+#elif defined(OS_LINUX)
+    bool linked = false;
+    if (fso.link_target != kser_entry::no_link) {
+        linked = link(file_paths[source].c_str(), new_file_path.c_str()) == 0;
+        if (linked) {
+            addToLog(log_level::debug, u8"linked " + new_file_path.u8string() + u8" to " + file_paths[source].u8string());
+        }
+        else if (!links_unsupported(errno)) {
+            if (errno == EEXIST) {
+                throw_exists(new_file_path);
+            }
+            throw_u8string_error(u8"failed to link " + new_file_path.u8string() + u8" to " + file_paths[source].u8string() + u8": " + errno_u8string());
+        }
+    }
+    if (!linked) {
+        unique_fd output_fd(open(new_file_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666));
+        if (!output_fd) {
+            if (errno == EEXIST) {
+                throw_exists(new_file_path);
+            }
+            throw_u8string_error(u8"failed to create " +  new_file_path.u8string());
+        }
+        addToLog(log_level::debug, u8"created " + new_file_path.u8string());
+        if (fso.sparse) {
+            // only the data extents are written, ftruncate leaves the rest of the file as holes
+            if (ftruncate(output_fd.get(), static_cast<off_t>(fso.file_size)) != 0) {
+                throw_u8string_error(u8"failed to resize " + new_file_path.u8string());
+            }
+        }
+        else {
+            preallocate_fd(output_fd.get(), fso.file_size);
+        }
+
+        bool cloned = false;
+        if (source != kser_entry::no_link) {
+            // the data is already on disk in the earlier file
+            unique_fd source_fd(open(file_paths[source].c_str(), O_RDONLY | O_CLOEXEC));
+            if (!source_fd) {
+                throw_u8string_error(u8"failed to open " + file_paths[source].u8string());
+            }
+            cloned = clone_fd(source_fd.get(), output_fd.get());
+            if (!cloned) {
+                for (const file_extent& extent : extents) {
+                    copy_fd_range(source_fd.get(), extent.offset, output_fd.get(), extent.offset, extent.length);
+                }
+            }
+        }
+        else {
+            size_t extent = 0;
+            uint64_t extent_pos = 0;
+            reader.read_payload([&](const char* data, size_t size) {
+                while (size > 0) {
+                    while (extent_pos == extents[extent].length) {
+                        extent++;
+                        extent_pos = 0;
+                    }
+                    size_t chunk = static_cast<size_t>(std::min<uint64_t>(size, extents[extent].length - extent_pos));
+                    write_fd_range(output_fd.get(), extents[extent].offset + extent_pos, data, chunk);
+                    data += chunk;
+                    size -= chunk;
+                    extent_pos += chunk;
+                }
+            });
+        }
+        output_fd.reset();
+        addToLog(log_level::debug, (cloned ? u8"cloned data to " : u8"wrote data to ") + new_file_path.u8string());
+    }
+#endif
+    apply_file_permissions(new_file_path, fso.win_permissions, fso.linux_permissions);
+}
+
+// entries are extracted in the order they arrive: archives are sorted by path, so a directory
+// comes before everything in it. directory modes are set at the end, deepest first.
+run_summary deserialize_stream(std::istream& in, const std::u8string& name, fs::path output_dir_path, const kser_options& options) {
+    kser_stream_reader reader(in, name);
+    addToLog(u8"extracting " + name + u8"...");
+    run_summary summary;
+    std::vector<fs::path> file_paths;
+    std::vector<std::pair<fs::path, int32_t>> directories;
+    phase_timer files_timer(options.stats, kser_phase::files);
+    while (reader.next()) {
+        check_cancelled(options);
+        const kser_entry& fso = reader.entry();
+        fs::path new_file_path = output_dir_path / reader.filename();
+        for_entry(options, fso.filename, [&] {
+            if (fso.isDir) {
+                create_directory_at(new_file_path, fso.win_permissions);
+                directories.emplace_back(new_file_path, fso.linux_permissions);
+                summary.dirs++;
+            }
+            else {
+                time_file(options.stats, fso.filename, fso.file_size, [&] {
+                    extract_stream_file(reader, new_file_path, file_paths);
+                });
+                summary.files++;
+                summary.bytes += fso.file_size;
+            }
+        });
+        file_paths.push_back(std::move(new_file_path));
+        report_progress(options, 1, fso.file_size);
+    }
+    files_timer.stop();
+    phase_timer permissions_timer(options.stats, kser_phase::permissions);
+    for (auto it = directories.rbegin(); it != directories.rend(); ++it) {
+        set_directory_mode(it->first, it->second);
+    }
+    permissions_timer.stop();
+    summary.archive_bytes = reader.offset();
+    if (options.stats) {
+        options.stats->add(kser_counter::archive_bytes, summary.archive_bytes);
+    }
+    return summary;
+}
+
+run_summary verify_stream(std::istream& in, const std::u8string& name, const kser_options& options) {
+    kser_stream_reader reader(in, name);
+    run_summary summary;
+    phase_timer verify_timer(options.stats, kser_phase::verify);
+    while (reader.next()) {
+        check_cancelled(options);
+        const kser_entry& fso = reader.entry();
+        if (fso.isDir) {
+            summary.dirs++;
+            continue;
+        }
+        summary.files++;
+        summary.bytes += fso.file_size;
+        if (reader.has_payload() && !fso.has_checksum) {
+            summary.unchecked_files++;
+        }
+        time_file(options.stats, fso.filename, fso.file_size, [&] { reader.read_payload(nullptr); });
+        report_progress(options, 1, fso.file_size);
+    }
+    verify_timer.stop();
+    addToLog(u8"verified " + name);
+    summary.archive_bytes = reader.offset();
+    if (options.stats) {
+        options.stats->add(kser_counter::archive_bytes, summary.archive_bytes);
+    }
+    return summary;
+}
+
+run_summary apply_permissions_stream(std::istream& in, const std::u8string& name, fs::path output_dir_path,
+                                     const kser_options& options) {
+    entry_table table;
+    run_summary summary;
+    {
+        phase_timer parse_timer(options.stats, kser_phase::parse);
+        summary.archive_bytes = read_stream_entries(in, name, table);
+    }
+    if (options.stats) {
+        options.stats->add(kser_counter::archive_bytes, summary.archive_bytes);
+    }
+    phase_timer permissions_timer(options.stats, kser_phase::permissions);
+    apply_table_permissions(table, output_dir_path, options, summary);
+    return summary;
+}
+
+run_summary serialize_stream(fs::path input_path, std::ostream& out, const kser_options& options) {
+    return counting_errors(options, [&] {
+        if (options.metadata_only) {
+            throw_u8string_error(u8"metadata-only archives have an index and can't be streamed");
+        }
+        uint64_t scan_syscalls = 0;
+        entry_table table = scan_input(input_path, options, scan_syscalls);
+        run_summary summary = summarize(table);
+        start_progress(options, summary);
+        addToLog(u8"serializing...");
+        write_stream(out, table, options);
+        summary.scan_syscalls = scan_syscalls;
+        return summary;
+    });
+}
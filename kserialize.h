@@ -4,341 +4,140 @@
 
 
 
-#include <iostream>
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
 #include <vector>
+#include <string>
 #include <filesystem>
-#include <fstream>
-#include <algorithm>
-#include <unordered_map>
-#include <algorithm>
+#include <functional>
+#include <iosfwd>
 
-#include <fcntl.h>
+#include "kser_codec.h"
+#include "kser_log.h"
+#include "kser_table.h"
 
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
-#include "permwin.h"
 #define OS_WIN
 #elif defined(__linux__) || defined(__gnu_linux__) || defined(linux) || defined(__linux)
 #define OS_LINUX
-mode_t read_umask(){
-    mode_t mask = umask (0);
-    umask(mask);
-    return mask;
-}
 #endif
 
 namespace fs = std::filesystem;
 
-struct filesystem_object {
-    uint8_t isDir;
-    fs::path filename;
-    int32_t win_permissions;
-    int32_t linux_permissions;
-    uint64_t file_size;
-    fs::path full_path;
+// totals of a serialize/deserialize run, used for the summary line of the cli
+struct run_summary {
+    uint64_t files = 0;
+    uint64_t dirs = 0;
+    uint64_t bytes = 0;
+    // syscalls made by the directory scan of serialize
+    uint64_t scan_syscalls = 0;
+    // size of the .kser file written or read
+    uint64_t archive_bytes = 0;
+    // files whose payload was kept from the previous archive (incremental serialize)
+    uint64_t reused_files = 0;
+    // files verify couldn't check because the archive has no checksum for them
+    uint64_t unchecked_files = 0;
+    // apply_permissions: entries whose mode already matched, and entries not found in the tree
+    uint64_t unchanged_entries = 0;
+    uint64_t missing_entries = 0;
 };
 
+// how the many small files of a tree are opened, read and written
+enum class kser_io_backend {
+    // io_uring on linux when the files are small on average, otherwise synchronous
+    automatic,
+    // one open/read/write/close syscall after another
+    sync,
+    // batches of small files through io_uring, synchronous where the kernel lacks it
+    io_uring
+};
 
-void addToLog(std::u8string message);
-void throw_u8string_error(std::u8string s);
-
-
-void read_fso_isDir_size_permissions(filesystem_object& fso);
-void process_directory(const fs::path& directory_path, 
-                       std::unordered_map<fs::path, filesystem_object>& old_files,
-                       std::vector<filesystem_object>& new_files);
-void extract_old_fso_info(const fs::path& output_file_name, std::vector<filesystem_object>& old_files);
-void write_fso_map_to_file(const fs::path& output_file_name, const std::vector<filesystem_object>& fso_v);
-void create_files(const std::vector<filesystem_object>& fso_v, fs::path serialized_file_path, fs::path output_dir_path);
-
-void serialzie(fs::path input_path, fs::path output_path);
-void deserialize(fs::path input_file_name, fs::path output_file_path);
-
-
-void fill_other_system_permissions(filesystem_object& fso, std::unordered_map<fs::path, filesystem_object>& fso_map) {
-    if (fso_map.find(fso.filename) != fso_map.end()) {
-        fso.win_permissions = fso_map[fso.filename].win_permissions;
-        fso.linux_permissions = fso_map[fso.filename].linux_permissions;
-    }
-    else {
-        fso.win_permissions = 0;
-        fso.linux_permissions = 0;
-    }
-}
-
-void read_fso_isDir_size_permissions(filesystem_object& fso) {
-    fso.isDir = fs::is_directory(fso.full_path) ? 1 : 0;
-    if (fso.isDir) {
-        fso.file_size = 0;
-    }
-    else {
-        fso.file_size = fs::file_size(fso.full_path);
-    }
-
-    //reading permissions
-#if defined (OS_WIN)
-    std::wstring widePath = fso.full_path.wstring();
-    LPCWSTR filePath = widePath.c_str();
-    int32_t permissions = GetCurrentUserFilePermissionsWin(filePath);
-
-    if (permissions != 0) {
-        fso.win_permissions = permissions;
-        addToLog(u8"read permissions for " + fso.full_path.u8string());
-    }
-    else {
-        throw_u8string_error(u8"failed to get current user's permissions or no explicit permissions found for " + fso.full_path.u8string());
-    }
-#elif defined (OS_LINUX)
-    fs::file_status status = fs::status(fso.full_path);
-    fs::perms permissions = status.permissions();
-    fso.linux_permissions = static_cast<uint32_t>(permissions);
-    addToLog(u8"read permissions for " + fso.full_path.u8string());
-#endif
-
-}
-
-void process_directory(const fs::path& directory_path, std::unordered_map<fs::path, filesystem_object>& old_files, std::vector<filesystem_object>& new_files) {
-    for (const auto& entry : fs::recursive_directory_iterator(directory_path)) {
-        filesystem_object fso;
-        fso.full_path = entry.path();
-        fso.filename = fs::relative(entry.path(), directory_path.parent_path());
-        fill_other_system_permissions(fso, old_files);
-        read_fso_isDir_size_permissions(fso);
-        new_files.push_back(fso);
-    }
-}
-
-void extract_old_fso_info(const fs::path& output_file, std::vector<filesystem_object>& old_files) {
-    std::ifstream in(output_file, std::ios::binary);
-    if (!in) {
-        throw_u8string_error(u8"falied to open " + output_file.u8string() + u8" for reading");
-    }
-
-    uint32_t num_objects;
-    in.read(reinterpret_cast<char*>(&num_objects), sizeof(num_objects));
-
-    for (int i = 0; i < num_objects; i++) {
-        filesystem_object fso;
-        in.read(reinterpret_cast<char*>(&fso.isDir), sizeof(fso.isDir));
-
-        uint32_t filename_len;
-        in.read(reinterpret_cast<char*>(&filename_len), sizeof(filename_len));
-
-        std::string utf8_str;
-        utf8_str.resize(filename_len);
-        in.read(utf8_str.data(), filename_len);
-#if defined(OS_WIN)
-        std::replace(utf8_str.begin(), utf8_str.end(), u8'/', u8'\\');
-        fs::path u8path = fs::u8path(utf8_str);
-        fso.filename = fs::path(u8path.wstring());
-
-#elif defined(OS_LINUX)
-        fso.filename = fs::u8path(utf8_str);
-#endif
-
-        in.read(reinterpret_cast<char*>(&fso.win_permissions), sizeof(fso.win_permissions));
-        in.read(reinterpret_cast<char*>(&fso.linux_permissions), sizeof(fso.linux_permissions));
-        in.read(reinterpret_cast<char*>(&fso.file_size), sizeof(fso.file_size));
-
-        old_files.push_back(fso);
-    }
-    if (!in) {
-        throw_u8string_error(u8"error reading from file (possibly incorrect data format): " + output_file.u8string());
-    }
-
-    in.close();
-}
-
-void write_fso_map_to_file(const fs::path& output_file, const std::vector<filesystem_object>& fso_v) {
-    std::ofstream out(output_file, std::ios::binary | std::ios::trunc);
-    if (!out) {
-        throw_u8string_error(u8"failed to open " + output_file.u8string() + u8" for writing");
-    }
-    uint32_t num_objects = static_cast<uint32_t>(fso_v.size());
-    out.write(reinterpret_cast<const char*>(&num_objects), sizeof(num_objects));
-
-    for (const auto& fso : fso_v) {
-        out.write(reinterpret_cast<const char*>(&fso.isDir), sizeof(fso.isDir));
-
-
-        uint32_t filename_len_bytes = static_cast<uint32_t>(fso.filename.u8string().size());
-        out.write(reinterpret_cast<const char*>(&filename_len_bytes), sizeof(filename_len_bytes));
-        auto u8str = fso.filename.u8string();
-
-#if defined(OS_WIN)
-        std::replace(u8str.begin(), u8str.end(), u8'\\', u8'/');
-#endif
-        out.write(reinterpret_cast<const char*>(&(u8str[0])), filename_len_bytes);
-
-        out.write(reinterpret_cast<const char*>(&fso.win_permissions), sizeof(fso.win_permissions));
-        out.write(reinterpret_cast<const char*>(&fso.linux_permissions), sizeof(fso.linux_permissions));
-        out.write(reinterpret_cast<const char*>(&fso.file_size), sizeof(fso.file_size));
-    }
-
-    for (const auto& fso : fso_v) {
-        if (!fso.isDir && fso.file_size > 0) {
-            std::ifstream in(fso.full_path, std::ios::binary);
-            if (!in) {
-                throw_u8string_error(u8"failed to open source file: " + fso.full_path.u8string());
-            }            
-            if (!(out << in.rdbuf()))
-                throw_u8string_error(u8"failed to write " + fso.full_path.u8string() + u8" data to " + output_file.u8string());
-        }
-    }
-}
-
-void create_files(const std::vector<filesystem_object>& fso_v,
-    fs::path serialized_file_path, fs::path output_dir_path) {
-
-
-    std::ifstream serialized_file(serialized_file_path, std::ios::binary);
-    if (!serialized_file) {
-        throw_u8string_error(u8"failed to open " + serialized_file_path.u8string());
-    }
-
-    uint32_t num_fsos;
-    serialized_file.read(reinterpret_cast<char*>(&num_fsos), sizeof(num_fsos));
-
-    // data begins (4 + (1+4+filename_len+4+4+8)*num_fsos)
-    size_t data_offset = sizeof(num_fsos);
-    for (uint32_t i = 0; i < num_fsos; ++i) {
-        uint8_t isDir;
-        uint32_t filename_len;
-        serialized_file.read(reinterpret_cast<char*>(&isDir), sizeof(isDir));
-        serialized_file.read(reinterpret_cast<char*>(&filename_len), sizeof(filename_len));
-
-        serialized_file.seekg(filename_len + sizeof(uint32_t) * 2 + sizeof(uint64_t), std::ios::cur);
-        data_offset += sizeof(isDir) + sizeof(filename_len) + filename_len + sizeof(uint32_t) * 2 + sizeof(uint64_t);
-    }
-
-    for (const auto& fso : fso_v) {
-        try {
-            fs::path new_file_path = output_dir_path / fso.filename;
-
-            if (fs::exists(new_file_path)) {
-                throw_u8string_error(u8"can't deserialize " + new_file_path.u8string() + u8" because it already exists");
-            }
-
-#if defined(OS_WIN)  
-            std::wstring widePath = new_file_path.wstring();
-            LPWSTR output_file_path = (LPWSTR)(widePath.c_str());
-
-            if (!fso.isDir && !CreateFileWithInheritanceWin(output_file_path)) {
-                throw_u8string_error(u8"failed to create file " + new_file_path.u8string());
-            }
-
-            if (fso.isDir) {
-                if (!CreateDirectoryWithInheritedPermissions(output_file_path)) {
-                    throw_u8string_error(u8"failed to create folder " + new_file_path.u8string());
-                }
-            }
-            addToLog(u8"created " + (output_dir_path / fso.filename).u8string());
-
-            if (!fso.isDir) {
-                std::ofstream output_file(output_file_path, std::ios::binary);
-                if (!output_file) {
-                    throw_u8string_error(u8"failed to open " + new_file_path.u8string());
-                }
-
-                std::vector<char> buffer(fso.file_size);
-                serialized_file.read(buffer.data(), fso.file_size);
-                output_file.write(buffer.data(), fso.file_size);
-                output_file.close();
-                addToLog(u8"wrote data to " + new_file_path.u8string());
-            }
-            
-            if (fso.win_permissions != 0){
-                if (!SetCurrentUserPermissionsWin(output_file_path, fso.win_permissions)) {
-                    throw_u8string_error(u8"failed to set permissions for " + new_file_path.u8string());
-                }
-                addToLog(u8"set permissions for " + new_file_path.u8string());
-            } else {    
-                addToLog(u8"no permissions found for windows operating system for file" + new_file_path.u8string());
-                addToLog(u8"created file with default permissions on your machine");
-            }
-
-            
+// counters of a running serialize/deserialize for a progress display on another thread.
+// the totals are set once the scan (serialize) or the index (deserialize) is known.
+struct kser_progress {
+    std::atomic<uint64_t> entries_total{0};
+    std::atomic<uint64_t> entries_done{0};
+    std::atomic<uint64_t> bytes_total{0};
+    std::atomic<uint64_t> bytes_done{0};
+    // set from another thread: the run stops before its next entry and throws kser_cancelled
+    std::atomic<bool> cancel{false};
+};
 
-#elif defined(OS_LINUX)
-            if (fso.isDir) {
-                if (mkdir(reinterpret_cast<const char*>(&(new_file_path.u8string()[0])), 0777) == -1){
-                    throw_u8string_error(u8"failed to create dir " +  new_file_path.u8string());
-                }
-            } else {
-                std::ofstream file(new_file_path);
-                if (!file) throw_u8string_error(u8"failed to create " +  new_file_path.u8string());
-                file.close();
-            }
+// thrown when a run was cancelled through kser_progress. serialize has removed the partial
+// archive by then (or cut an incremental append off again); deserialize leaves the entries
+// it already extracted.
+class kser_cancelled : public std::runtime_error {
+public:
+    kser_cancelled() : std::runtime_error("cancelled") {}
+};
 
-            if (!fso.isDir) {
-                std::ofstream output_file(new_file_path, std::ios::binary);
-                if (!output_file) {
-                    throw_u8string_error(u8"failed to open " + new_file_path.u8string());
-                }
+class kser_stats;
+
+struct kser_options {
+    // worker threads for the directory scan, compression and extraction, 0 = one per hardware thread
+    unsigned threads = 0;
+    // on linux scan with getdents64 and one statx per entry instead of std::filesystem
+    bool fast_scan = true;
+    // codec for file payloads; files that don't compress are stored raw either way
+    kser_codec compression = kser_codec::klz;
+    // store identical payloads once; hard links are restored as hard links
+    bool dedup = false;
+    // keep the payloads of files that are unchanged (size, mtime, inode) since the previous
+    // archive at the output path and append only the changed ones plus a new index
+    bool incremental = false;
+    // write only the index, without any file data (kser_archive_metadata_only). such an archive
+    // can't be extracted, only applied onto an existing tree with apply_permissions
+    bool metadata_only = false;
+    kser_io_backend io = kser_io_backend::automatic;
+    // counters to update and the cancel flag to check, nullptr for none
+    kser_progress* progress = nullptr;
+    // phase timers, counters and per-file times to fill in (kser_stats.h), nullptr for none
+    kser_stats* stats = nullptr;
+};
 
-                std::vector<char> buffer(fso.file_size);
-                serialized_file.read(buffer.data(), fso.file_size);
-                output_file.write(buffer.data(), fso.file_size);
-                output_file.close();
-                addToLog(u8"wrote data to " + new_file_path.u8string());
-            }
-            
-            if (fso.linux_permissions != 0){
-                fs::permissions(new_file_path, static_cast<fs::perms>(fso.linux_permissions));
-                addToLog(u8"set permissions for " + new_file_path.u8string());
-            } else {
-                addToLog(u8"no permissions found for linux operating system for file " + new_file_path.u8string());
-                addToLog(u8"created file with deault permissions mask");
-            }
+void throw_u8string_error(std::u8string s);
+// adds done entries and bytes to options.progress and options.stats
+void report_progress(const kser_options& options, uint64_t entries, uint64_t bytes);
+// throws kser_cancelled once options.progress asks for it
+void check_cancelled(const kser_options& options);
+
+
+// reads type, size and the current system's permissions of entry i from disk
+void read_fso_isDir_size_permissions(entry_table& files, size_t i);
+// appends everything below directory_path to new_files, whose root must be its parent.
+// returns the number of syscalls the scan made
+uint64_t process_directory(const fs::path& directory_path,
+                           entry_table& new_files,
+                           const kser_options& options = {});
+void extract_old_fso_info(const fs::path& output_file_name, entry_table& old_files);
+class KserView;
+// previous is the archive currently at output_file_name, used by incremental serialize.
+// returns the number of files whose payload was kept from it
+uint64_t write_fso_map_to_file(const fs::path& output_file_name, const entry_table& fso_v,
+                               const kser_options& options = {}, const KserView* previous = nullptr);
+void create_files(const KserView& view, fs::path output_dir_path, const kser_options& options = {});
+
+run_summary serialize(fs::path input_path, fs::path output_path, const kser_options& options = {});
+run_summary deserialize(fs::path input_file_name, fs::path output_file_path, const kser_options& options = {});
+// checks the index and every payload of an archive against their checksums on the pool,
+// without extracting anything. throws at the first damaged entry
+run_summary verify(fs::path input_file_name, const kser_options& options = {});
+// sets the permissions in the archive on the tree that already exists in output_dir_path, like
+// the one deserialize would create there, without reading or writing any file data. entries
+// whose permissions already match are left alone, entries missing from the tree are skipped
+// with a warning. works with any archive, metadata-only ones included
+run_summary apply_permissions(fs::path input_file_name, fs::path output_dir_path, const kser_options& options = {});
+
+// streaming archives (see kser_format.h) are written and read strictly in order, so out and in
+// may be pipes. name is how the input is called in messages. deserialize and verify of a
+// streaming archive file end up here too. archive_bytes counts what was read; serialize_stream
+// leaves it 0 because out may not be a file
+run_summary serialize_stream(fs::path input_path, std::ostream& out, const kser_options& options = {});
+run_summary deserialize_stream(std::istream& in, const std::u8string& name, fs::path output_dir_path,
+                               const kser_options& options = {});
+run_summary verify_stream(std::istream& in, const std::u8string& name, const kser_options& options = {});
+run_summary apply_permissions_stream(std::istream& in, const std::u8string& name, fs::path output_dir_path,
+                                     const kser_options& options = {});
 
-            
 #endif
-        }
-        catch (const std::exception& e) {
-            throw std::runtime_error(std::string("Failed to process file '") +
-                fso.filename.string() + "': " + e.what());
-        }
-    }
-}
-
-void serialize(fs::path input_path, fs::path output_path) {
-    std::vector<filesystem_object> fso_v;
-    if (fs::file_size(output_path) != 0)
-        extract_old_fso_info(output_path, fso_v);
-
-    std::unordered_map<fs::path, filesystem_object> fso_map;
-    for (const auto& fso : fso_v) {
-        fso_map[fso.filename] = fso;
-    }
-
-    fso_v.clear();
-
-    //first object (start dir or only file)
-    filesystem_object first_fso;
-    first_fso.filename = input_path.filename();
-    first_fso.full_path = input_path;
-    fill_other_system_permissions(first_fso, fso_map);
-    read_fso_isDir_size_permissions(first_fso);
-    fso_v.push_back(first_fso);
-
-
-
-    if (fs::is_directory(input_path)) {
-        process_directory(input_path, fso_map, fso_v);
-    }
-
-    std::sort(fso_v.begin(), fso_v.end(),
-        [](const filesystem_object& a, const filesystem_object& b) {
-            return a.filename < b.filename; });
-
-    addToLog(u8"serializing...");
-    write_fso_map_to_file(output_path, fso_v);
-}
-
-void deserialize(fs::path input_file_name, fs::path output_file_path) {
-    std::vector<filesystem_object> fso_v;
-    extract_old_fso_info(input_file_name, fso_v);
-    addToLog(u8"extracted permissions...");
-    create_files(fso_v, input_file_name, output_file_path);
-}
-
-#endif
\ No newline at end of file
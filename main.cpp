@@ -10,16 +10,28 @@
 #include <FL/fl_ask.H>
 #include <FL/Fl_Text_Editor.H>
 #include <FL/Fl_Text_Buffer.H>
+#include <FL/Fl_Progress.H>
 
 #include <string> 
+#include <fstream>
 #include <filesystem>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include "kserialize.h"
+#include "kser_stats.h"
 
 namespace fs = std::filesystem;
 
 Fl_Input* input = nullptr;
 Fl_Input* output = nullptr;
 Fl_Button* action_button = nullptr;
+Fl_Button* cancel_button = nullptr;
+Fl_Progress* progress_bar = nullptr;
 Fl_Choice* input_mode = nullptr;
 Fl_Choice* output_mode = nullptr;
 Fl_Check_Button* serialize_btn = nullptr;
@@ -27,11 +39,44 @@ Fl_Check_Button* deserialize_btn = nullptr;
 Fl_Text_Buffer* log_buffer = nullptr;
 Fl_Text_Editor* log_editor = nullptr;
 
-void addToLog(std::u8string message);
-
-void throw_u8string_error(std::u8string s) {
-    throw std::runtime_error(std::string(reinterpret_cast<const char*>(&s[0])));
-}
+// the engine only pushes its messages into gui_log. a timer moves them into the log view a
+// batch at a time, so logging every file costs the engine no redraws.
+constexpr double log_poll_seconds = 0.1;
+// the view keeps the last lines only, the whole log goes to log_file
+constexpr int log_view_max_lines = 5000;
+log_queue gui_log;
+std::ofstream log_file;
+int log_view_lines = 0;
+
+void drain_log(void*);
+
+// a serialize or deserialize waiting for the worker thread. paths are checked and questions
+// asked when it is queued, the worker only runs it.
+struct job {
+    bool serialize = true;
+    fs::path input_path;
+    fs::path output_path;
+    // the .kser was created for this job and is removed again if the job doesn't finish
+    bool created_output = false;
+};
+
+// jobs run one after another on job_thread. the ui thread queues them and shows the
+// progress of the running one from a timer.
+std::thread job_thread;
+std::mutex jobs_mutex;
+std::condition_variable jobs_changed;
+std::deque<job> pending_jobs;
+bool shutting_down = false;
+bool job_running = false;
+std::u8string running_job_name;
+std::chrono::steady_clock::time_point job_start;
+// errors of finished jobs, shown by the ui thread
+std::deque<std::string> job_errors;
+kser_progress job_progress;
+
+void job_worker();
+void update_progress(void*);
+void queue_job(job next);
 
 void mode_callback(Fl_Widget* w, void* data) {
     Fl_Check_Button* b = (Fl_Check_Button*)w;
@@ -84,6 +129,7 @@ void action_callback(Fl_Widget* w, void*) {
             }   
 
             fs::path kser_file_path;
+            bool created_output = false;
             if (fs::is_directory(output_path)) {
                 kser_file_path = output_path / input_path.filename();
                 kser_file_path.replace_extension(".kser");
@@ -108,6 +154,7 @@ void action_callback(Fl_Widget* w, void*) {
                 }
                 outfile.close();
                 addToLog(u8"Created file " + kser_file_path.u8string());
+                created_output = true;
             }
             else {
                 if (output_path.extension() != ".kser") {
@@ -116,8 +163,7 @@ void action_callback(Fl_Widget* w, void*) {
                 }
                 kser_file_path = output_path;
             }
-            serialize(input_path, kser_file_path);
-            addToLog(u8"successfully serialized " + input_path.u8string() + u8" into " + output_path.u8string());
+            queue_job({ true, input_path, kser_file_path, created_output });
         }
         else if (deserialize_btn && deserialize_btn->value()) {
             if (input_path.native().empty()) {
@@ -153,9 +199,7 @@ void action_callback(Fl_Widget* w, void*) {
                 fl_alert("output path does not exist on this system");
                 return;
             }
-            deserialize(input_path, output_path);
-            
-            addToLog(u8"successfully deserialized " + input_path.u8string() + u8" into " + output_path.u8string());
+            queue_job({ false, input_path, output_path, false });
         }
         else {
             //unreachable
@@ -167,6 +211,14 @@ void action_callback(Fl_Widget* w, void*) {
     }
 }
 
+void cancel_callback(Fl_Widget* w, void*) {
+    std::lock_guard<std::mutex> lock(jobs_mutex);
+    if (job_running) {
+        job_progress.cancel = true;
+        addToLog(u8"cancelling " + running_job_name + u8"...");
+    }
+}
+
 int main(int argc, char** argv) {
     Fl_Window* window = new Fl_Window(800, 600, "Permissions Zipper");
 
@@ -216,24 +268,231 @@ int main(int argc, char** argv) {
     output_browse->callback(browse_callback);
     action_button ->callback(action_callback);
 
+    cancel_button = new Fl_Button(360, 290, 100, 40, "Cancel");
+    cancel_button->callback(cancel_callback);
+    cancel_button->deactivate();
+
+    progress_bar = new Fl_Progress(20, 345, 760, 30);
+    progress_bar->minimum(0);
+    progress_bar->maximum(1);
+    progress_bar->value(0);
+
 
     log_buffer = new Fl_Text_Buffer();
-    log_editor = new Fl_Text_Editor(20, 350, 760, 200, "Log");
+    log_editor = new Fl_Text_Editor(20, 390, 760, 180, "Log");
     log_editor->buffer(log_buffer);
     log_editor->textfont(FL_COURIER);
     log_editor->scrollbar_width(15);
 
+    fs::path log_path = fs::temp_directory_path() / "kser_gui.log";
+    log_file.open(log_path, std::ios::trunc);
+    if (log_file) {
+        log_buffer->append(reinterpret_cast<const char*>((u8"full log: " + log_path.u8string() + u8"\n").c_str()));
+        log_view_lines = 1;
+    }
+    set_log_level(log_level::debug);
+    set_log_queue(&gui_log);
+    Fl::add_timeout(log_poll_seconds, drain_log);
+    Fl::add_timeout(log_poll_seconds, update_progress);
+    job_thread = std::thread(job_worker);
+
     window->end();
     window->show(argc, argv);
-    return Fl::run();
+    int result = Fl::run();
+
+    // the window was closed: queued jobs are dropped, the running one is cancelled
+    {
+        std::lock_guard<std::mutex> lock(jobs_mutex);
+        shutting_down = true;
+        pending_jobs.clear();
+        job_progress.cancel = true;
+    }
+    jobs_changed.notify_all();
+    job_thread.join();
+    set_log_queue(nullptr);
+    return result;
 }
 
-void addToLog(std::u8string message) {
-    message += u8"\n";
-    if (log_buffer && log_editor) {
-        log_buffer->append(reinterpret_cast<const char*>(&message[0]));
+void queue_job(job next) {
+    std::u8string name = next.input_path.filename().u8string();
+    {
+        std::lock_guard<std::mutex> lock(jobs_mutex);
+        pending_jobs.push_back(std::move(next));
+    }
+    jobs_changed.notify_one();
+    addToLog(u8"queued " + name);
+}
+
+// the stats of a finished job, a log line per line of the report
+static void log_stats(const kser_stats& stats) {
+    std::string summary = stats.summary();
+    size_t begin = 0;
+    while (begin < summary.size()) {
+        size_t end = summary.find('\n', begin);
+        if (end == std::string::npos) {
+            end = summary.size();
+        }
+        addToLog(std::u8string(summary.begin() + begin, summary.begin() + end));
+        begin = end + 1;
+    }
+}
+
+static void run_job(const job& current) {
+    kser_stats stats;
+    kser_options options;
+    options.progress = &job_progress;
+    options.stats = &stats;
+    try {
+        if (current.serialize) {
+            serialize(current.input_path, current.output_path, options);
+            addToLog(u8"successfully serialized " + current.input_path.u8string() + u8" into " + current.output_path.u8string());
+        }
+        else {
+            deserialize(current.input_path, current.output_path, options);
+            addToLog(u8"successfully deserialized " + current.input_path.u8string() + u8" into " + current.output_path.u8string());
+        }
+        log_stats(stats);
+        return;
+    }
+    catch (const kser_cancelled&) {
+        addToLog(log_level::warning, u8"cancelled " + current.input_path.u8string());
+    }
+    catch (const std::exception& e) {
+        std::string what = e.what();
+        addToLog(log_level::error, std::u8string(what.begin(), what.end()));
+        std::lock_guard<std::mutex> lock(jobs_mutex);
+        job_errors.push_back(what);
+    }
+    if (current.created_output) {
+        std::error_code ec;
+        fs::remove(current.output_path, ec);
+    }
+}
+
+void job_worker() {
+    for (;;) {
+        job current;
+        {
+            std::unique_lock<std::mutex> lock(jobs_mutex);
+            jobs_changed.wait(lock, [] { return shutting_down || !pending_jobs.empty(); });
+            if (shutting_down) {
+                return;
+            }
+            current = std::move(pending_jobs.front());
+            pending_jobs.pop_front();
+            job_progress.entries_total = 0;
+            job_progress.entries_done = 0;
+            job_progress.bytes_total = 0;
+            job_progress.bytes_done = 0;
+            job_progress.cancel = false;
+            job_running = true;
+            running_job_name = (current.serialize ? u8"serializing " : u8"deserializing ") + current.input_path.filename().u8string();
+            job_start = std::chrono::steady_clock::now();
+        }
+        run_job(current);
+        std::lock_guard<std::mutex> lock(jobs_mutex);
+        job_running = false;
+    }
+}
+
+// fills the progress bar from the counters of the running job: done fraction (by bytes,
+// by entries while no bytes are known), average MB/s and files/s since the job started and
+// the time left at that rate
+void update_progress(void*) {
+    Fl::repeat_timeout(log_poll_seconds, update_progress);
+    // fl_alert runs a nested event loop in which this timer keeps firing
+    static bool showing_error = false;
+
+    std::string status;
+    float fraction = 0;
+    std::string error;
+    {
+        std::lock_guard<std::mutex> lock(jobs_mutex);
+        if (job_running) {
+            uint64_t entries_total = job_progress.entries_total;
+            uint64_t entries_done = job_progress.entries_done;
+            uint64_t bytes_total = job_progress.bytes_total;
+            uint64_t bytes_done = job_progress.bytes_done;
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - job_start).count();
+
+            status.assign(running_job_name.begin(), running_job_name.end());
+            char text[128];
+            if (entries_total == 0) {
+                std::snprintf(text, sizeof(text), ": scanning for %.0f s", seconds);
+                status += text;
+            }
+            else {
+                fraction = static_cast<float>(bytes_total > 0 ? static_cast<double>(bytes_done) / bytes_total
+                    : static_cast<double>(entries_done) / entries_total);
+                double bytes_per_second = seconds > 0 ? bytes_done / seconds : 0;
+                double files_per_second = seconds > 0 ? entries_done / seconds : 0;
+                std::snprintf(text, sizeof(text), ": %.0f%%  %.1f MB/s  %.0f files/s", fraction * 100.0,
+                    bytes_per_second / 1e6, files_per_second);
+                status += text;
+                if (bytes_per_second > 0 && bytes_total > bytes_done) {
+                    std::snprintf(text, sizeof(text), "  about %.0f s left", (bytes_total - bytes_done) / bytes_per_second);
+                    status += text;
+                }
+            }
+            if (job_progress.cancel) {
+                status += "  (cancelling)";
+            }
+        }
+        if (!pending_jobs.empty()) {
+            status += (status.empty() ? "" : ", ") + std::to_string(pending_jobs.size()) + " queued";
+        }
+        if (!job_errors.empty() && !showing_error) {
+            error = std::move(job_errors.front());
+            job_errors.pop_front();
+        }
+        if (job_running) {
+            cancel_button->activate();
+        }
+        else {
+            cancel_button->deactivate();
+        }
+    }
+
+    progress_bar->value(fraction);
+    progress_bar->copy_label(status.c_str());
+
+    if (!error.empty()) {
+        showing_error = true;
+        fl_alert("ERROR: %s", error.c_str());
+        showing_error = false;
+    }
+}
+
+void drain_log(void*) {
+    std::string chunk;
+    int lines = 0;
+    gui_log.drain([&](log_level level, std::u8string& message) {
+        if (level >= log_level::warning) {
+            chunk += log_level_name(level);
+            chunk += ": ";
+        }
+        chunk.append(reinterpret_cast<const char*>(message.data()), message.size());
+        chunk += '\n';
+        lines++;
+    });
+    if (uint64_t dropped = gui_log.take_dropped()) {
+        chunk += "... " + std::to_string(dropped) + " messages dropped, the log couldn't keep up\n";
+        lines++;
+    }
+
+    if (!chunk.empty()) {
+        if (log_file) {
+            log_file << chunk;
+            log_file.flush();
+        }
+        log_buffer->append(chunk.c_str());
+        log_view_lines += lines;
+        if (log_view_lines > log_view_max_lines) {
+            log_buffer->remove(0, log_buffer->skip_lines(0, log_view_lines - log_view_max_lines));
+            log_view_lines = log_view_max_lines;
+        }
         log_editor->insert_position(log_buffer->length());
         log_editor->show_insert_position();
-        Fl::check();
     }
-}
\ No newline at end of file
+    Fl::repeat_timeout(log_poll_seconds, drain_log);
+}